@@ -0,0 +1,129 @@
+#include "batch.hpp"
+#include <algorithm>
+
+namespace layer {
+	
+	const size_t BatchPipeline::default_slots;
+	
+	BatchPipeline::BatchPipeline(Layer &root, Layer &input, size_t slots, size_t threads) :
+			m_root(root), m_input(input), m_transfer(root.context().queue(pr_transfer)), m_compute(root.context().queue(pr_background)),
+			m_pool(std::max<size_t>(threads, 2)), m_wall(0), m_skipped(0) {
+		mcl::Context c = root.context().mcl_context();
+		slots = std::max<size_t>(slots, 1);
+		for(size_t i=0; i<slots; i++) {
+			std::shared_ptr<Slot> s(new Slot(root));
+			if(!s->plan.has_slot(&input))
+				throw NotFoundException(std::string("input:") + input.class_name());
+			s->plan.allocate(c);
+			s->executor.reset(new Executor(s->plan, m_compute));
+			m_slots.push_back(s);
+			m_free.push_back(s.get());
+		}
+		std::fill(m_busy, m_busy+st_count, 0.0);
+		std::fill(m_done, m_done+st_count, 0);
+	}
+	
+	const char *BatchPipeline::stage_name(stage_t s) {
+		static const char *names[] = { "decode", "upload", "compute", "download", "encode" };
+		return names[s];
+	}
+	
+	BatchPipeline::Slot *BatchPipeline::acquire() {
+		boost::unique_lock<boost::mutex> lk(m_mutex);
+		m_free_cond.wait(lk, [this]{ return !m_free.empty(); });
+		Slot *s = m_free.back();
+		m_free.pop_back();
+		return s;
+	}
+	
+	void BatchPipeline::release(Slot *s) {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		m_free.push_back(s);
+		m_free_cond.notify_one();
+	}
+	
+	void BatchPipeline::finished(stage_t s, const boost::posix_time::ptime &started) {
+		boost::posix_time::time_duration d = boost::posix_time::microsec_clock::universal_time() - started;
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		m_busy[s] += d.total_microseconds()/1e6;
+		m_done[s]++;
+	}
+	
+	void BatchPipeline::process(size_t index, const decode_t &decode, const encode_t &encode) {
+		using boost::posix_time::microsec_clock;
+		boost::posix_time::ptime t = microsec_clock::universal_time();
+		Frame in;
+		decode(index, in);
+		finished(st_decode, t);
+		if(in.pixels.empty()) {
+			boost::lock_guard<boost::mutex> lk(m_mutex);
+			m_skipped++;
+			return;
+		}
+		
+		Frame out;
+		Slot *s = acquire();
+		try {
+			Storage ist = s->plan.storage(&m_input), ost = s->plan.storage(&m_root);
+			if(in.pixels.size()!=ist.size)
+				throw mcl::Error(CL_INVALID_VALUE);
+			t = microsec_clock::universal_time();
+			if(ist.kind==Storage::sk_image)
+				m_transfer.write(in.pixels.data(), s->plan.image(&m_input)).wait();
+			else
+				m_transfer.write(in.pixels.data(), s->plan.buffer(&m_input)).wait();
+			finished(st_upload, t);
+			
+			t = microsec_clock::universal_time();
+			std::vector<mcl::Event> done;
+			{
+				boost::lock_guard<boost::mutex> lk(m_compute_mutex);
+				done = s->executor->run();
+			}
+			for(auto i = done.begin(); i!=done.end(); i++)
+				i->wait();
+			finished(st_compute, t);
+			
+			t = microsec_clock::universal_time();
+			out.width = ost.width;
+			out.height = ost.height;
+			out.pixels.resize(ost.size);
+			if(ost.kind==Storage::sk_image)
+				m_transfer.read(s->plan.image(&m_root), out.pixels.data()).wait();
+			else
+				m_transfer.read(s->plan.buffer(&m_root), out.pixels.data()).wait();
+			finished(st_download, t);
+		} catch(...) {
+			release(s);
+			throw;
+		}
+		release(s);
+		
+		t = microsec_clock::universal_time();
+		encode(index, out);
+		finished(st_encode, t);
+	}
+	
+	void BatchPipeline::run(size_t count, const decode_t &decode, const encode_t &encode) {
+		boost::posix_time::ptime started = boost::posix_time::microsec_clock::universal_time();
+		for(size_t i=0; i<count; i++)
+			m_pool.post([this, i, decode, encode]() { process(i, decode, encode); });
+		try {
+			m_pool.wait();
+		} catch(...) {
+			m_wall += (boost::posix_time::microsec_clock::universal_time() - started).total_microseconds()/1e6;
+			throw;
+		}
+		m_wall += (boost::posix_time::microsec_clock::universal_time() - started).total_microseconds()/1e6;
+	}
+	
+	void BatchPipeline::report(std::ostream &s) const {
+		s << "Batch: " << m_done[st_encode] << " items, " << m_skipped << " skipped, " << m_slots.size() << " slots, " << m_pool.size() << " threads" << std::endl;
+		s << "\twall: " << m_wall << " s";
+		if(m_wall>0)
+			s << ", " << m_done[st_encode]/m_wall << " items/s";
+		s << std::endl;
+		for(int i=0; i<st_count; i++)
+			s << "\t" << stage_name(stage_t(i)) << ": " << m_busy[i] << " s, " << throughput(stage_t(i)) << " items/s" << std::endl;
+	}
+}
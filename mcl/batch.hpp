@@ -0,0 +1,68 @@
+#ifndef MAY_BATCH_HPP
+#define MAY_BATCH_HPP
+
+#include "execute.hpp"
+#include "pool.hpp"
+#include <vector>
+#include <memory>
+#include <functional>
+#include <boost/thread.hpp>
+
+namespace layer {
+	
+	// pushes many inputs through one graph, each image in flight has its own device buffers
+	// so decoding, transfers, kernels and encoding of neighbouring images overlap
+	class BatchPipeline {
+	public:
+		struct Frame {
+			size_t width;
+			size_t height;
+			std::vector<char> pixels; // laid out as the storage of the input or root layer
+			Frame() : width(0), height(0) {}
+		};
+		// the decoder skips an item by leaving its frame empty, it is not computed nor encoded
+		typedef std::function<void(size_t, Frame &)> decode_t;
+		typedef std::function<void(size_t, const Frame &)> encode_t;
+		enum stage_t { st_decode, st_upload, st_compute, st_download, st_encode, st_count };
+		static const size_t default_slots = 3;
+	private:
+		struct Slot {
+			MemoryPlan plan;
+			std::shared_ptr<Executor> executor;
+			Slot(Layer &root) : plan(root) {}
+		};
+		Layer &m_root;
+		Layer &m_input;
+		mcl::Queue m_transfer;
+		mcl::Queue m_compute;
+		std::vector<std::shared_ptr<Slot>> m_slots;
+		std::vector<Slot *> m_free;
+		WorkerPool m_pool;
+		double m_busy[st_count]; // seconds
+		size_t m_done[st_count];
+		double m_wall;
+		size_t m_skipped;
+		boost::mutex m_mutex;
+		boost::mutex m_compute_mutex; // kernel arguments of the graph are shared by the slots
+		boost::condition_variable m_free_cond;
+		Slot *acquire();
+		void release(Slot *);
+		void process(size_t, const decode_t &, const encode_t &);
+		void finished(stage_t, const boost::posix_time::ptime &started);
+	public:
+		BatchPipeline(Layer &root, Layer &input, size_t slots=default_slots, size_t threads=WorkerPool::default_size());
+		// decodes, computes and encodes count items, rethrows the first failure
+		void run(size_t count, const decode_t &, const encode_t &);
+		
+		static const char *stage_name(stage_t);
+		size_t processed(stage_t s) const { return m_done[s]; }
+		size_t skipped() const { return m_skipped; }
+		double busy(stage_t s) const { return m_busy[s]; }
+		// items per second of stage time, the slowest stage bounds the pipeline
+		double throughput(stage_t s) const { return m_busy[s]>0 ? m_done[s]/m_busy[s] : 0; }
+		double wall() const { return m_wall; }
+		void report(std::ostream &) const;
+	};
+}
+
+#endif // MAY_BATCH_HPP
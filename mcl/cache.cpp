@@ -0,0 +1,121 @@
+#include "cache.hpp"
+#include <vector>
+
+namespace layer {
+	
+	const size_t ResultCache::default_share;
+	
+	Region Region::intersected(const Region &r) const {
+		size_t l = std::max(x, r.x), t = std::max(y, r.y);
+		size_t rt = std::min(right(), r.right()), b = std::min(bottom(), r.bottom());
+		if(l>=rt || t>=b)
+			return Region(l, t, 0, 0);
+		return Region(l, t, rt-l, b-t);
+	}
+	
+	Region Region::united(const Region &r) const {
+		if(is_empty())
+			return r;
+		if(r.is_empty())
+			return *this;
+		size_t l = std::min(x, r.x), t = std::min(y, r.y);
+		return Region(l, t, std::max(right(), r.right())-l, std::max(bottom(), r.bottom())-t);
+	}
+	
+	Region Region::dilated(size_t n) const {
+		if(is_empty())
+			return *this;
+		size_t l = x>n ? x-n : 0, t = y>n ? y-n : 0;
+		size_t rt = right(), b = bottom();
+		const size_t max = std::numeric_limits<size_t>::max();
+		rt = rt>max-n ? max : rt+n;
+		b = b>max-n ? max : b+n;
+		return Region(l, t, rt-l, b-t);
+	}
+	
+	Region Region::reduced(size_t n) const {
+		if(n<=1 || is_empty() || is_everything())
+			return *this;
+		size_t rt = right(), b = bottom();
+		rt = rt/n + (rt%n ? 1 : 0);
+		b = b/n + (b%n ? 1 : 0);
+		return Region(x/n, y/n, rt-x/n, b-y/n);
+	}
+	
+	void ResultCache::evict(size_t needed, dropped_t &dropped) {
+		while(!m_order.empty() && m_size+needed>m_budget) {
+			auto i = m_entries.find(m_order.front());
+			m_size -= i->second.first.size;
+			dropped.push_back(std::make_pair(i->first, i->second.first));
+			m_entries.erase(i);
+			m_order.pop_front();
+		}
+	}
+	
+	void ResultCache::report(const dropped_t &dropped) {
+		for(auto i = dropped.begin(); i!=dropped.end(); i++)
+			evicted(i->first, i->second);
+	}
+	
+	bool ResultCache::find(const Key &k, Entry &e) {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		auto i = m_entries.find(k);
+		if(i==m_entries.end()) {
+			m_misses++;
+			return false;
+		}
+		m_hits++;
+		m_order.splice(m_order.end(), m_order, i->second.second);
+		e = i->second.first;
+		return true;
+	}
+	
+	void ResultCache::insert(const Key &k, const Entry &e) {
+		if(e.size>m_budget)
+			return;
+		dropped_t dropped;
+		{
+			boost::lock_guard<boost::mutex> lk(m_mutex);
+			auto i = m_entries.find(k);
+			if(i!=m_entries.end()) {
+				m_size -= i->second.first.size;
+				m_order.erase(i->second.second);
+				m_entries.erase(i);
+			}
+			evict(e.size, dropped);
+			m_order.push_back(k);
+			m_entries.insert(std::make_pair(k, std::make_pair(e, --m_order.end())));
+			m_size += e.size;
+		}
+		report(dropped);
+	}
+	
+	void ResultCache::erase(const Layer *l) {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		for(auto i = m_entries.begin(); i!=m_entries.end();) {
+			if(i->first.layer==l) {
+				m_size -= i->second.first.size;
+				m_order.erase(i->second.second);
+				m_entries.erase(i++);
+			} else
+				i++;
+		}
+	}
+	
+	void ResultCache::clear() {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		m_entries.clear();
+		m_order.clear();
+		m_size = 0;
+	}
+	
+	void ResultCache::set_budget(size_t b) {
+		dropped_t dropped;
+		{
+			boost::lock_guard<boost::mutex> lk(m_mutex);
+			m_budget = b;
+			evict(0, dropped);
+		}
+		report(dropped);
+	}
+}
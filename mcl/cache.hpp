@@ -0,0 +1,124 @@
+#ifndef MAY_CACHE_HPP
+#define MAY_CACHE_HPP
+
+#include "mcl.hpp"
+#include <map>
+#include <list>
+#include <vector>
+#include <memory>
+#include <limits>
+#include <algorithm>
+#include <boost/thread.hpp>
+
+namespace layer {
+	
+	class Layer;
+	
+	// part of a layer output in pixels of the given resolution
+	class Region {
+	public:
+		size_t x;
+		size_t y;
+		size_t width;
+		size_t height;
+		Region() : x(0), y(0), width(0), height(0) {}
+		Region(size_t px, size_t py, size_t w, size_t h) : x(px), y(py), width(w), height(h) {}
+		bool operator<(const Region &r) const {
+			if(x!=r.x) return x<r.x;
+			if(y!=r.y) return y<r.y;
+			if(width!=r.width) return width<r.width;
+			return height<r.height;
+		}
+		bool operator==(const Region &r) const {
+			return x==r.x && y==r.y && width==r.width && height==r.height;
+		}
+		static Region everything() {
+			return Region(0, 0, std::numeric_limits<size_t>::max(), std::numeric_limits<size_t>::max());
+		}
+		bool is_everything() const {
+			return *this==everything();
+		}
+		bool is_empty() const {
+			return width==0 || height==0;
+		}
+		size_t right() const {
+			return width>std::numeric_limits<size_t>::max()-x ? std::numeric_limits<size_t>::max() : x+width;
+		}
+		size_t bottom() const {
+			return height>std::numeric_limits<size_t>::max()-y ? std::numeric_limits<size_t>::max() : y+height;
+		}
+		bool intersects(const Region &r) const {
+			return !is_empty() && !r.is_empty() && x<r.right() && r.x<right() && y<r.bottom() && r.y<bottom();
+		}
+		Region intersected(const Region &r) const;
+		Region united(const Region &r) const;
+		// grown by n pixels on every side
+		Region dilated(size_t n) const;
+		// pixels of an output 1/n of the size covering the region
+		Region reduced(size_t n) const;
+		Region clipped(size_t w, size_t h) const {
+			return intersected(Region(0, 0, w, h));
+		}
+	};
+	
+	// device resident layer outputs, least recently used are evicted first
+	class ResultCache {
+	public:
+		struct Key {
+			const Layer *layer;
+			long long version;
+			Region region;
+			size_t resolution;
+			Key(const Layer *l, long long v, const Region &r, size_t res) : layer(l), version(v), region(r), resolution(res) {}
+			bool operator<(const Key &k) const {
+				if(layer!=k.layer) return layer<k.layer;
+				if(version!=k.version) return version<k.version;
+				if(resolution!=k.resolution) return resolution<k.resolution;
+				return region<k.region;
+			}
+		};
+		struct Entry {
+			std::shared_ptr<mcl::Buffer> buffer;
+			std::shared_ptr<mcl::Image> image;
+			size_t size;
+			mcl::Event ready; // completes when the data is on the device
+			Entry() : size(0) {}
+			Entry(const mcl::Buffer &b) : buffer(new mcl::Buffer(b)), size(b.size()) {}
+			Entry(const mcl::Image &img) : image(new mcl::Image(img)), size(img.element_size()*img.width()*img.height()) {}
+		};
+		static const size_t default_share = 4; // quarter of the device memory
+	private:
+		typedef std::list<Key> order_t;
+		std::map<Key, std::pair<Entry, order_t::iterator>> m_entries;
+		order_t m_order;
+		size_t m_budget;
+		size_t m_size;
+		size_t m_hits;
+		size_t m_misses;
+		boost::mutex m_mutex;
+		typedef std::vector<std::pair<Key, Entry>> dropped_t;
+		// called with the lock held, dropped entries are reported after it is released
+		void evict(size_t, dropped_t &);
+		void report(const dropped_t &);
+	protected:
+		// called without the lock held for every entry dropped to stay within the budget
+		virtual void evicted(const Key &, const Entry &) {}
+	public:
+		ResultCache(size_t budget) : m_budget(budget), m_size(0), m_hits(0), m_misses(0) {}
+		ResultCache(const mcl::Device &d, size_t share=default_share) : m_budget(d.global_mem_size()/share), m_size(0), m_hits(0), m_misses(0) {}
+		virtual ~ResultCache() {}
+		
+		virtual bool find(const Key &, Entry &);
+		virtual void insert(const Key &, const Entry &);
+		virtual void erase(const Layer *);
+		void clear();
+		
+		size_t budget() const { return m_budget; }
+		void set_budget(size_t);
+		size_t size() const { return m_size; }
+		size_t hits() const { return m_hits; }
+		size_t misses() const { return m_misses; }
+	};
+}
+
+#endif // MAY_CACHE_HPP
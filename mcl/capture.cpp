@@ -0,0 +1,358 @@
+#include "capture.hpp"
+#include "mcl.hpp"
+#include <fstream>
+#include <memory>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+namespace mcl {
+	
+	volatile bool Capture::m_active = false;
+	
+	namespace {
+		const char magic[8] = { 'M', 'C', 'L', 'C', 'A', 'P', '0', '1' };
+		
+		boost::mutex capture_mutex;
+		std::ofstream capture_out;
+		std::map<const void *, cl_ulong> capture_ids; // handles are reused after release, creation assigns a new id
+		cl_ulong capture_next = 1;
+		
+		cl_ulong new_id(const void *h) {
+			return capture_ids[h] = capture_next++;
+		}
+		
+		cl_ulong id(const void *h) {
+			auto i = capture_ids.find(h);
+			return i==capture_ids.end() ? 0 : i->second;
+		}
+		
+		void put(cl_ulong v) {
+			capture_out.write(reinterpret_cast<const char *>(&v), sizeof(v));
+		}
+		
+		// op, values, strings and data, sizes as 64 bit integers
+		void record(Capture::op_t op, const std::vector<cl_ulong> &values, const std::vector<std::string> &strings=std::vector<std::string>(), const void *data=0, size_t size=0) {
+			if(!capture_out.is_open())
+				return;
+			char o = op;
+			capture_out.write(&o, 1);
+			put(values.size());
+			for(auto i = values.begin(); i!=values.end(); i++)
+				put(*i);
+			put(strings.size());
+			for(auto i = strings.begin(); i!=strings.end(); i++) {
+				put(i->size());
+				capture_out.write(i->data(), i->size());
+			}
+			put(size);
+			if(size)
+				capture_out.write(static_cast<const char *>(data), size);
+		}
+		
+		void sizes(std::vector<cl_ulong> &v, const size_t *s, size_t n, size_t missing) {
+			for(size_t i=0; i<n; i++)
+				v.push_back(s ? s[i] : missing);
+		}
+	}
+	
+	void Capture::start(const std::string &file) {
+		boost::lock_guard<boost::mutex> lk(capture_mutex);
+		if(capture_out.is_open())
+			capture_out.close();
+		capture_out.clear();
+		capture_out.open(file.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		if(!capture_out)
+			throw Error(CL_INVALID_VALUE);
+		capture_out.write(magic, sizeof(magic));
+		capture_ids.clear();
+		capture_next = 1;
+		m_active = true;
+	}
+	
+	void Capture::stop() {
+		boost::lock_guard<boost::mutex> lk(capture_mutex);
+		m_active = false;
+		if(capture_out.is_open())
+			capture_out.close();
+	}
+	
+	void Capture::program(cl_program p, const std::vector<std::string> &sources) {
+		boost::lock_guard<boost::mutex> lk(capture_mutex);
+		record(op_program, { new_id(p) }, sources);
+	}
+	
+	void Capture::build(cl_program p, const std::string &options) {
+		boost::lock_guard<boost::mutex> lk(capture_mutex);
+		record(op_build, { id(p) }, { options });
+	}
+	
+	void Capture::kernel(cl_kernel k, cl_program p, const std::string &name) {
+		boost::lock_guard<boost::mutex> lk(capture_mutex);
+		record(op_kernel, { new_id(k), id(p) }, { name });
+	}
+	
+	void Capture::buffer(cl_mem m, cl_mem_flags flags, size_t size) {
+		boost::lock_guard<boost::mutex> lk(capture_mutex);
+		record(op_buffer, { new_id(m), flags, size });
+	}
+	
+	void Capture::image(cl_mem m, cl_mem_flags flags, const cl_image_format &f, size_t width, size_t height) {
+		boost::lock_guard<boost::mutex> lk(capture_mutex);
+		record(op_image, { new_id(m), flags, f.image_channel_order, f.image_channel_data_type, width, height });
+	}
+	
+	void Capture::arg(cl_kernel k, cl_uint index, size_t size, const void *value) {
+		boost::lock_guard<boost::mutex> lk(capture_mutex);
+		record(op_arg, { id(k), index }, std::vector<std::string>(), value, size);
+	}
+	
+	void Capture::arg(cl_kernel k, cl_uint index, cl_mem m) {
+		boost::lock_guard<boost::mutex> lk(capture_mutex);
+		record(op_arg_mem, { id(k), index, id(m) });
+	}
+	
+	void Capture::write(cl_mem m, const void *data, size_t size) {
+		boost::lock_guard<boost::mutex> lk(capture_mutex);
+		record(op_write, { id(m) }, std::vector<std::string>(), data, size);
+	}
+	
+	void Capture::write(cl_mem m, const void *data, const size_t *buffer_origin, const size_t *host_origin, const size_t *region, size_t buffer_pitch, size_t host_pitch) {
+		std::vector<cl_ulong> v;
+		v.push_back(0);
+		sizes(v, buffer_origin, 3, 0);
+		sizes(v, region, 3, 1);
+		v.push_back(buffer_pitch);
+		std::vector<char> rows(region[0]*region[1]*region[2]);
+		const char *d = static_cast<const char *>(data);
+		for(size_t z=0; z<region[2]; z++) {
+			for(size_t y=0; y<region[1]; y++) {
+				const char *row = d + host_origin[0] + (host_origin[1] + y + (host_origin[2] + z)*region[1])*host_pitch;
+				std::copy(row, row + region[0], rows.begin() + (y + z*region[1])*region[0]);
+			}
+		}
+		boost::lock_guard<boost::mutex> lk(capture_mutex);
+		v[0] = id(m);
+		record(op_write_rect, v, std::vector<std::string>(), rows.data(), rows.size());
+	}
+	
+	void Capture::read(cl_mem m, size_t size) {
+		boost::lock_guard<boost::mutex> lk(capture_mutex);
+		record(op_read, { id(m), size });
+	}
+	
+	void Capture::ndrange(cl_kernel k, cl_uint dims, const size_t *offset, const size_t *global, const size_t *local) {
+		std::vector<cl_ulong> v;
+		v.push_back(0);
+		v.push_back(dims);
+		v.push_back(local!=NULL);
+		sizes(v, offset, dims, 0);
+		sizes(v, global, dims, 1);
+		sizes(v, local, dims, 1);
+		boost::lock_guard<boost::mutex> lk(capture_mutex);
+		v[0] = id(k);
+		record(op_ndrange, v);
+	}
+	
+	void Capture::copy(cl_mem src, cl_mem dst) {
+		boost::lock_guard<boost::mutex> lk(capture_mutex);
+		record(op_copy, { id(src), id(dst) });
+	}
+	
+	void Capture::copy(cl_mem src, cl_mem dst, const size_t *src_origin, const size_t *dst_origin, const size_t *region, size_t src_pitch, size_t dst_pitch) {
+		std::vector<cl_ulong> v;
+		v.push_back(0);
+		v.push_back(0);
+		sizes(v, src_origin, 3, 0);
+		sizes(v, dst_origin, 3, 0);
+		sizes(v, region, 3, 1);
+		v.push_back(src_pitch);
+		v.push_back(dst_pitch);
+		boost::lock_guard<boost::mutex> lk(capture_mutex);
+		v[0] = id(src);
+		v[1] = id(dst);
+		record(op_copy_rect, v);
+	}
+	
+	void Capture::finish() {
+		boost::lock_guard<boost::mutex> lk(capture_mutex);
+		record(op_finish, std::vector<cl_ulong>());
+	}
+	
+	namespace {
+		bool get(std::istream &in, cl_ulong &v) {
+			return (bool)in.read(reinterpret_cast<char *>(&v), sizeof(v));
+		}
+		
+		template<typename T>
+		T &object(std::map<cl_ulong, std::shared_ptr<T>> &m, cl_ulong i) {
+			auto r = m.find(i);
+			if(r==m.end())
+				throw Error(CL_INVALID_VALUE);
+			return *r->second;
+		}
+	}
+	
+	Replay::Replay(const std::string &file) {
+		std::ifstream in(file.c_str(), std::ios::in | std::ios::binary);
+		char m[sizeof(magic)];
+		if(!in.read(m, sizeof(m)) || !std::equal(m, m+sizeof(m), magic))
+			throw Error(CL_INVALID_VALUE);
+		for(char op; in.get(op);) {
+			Record r;
+			r.op = Capture::op_t(op);
+			cl_ulong n, v;
+			if(!get(in, n))
+				throw Error(CL_INVALID_VALUE);
+			for(cl_ulong i=0; i<n; i++) {
+				if(!get(in, v))
+					throw Error(CL_INVALID_VALUE);
+				r.values.push_back(v);
+			}
+			if(!get(in, n))
+				throw Error(CL_INVALID_VALUE);
+			for(cl_ulong i=0; i<n; i++) {
+				if(!get(in, v))
+					throw Error(CL_INVALID_VALUE);
+				std::string s(v, '\0');
+				if(v && !in.read(&s[0], v))
+					throw Error(CL_INVALID_VALUE);
+				r.strings.push_back(s);
+			}
+			if(!get(in, n))
+				throw Error(CL_INVALID_VALUE);
+			r.data.resize(n);
+			if(n && !in.read(r.data.data(), n))
+				throw Error(CL_INVALID_VALUE);
+			m_records.push_back(r);
+		}
+	}
+	
+	const char *Replay::op_name(Capture::op_t op) {
+		static const char *names[] = { "", "program", "build", "kernel", "buffer", "image", "arg", "arg", "write", "read", "ndrange", "copy", "copy", "finish", "write" };
+		return op>=Capture::op_program && op<=Capture::op_write_rect ? names[op] : "unknown";
+	}
+	
+	void Replay::run(const Context &c, const Device &d) {
+		std::map<cl_ulong, std::shared_ptr<Program>> programs;
+		std::map<cl_ulong, std::shared_ptr<Kernel>> kernels;
+		std::map<cl_ulong, std::string> names;
+		std::map<cl_ulong, std::shared_ptr<Buffer>> buffers;
+		std::map<cl_ulong, std::shared_ptr<Image>> images;
+		Queue q(c, d, false);
+		std::vector<char> scratch;
+		m_commands.clear();
+		for(auto r = m_records.begin(); r!=m_records.end(); r++) {
+			const std::vector<cl_ulong> &v = r->values;
+			Command cmd;
+			cmd.op = r->op;
+			cmd.bytes = 0;
+			cmd.items = 0;
+			boost::posix_time::ptime started = boost::posix_time::microsec_clock::universal_time();
+			switch(r->op) {
+			case Capture::op_program:
+				programs[v.at(0)].reset(new Program(c, std::vector<Device>(1, d), r->strings));
+				break;
+			case Capture::op_build:
+				object(programs, v.at(0)).build(r->strings.at(0));
+				break;
+			case Capture::op_kernel:
+				kernels[v.at(0)].reset(new Kernel(object(programs, v.at(1)).kernel(r->strings.at(0))));
+				names[v.at(0)] = r->strings.at(0);
+				break;
+			case Capture::op_buffer:
+				buffers[v.at(0)].reset(new Buffer(v.at(1) & CL_MEM_ALLOC_HOST_PTR ? c.buffer_host(v.at(2)) : c.buffer(v.at(2))));
+				images.erase(v.at(0));
+				break;
+			case Capture::op_image: {
+				cl_image_format f = { cl_channel_order(v.at(2)), cl_channel_type(v.at(3)) };
+				images[v.at(0)].reset(new Image(c.image(f, v.at(4), v.at(5))));
+				buffers.erase(v.at(0));
+				break;
+			}
+			case Capture::op_arg: {
+				cl_int err_code = clSetKernelArg(object(kernels, v.at(0)).id(), v.at(1), r->data.size(), r->data.empty() ? NULL : r->data.data());
+				if(err_code!=CL_SUCCESS)
+					throw Error(err_code);
+				break;
+			}
+			case Capture::op_arg_mem:
+				if(images.count(v.at(2)))
+					object(kernels, v.at(0)).set_arg(v.at(1), object(images, v.at(2)));
+				else
+					object(kernels, v.at(0)).set_arg(v.at(1), object(buffers, v.at(2)));
+				break;
+			case Capture::op_write:
+				cmd.bytes = r->data.size();
+				if(images.count(v.at(0)))
+					q.write(r->data.data(), object(images, v.at(0))).wait();
+				else
+					q.write(r->data.data(), object(buffers, v.at(0))).wait();
+				break;
+			case Capture::op_read:
+				cmd.bytes = v.at(1);
+				if(images.count(v.at(0))) {
+					Image &img = object(images, v.at(0));
+					scratch.resize(img.element_size()*img.width()*img.height());
+					q.read(img, scratch.data()).wait();
+				} else {
+					Buffer &b = object(buffers, v.at(0));
+					scratch.resize(b.size());
+					q.read(b, scratch.data()).wait();
+				}
+				break;
+			case Capture::op_ndrange: {
+				cl_uint dims = v.at(1);
+				size_t offset[3], global[3], local[3];
+				if(dims<1 || dims>3 || v.size()<3 + 3*dims)
+					throw Error(CL_INVALID_VALUE);
+				cmd.items = 1;
+				for(cl_uint i=0; i<dims; i++) {
+					offset[i] = v[3 + i];
+					global[i] = v[3 + dims + i];
+					local[i] = v[3 + 2*dims + i];
+					cmd.items *= global[i];
+				}
+				cmd.name = names[v[0]];
+				q.enqueue(object(kernels, v[0]), dims, global, offset, v[2] ? local : NULL).wait();
+				break;
+			}
+			case Capture::op_copy:
+				if(images.count(v.at(0)))
+					q.copy(object(images, v.at(0)), object(images, v.at(1))).wait();
+				else
+					q.copy(object(buffers, v.at(0)), object(buffers, v.at(1))).wait();
+				break;
+			case Capture::op_copy_rect: {
+				size_t so[3], dor[3], region[3];
+				for(int i=0; i<3; i++) {
+					so[i] = v.at(2 + i);
+					dor[i] = v.at(5 + i);
+					region[i] = v.at(8 + i);
+				}
+				if(images.count(v.at(0)))
+					q.copy(object(images, v.at(0)), object(images, v.at(1)), so, dor, region).wait();
+				else
+					q.copy(object(buffers, v.at(0)), object(buffers, v.at(1)), so, dor, region, v.at(11), v.at(12)).wait();
+				break;
+			}
+			case Capture::op_finish:
+				q.finish();
+				break;
+			case Capture::op_write_rect: {
+				size_t bo[3], ho[] = { 0, 0, 0 }, region[3];
+				for(int i=0; i<3; i++) {
+					bo[i] = v.at(1 + i);
+					region[i] = v.at(4 + i);
+				}
+				cmd.bytes = r->data.size();
+				q.write(r->data.data(), object(buffers, v.at(0)), bo, ho, region, v.at(7), region[0]).wait();
+				break;
+			}
+			default:
+				throw Error(CL_INVALID_VALUE);
+			}
+			cmd.ms = (boost::posix_time::microsec_clock::universal_time() - started).total_microseconds()/1000.0;
+			m_commands.push_back(cmd);
+		}
+	}
+}
@@ -0,0 +1,76 @@
+#ifndef MAY_CAPTURE_HPP
+#define MAY_CAPTURE_HPP
+
+#include "CL/cl.h"
+#include <string>
+#include <vector>
+#include <map>
+
+namespace mcl {
+	
+	class Context;
+	class Device;
+	
+	// records programs, kernel arguments, memory objects with the data written to them and the commands of every queue
+	// into a file, Replay executes it again; data written through mapped memory is not recorded
+	class Capture {
+	public:
+		enum op_t { op_program=1, op_build, op_kernel, op_buffer, op_image, op_arg, op_arg_mem, op_write, op_read, op_ndrange, op_copy, op_copy_rect, op_finish, op_write_rect };
+	private:
+		static volatile bool m_active;
+	public:
+		static bool active() { return m_active; }
+		// throws Error(CL_INVALID_VALUE) if the file can not be written
+		static void start(const std::string &file);
+		static void stop();
+		
+		static void program(cl_program, const std::vector<std::string> &sources);
+		static void build(cl_program, const std::string &options);
+		static void kernel(cl_kernel, cl_program, const std::string &name);
+		static void buffer(cl_mem, cl_mem_flags, size_t size);
+		static void image(cl_mem, cl_mem_flags, const cl_image_format &, size_t width, size_t height);
+		static void arg(cl_kernel, cl_uint index, size_t size, const void *value);
+		static void arg(cl_kernel, cl_uint index, cl_mem);
+		// whole object contents
+		static void write(cl_mem, const void *data, size_t size);
+		static void read(cl_mem, size_t size);
+		// origins and region in bytes and rows as passed to the write, the rows are recorded packed
+		static void write(cl_mem, const void *data, const size_t *buffer_origin, const size_t *host_origin, const size_t *region, size_t buffer_pitch, size_t host_pitch);
+		static void ndrange(cl_kernel, cl_uint dims, const size_t *offset, const size_t *global, const size_t *local);
+		static void copy(cl_mem src, cl_mem dst);
+		// origins and region as passed to the copy, pitches are 0 for images
+		static void copy(cl_mem src, cl_mem dst, const size_t *src_origin, const size_t *dst_origin, const size_t *region, size_t src_pitch, size_t dst_pitch);
+		static void finish();
+	};
+	
+	// executes a captured file on one device, commands run one at a time and are timed separately
+	class Replay {
+	public:
+		struct Command {
+			Capture::op_t op;
+			std::string name; // kernel of an NDRange
+			size_t bytes;
+			size_t items;
+			double ms;
+		};
+	private:
+		struct Record {
+			Capture::op_t op;
+			std::vector<cl_ulong> values;
+			std::vector<std::string> strings;
+			std::vector<char> data;
+		};
+		std::vector<Record> m_records;
+		std::vector<Command> m_commands;
+	public:
+		// throws Error(CL_INVALID_VALUE) if the file is missing or malformed
+		Replay(const std::string &file);
+		size_t records() const { return m_records.size(); }
+		void run(const Context &, const Device &);
+		// timings of the last run
+		const std::vector<Command> &commands() const { return m_commands; }
+		static const char *op_name(Capture::op_t);
+	};
+}
+
+#endif // MAY_CAPTURE_HPP
@@ -0,0 +1,183 @@
+#include "dispatch.hpp"
+#include <algorithm>
+
+namespace layer {
+	
+	const size_t Dispatcher::default_slice;
+	
+	DispatchJob::DispatchJob(const mcl::Kernel &k, cl_uint dims, const size_t *global, const size_t *offset, const size_t *local, Priority p, const std::vector<mcl::Event> &deps, const mcl::Event &done) :
+			m_kernel(k), m_dims(std::max<cl_uint>(std::min<cl_uint>(dims, 3), 1)), m_has_local(local!=NULL), m_priority(p), m_deps(deps),
+			m_done(done), m_next(0), m_slices(0), m_cancelled(false), m_submitted(false) {
+		for(cl_uint i=0; i<3; i++) {
+			m_global[i] = i<m_dims ? global[i] : 1;
+			m_offset[i] = i<m_dims && offset ? offset[i] : 0;
+			m_local[i] = i<m_dims && local ? local[i] : 1;
+		}
+	}
+	
+	void DispatchJob::finish() {
+		m_submitted = true;
+		m_cond.notify_all();
+		mcl::Event done = m_done;
+		if(m_cancelled)
+			done.set_status(CL_INVALID_OPERATION);
+		else if(m_last.empty())
+			done.set_status(CL_COMPLETE);
+		else
+			m_last.on_complete([done]() { done.set_status(CL_COMPLETE); });
+	}
+	
+	void DispatchJob::cancel() {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		m_cancelled = true;
+		m_cond.notify_all();
+	}
+	
+	bool DispatchJob::cancelled() {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		return m_cancelled;
+	}
+	
+	mcl::Event DispatchJob::submitted() {
+		boost::unique_lock<boost::mutex> lk(m_mutex);
+		m_cond.wait(lk, [this]{ return m_submitted || m_cancelled; });
+		return m_last;
+	}
+	
+	bool DispatchJob::wait() {
+		submitted().wait();
+		return !cancelled();
+	}
+	
+	size_t DispatchJob::slices() {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		return m_slices;
+	}
+	
+	Dispatcher::Dispatcher(const mcl::Queue &q, size_t slice) : m_interactive(q), m_background(q), m_slice(std::max<size_t>(slice, 1)), m_preemptions(0), m_slice_pending(false), m_stop(false) {
+		m_thread = boost::thread([this]() { run(); });
+	}
+	
+	Dispatcher::Dispatcher(const mcl::Queue &interactive, const mcl::Queue &background, size_t slice) :
+			m_interactive(interactive), m_background(background), m_slice(std::max<size_t>(slice, 1)), m_preemptions(0), m_slice_pending(false), m_stop(false) {
+		m_thread = boost::thread([this]() { run(); });
+	}
+	
+	Dispatcher::~Dispatcher() {
+		{
+			boost::lock_guard<boost::mutex> lk(m_mutex);
+			m_stop = true;
+			m_cond.notify_all();
+		}
+		m_thread.join();
+		{
+			// the completion callback of the last slice still uses the dispatcher
+			boost::unique_lock<boost::mutex> lk(m_mutex);
+			m_cond.wait(lk, [this]{ return !m_slice_pending; });
+		}
+		for(int p=0; p<2; p++)
+			for(auto i = m_jobs[p].begin(); i!=m_jobs[p].end(); i++) {
+				boost::lock_guard<boost::mutex> jlk((*i)->m_mutex);
+				(*i)->m_cancelled = true;
+				try {
+					(*i)->finish();
+				} catch(...) {
+				}
+			}
+	}
+	
+	DispatchRef Dispatcher::submit(const mcl::Kernel &k, cl_uint dims, const size_t *global, const size_t *offset, const size_t *local, Priority p, const std::vector<mcl::Event> &deps) {
+		if(p!=pr_interactive)
+			p = pr_background;
+		DispatchRef j(new DispatchJob(k, dims, global, offset, local, p, deps, mcl::Event::user(queue(p).context())));
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		m_jobs[p].push_back(j);
+		m_cond.notify_all();
+		return j;
+	}
+	
+	// enqueues the next slice, true when nothing is left
+	bool Dispatcher::enqueue(DispatchJob &j, bool whole) {
+		boost::lock_guard<boost::mutex> lk(j.m_mutex);
+		if(j.m_cancelled || j.m_next>=j.rows())
+			return true;
+		size_t last = j.m_dims-1, row = 1;
+		for(cl_uint i=0; i<last; i++)
+			row *= j.m_global[i];
+		size_t rows = whole ? j.rows() : std::max<size_t>(m_slice/std::max<size_t>(row, 1), 1);
+		if(rows%j.m_local[last])
+			rows += j.m_local[last] - rows%j.m_local[last];
+		rows = std::min(rows, j.rows() - j.m_next);
+		
+		size_t global[3], offset[3];
+		std::copy(j.m_global, j.m_global+3, global);
+		std::copy(j.m_offset, j.m_offset+3, offset);
+		global[last] = rows;
+		offset[last] += j.m_next;
+		std::vector<mcl::Event> deps = j.m_deps;
+		if(!j.m_last.empty())
+			deps.assign(1, j.m_last);
+		mcl::Queue &q = queue(j.m_priority);
+		j.m_last = q.enqueue(j.m_kernel, j.m_dims, global, offset, j.m_has_local ? j.m_local : NULL, deps);
+		q.flush();
+		j.m_next += rows;
+		j.m_slices++;
+		return j.m_next>=j.rows();
+	}
+	
+	void Dispatcher::run() {
+		boost::unique_lock<boost::mutex> lk(m_mutex);
+		DispatchRef running; // background job with a slice on the device
+		while(!m_stop) {
+			m_cond.wait(lk, [this]{ return m_stop || !m_jobs[pr_interactive].empty() || (!m_slice_pending && !m_jobs[pr_background].empty()); });
+			if(m_stop)
+				break;
+			bool interactive = !m_jobs[pr_interactive].empty();
+			DispatchRef j = m_jobs[interactive ? pr_interactive : pr_background].front();
+			if(interactive && running && running!=j)
+				m_preemptions++;
+			lk.unlock();
+			mcl::Event slice;
+			bool done = true;
+			try {
+				done = enqueue(*j, interactive);
+				slice = j->m_last;
+			} catch(...) {
+				j->cancel();
+			}
+			lk.lock();
+			if(done) {
+				m_jobs[j->priority()].remove(j);
+				boost::lock_guard<boost::mutex> jlk(j->m_mutex);
+				try {
+					j->finish();
+				} catch(...) {
+				}
+			}
+			running = interactive || done ? DispatchRef() : j;
+			if(running) {
+				// the next background slice starts after this one, interactive jobs submitted meanwhile wake the thread at once
+				m_slice_pending = true;
+				lk.unlock();
+				try {
+					slice.on_complete([this, j, slice]() {
+						try {
+							if(slice.status()<0)
+								j->cancel();
+						} catch(...) {
+							j->cancel();
+						}
+						boost::lock_guard<boost::mutex> lk(m_mutex);
+						m_slice_pending = false;
+						m_cond.notify_all();
+					});
+					lk.lock();
+				} catch(...) {
+					j->cancel();
+					lk.lock();
+					m_slice_pending = false;
+				}
+			}
+		}
+	}
+}
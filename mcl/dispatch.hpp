@@ -0,0 +1,91 @@
+#ifndef MAY_DISPATCH_HPP
+#define MAY_DISPATCH_HPP
+
+#include "mcl.hpp"
+#include <list>
+#include <vector>
+#include <memory>
+#include <boost/thread.hpp>
+
+namespace layer {
+	
+	// transfers have their own queue, kernels of that class are sliced like background ones
+	enum Priority { pr_interactive, pr_background, pr_transfer, pr_count };
+	
+	class Dispatcher;
+	
+	// an NDRange enqueued slice by slice along its last dimension, each slice waits for the previous one
+	class DispatchJob {
+	private:
+		friend class Dispatcher;
+		mcl::Kernel m_kernel;
+		cl_uint m_dims;
+		size_t m_global[3];
+		size_t m_offset[3];
+		size_t m_local[3];
+		bool m_has_local;
+		Priority m_priority;
+		std::vector<mcl::Event> m_deps;
+		mcl::Event m_last;
+		mcl::Event m_done; // user event completing after the last slice
+		size_t m_next; // first row of the last dimension not enqueued yet
+		size_t m_slices;
+		bool m_cancelled;
+		bool m_submitted;
+		boost::mutex m_mutex;
+		boost::condition_variable m_cond;
+		DispatchJob(const mcl::Kernel &, cl_uint dims, const size_t *global, const size_t *offset, const size_t *local, Priority, const std::vector<mcl::Event> &, const mcl::Event &done);
+		size_t rows() const { return m_global[m_dims-1]; }
+		// called once with the lock held, after the last slice is enqueued or the job is cancelled
+		void finish();
+	public:
+		Priority priority() const { return m_priority; }
+		// slices not enqueued yet are dropped
+		void cancel();
+		bool cancelled();
+		// until every slice is enqueued or the job is cancelled, returns the last enqueued slice
+		mcl::Event submitted();
+		// completes after the last slice without blocking the caller, fails if the job is cancelled
+		const mcl::Event &done() const { return m_done; }
+		// false if cancelled
+		bool wait();
+		size_t slices();
+	};
+	
+	typedef std::shared_ptr<DispatchJob> DispatchRef;
+	
+	// keeps at most one background slice on the device, interactive jobs go before the next slice
+	class Dispatcher {
+	public:
+		static const size_t default_slice = 1 << 20; // work items
+	private:
+		mcl::Queue m_interactive;
+		mcl::Queue m_background;
+		size_t m_slice;
+		std::list<DispatchRef> m_jobs[2];
+		size_t m_preemptions;
+		bool m_slice_pending; // a background slice is on the device, its completion notifies m_cond
+		bool m_stop;
+		boost::mutex m_mutex;
+		boost::condition_variable m_cond;
+		boost::thread m_thread;
+		void run();
+		bool enqueue(DispatchJob &, bool whole);
+	public:
+		Dispatcher(const mcl::Queue &, size_t slice=default_slice);
+		Dispatcher(const mcl::Queue &interactive, const mcl::Queue &background, size_t slice=default_slice);
+		~Dispatcher();
+		
+		// slices are enqueued after the call returns, the kernel must not be bound again by anyone else
+		DispatchRef submit(const mcl::Kernel &, cl_uint dims, const size_t *global, const size_t *offset=NULL, const size_t *local=NULL,
+			Priority=pr_background, const std::vector<mcl::Event> &deps=std::vector<mcl::Event>());
+		
+		mcl::Queue &queue(Priority p) { return p==pr_interactive ? m_interactive : m_background; }
+		size_t slice() const { return m_slice; }
+		void set_slice(size_t s) { m_slice = std::max<size_t>(s, 1); }
+		// interactive jobs enqueued between slices of a background job
+		size_t preemptions() const { return m_preemptions; }
+	};
+}
+
+#endif // MAY_DISPATCH_HPP
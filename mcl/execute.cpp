@@ -0,0 +1,184 @@
+#include "execute.hpp"
+
+namespace layer {
+	
+	Executor::Executor(MemoryPlan &p, const std::vector<mcl::Queue> &q) : m_plan(p), m_queues(q), m_bounds(Region::everything()), m_framed(false), m_frame(Region::everything()), m_dispatcher(0), m_priority(pr_background), m_resolution(1), m_next_queue(0), m_dispatched(0) {
+		if(m_queues.empty())
+			throw mcl::Error(CL_INVALID_COMMAND_QUEUE);
+	}
+	
+	Executor::Executor(MemoryPlan &p, const mcl::Queue &q) : m_plan(p), m_queues(1, q), m_bounds(Region::everything()), m_framed(false), m_frame(Region::everything()), m_dispatcher(0), m_priority(pr_background), m_resolution(1), m_next_queue(0), m_dispatched(0) {}
+	
+	void Executor::append(std::vector<mcl::Event> &r, const std::vector<mcl::Event> &e) {
+		r.insert(r.end(), e.begin(), e.end());
+	}
+	
+	mcl::Queue &Executor::queue(const Layer *l) {
+		auto i = m_queue_of.find(l);
+		if(i==m_queue_of.end())
+			throw NotFoundException(std::string("queue:") + l->class_name());
+		return m_queues[i->second];
+	}
+	
+	const std::vector<mcl::Event> &Executor::done(const Layer *l) const {
+		auto i = m_done.find(l);
+		if(i==m_done.end())
+			throw NotFoundException(std::string("events:") + l->class_name());
+		return i->second;
+	}
+	
+	Region Executor::region(const Layer *l) const {
+		auto i = m_regions.find(l);
+		return i==m_regions.end() ? Region::everything() : i->second;
+	}
+	
+	std::vector<mcl::Event> Executor::run() {
+		return run(Region::everything());
+	}
+	
+	std::vector<mcl::Event> Executor::run(const Region &root_region) {
+		m_done.clear();
+		m_regions.clear();
+		m_skipped.clear();
+		m_frame = Region::everything();
+		const std::vector<Layer *> &order = m_plan.order();
+		if(!root_region.is_everything() && !order.empty()) {
+			// pulls the root region back through the arguments
+			m_regions[order.back()] = root_region;
+			for(auto i = order.rbegin(); i!=order.rend(); i++) {
+				auto r = m_regions.find(*i);
+				if(r==m_regions.end())
+					continue;
+				for(auto a = (*i)->arguments().begin(); a!=(*i)->arguments().end(); a++) {
+					if(!(bool)a->value())
+						continue;
+					Region in = (*i)->input_region(*a, r->second).intersected(m_bounds);
+					auto j = m_regions.find(a->value().get());
+					if(j==m_regions.end())
+						m_regions[a->value().get()] = in;
+					else
+						j->second = j->second.united(in);
+				}
+			}
+			if(m_framed) {
+				m_frame = Region();
+				for(auto r = m_regions.begin(); r!=m_regions.end(); r++)
+					m_frame = m_frame.united(r->second);
+			}
+		}
+		for(auto i = order.begin(); i!=order.end(); i++) {
+			Layer *l = *i;
+			std::vector<mcl::Event> deps;
+			const Layer *first = 0;
+			bool skipped = false;
+			for(auto a = l->arguments().begin(); a!=l->arguments().end(); a++) {
+				if(!(bool)a->value())
+					continue;
+				if(!first)
+					first = a->value().get();
+				append(deps, m_done[a->value().get()]);
+				skipped = skipped || m_skipped.count(a->value().get());
+			}
+			bool has_slot = m_plan.has_slot(l);
+			size_t slot = has_slot ? m_plan.slot(l) : 0;
+			if(has_slot) {
+				append(deps, m_slot_writer[slot]);
+				append(deps, m_slot_readers[slot]);
+			}
+			// chains stay on one queue, independent branches spread over the queues
+			if(first)
+				m_queue_of[l] = m_queue_of[first];
+			else
+				m_queue_of[l] = m_next_queue++ % m_queues.size();
+			
+			mcl::Event e;
+			if(skipped)
+				m_skipped.insert(l);
+			else
+				e = l->execute(*this, deps);
+			std::vector<mcl::Event> &r = m_done[l];
+			if(e.empty())
+				r = deps;
+			else {
+				r.assign(1, e);
+				m_dispatched++;
+			}
+			if(has_slot) {
+				m_slot_writer[slot] = r;
+				m_slot_readers[slot].clear();
+			}
+			for(auto a = l->arguments().begin(); a!=l->arguments().end(); a++)
+				if((bool)a->value() && m_plan.has_slot(a->value().get()))
+					append(m_slot_readers[m_plan.slot(a->value().get())], r);
+		}
+		for(auto q = m_queues.begin(); q!=m_queues.end(); q++)
+			q->flush();
+		return order.empty() ? std::vector<mcl::Event>() : m_done[order.back()];
+	}
+	
+	static void merge(std::vector<Region> &rs) {
+		for(bool merged = true; merged;) {
+			merged = false;
+			for(size_t i=0; i<rs.size() && !merged; i++)
+				for(size_t j=i+1; j<rs.size() && !merged; j++)
+					if(rs[i].intersects(rs[j])) {
+						rs[i] = rs[i].united(rs[j]);
+						rs.erase(rs.begin()+j);
+						merged = true;
+					}
+		}
+	}
+	
+	bool Executor::update(long long since, ResultCache::Entry &previous) {
+		if(m_plan.order().empty())
+			return false;
+		Layer *root = m_plan.order().back();
+		Storage st = root->storage();
+		std::vector<Region> dirty;
+		// slots of tiled plans hold the part at their origin, the full output is updated from a full size plan only
+		if(st.height==0 || !m_plan.has_slot(root) || !(storage(root)==st) || !root->dirty_regions(since, dirty))
+			return false;
+		merge(dirty);
+		std::vector<mcl::Event> last(1, previous.ready);
+		for(auto d = dirty.begin(); d!=dirty.end(); d++) {
+			Region r = d->reduced(m_resolution).clipped(st.kind==Storage::sk_image ? st.width : std::numeric_limits<size_t>::max(), st.height);
+			if(r.is_empty())
+				continue;
+			std::vector<mcl::Event> deps = run(r);
+			deps.insert(deps.end(), last.begin(), last.end());
+			// the root slot holds the region at its position in the frame of the run
+			mcl::Event e;
+			if(st.kind==Storage::sk_image) {
+				size_t src[] = { r.x - m_frame.x, r.y - m_frame.y, 0 };
+				size_t dst[] = { r.x, r.y, 0 };
+				size_t size[] = { r.width, r.height, 1 };
+				e = queue(root).copy(image(root), *previous.image, src, dst, size, deps);
+			} else {
+				size_t pitch = st.size/st.height, pixel = st.width ? pitch/st.width : 1;
+				r = r.clipped(st.width ? st.width : pitch, st.height);
+				size_t src[] = { (r.x - m_frame.x)*pixel, r.y - m_frame.y, 0 };
+				size_t dst[] = { r.x*pixel, r.y, 0 };
+				size_t size[] = { r.width*pixel, r.height, 1 };
+				e = queue(root).copy(buffer(root), *previous.buffer, src, dst, size, pitch, pitch, deps);
+			}
+			last.assign(1, e);
+			add_reader(root, e);
+		}
+		previous.ready = last.front();
+		queue(root).flush();
+		return true;
+	}
+	
+	void Executor::add_reader(const Layer *l, const mcl::Event &e) {
+		if(m_plan.has_slot(l))
+			m_slot_readers[m_plan.slot(l)].push_back(e);
+	}
+	
+	void Executor::wait() {
+		if(m_plan.order().empty())
+			return;
+		const std::vector<mcl::Event> &r = m_done[m_plan.order().back()];
+		for(auto i = r.begin(); i!=r.end(); i++)
+			i->wait();
+	}
+}
@@ -0,0 +1,79 @@
+#ifndef MAY_EXECUTE_HPP
+#define MAY_EXECUTE_HPP
+
+#include "graph.hpp"
+#include "dispatch.hpp"
+#include <vector>
+#include <map>
+#include <set>
+
+namespace layer {
+	
+	// enqueues the layers of a planned graph, each waits only for its arguments and for the readers of a reused slot
+	class Executor {
+	private:
+		MemoryPlan &m_plan;
+		std::vector<mcl::Queue> m_queues;
+		std::map<const Layer *, std::vector<mcl::Event>> m_done;
+		std::map<const Layer *, size_t> m_queue_of;
+		std::map<size_t, std::vector<mcl::Event>> m_slot_writer;
+		std::map<size_t, std::vector<mcl::Event>> m_slot_readers; // readers of the current occupant
+		std::map<const Layer *, Region> m_regions; // parts to compute, everything if absent
+		std::set<const Layer *> m_skipped; // without a kernel in the last run, and their consumers
+		Region m_bounds;
+		bool m_framed;
+		Region m_frame;
+		Dispatcher *m_dispatcher;
+		Priority m_priority;
+		size_t m_resolution;
+		size_t m_next_queue;
+		size_t m_dispatched;
+		static void append(std::vector<mcl::Event> &, const std::vector<mcl::Event> &);
+	public:
+		Executor(MemoryPlan &, const std::vector<mcl::Queue> &);
+		Executor(MemoryPlan &, const mcl::Queue &);
+		
+		// enqueues the whole graph, returns the events completing the root
+		std::vector<mcl::Event> run();
+		// enqueues only what the region of the root needs
+		std::vector<mcl::Event> run(const Region &);
+		void wait();
+		// recomputes the parts of the root changed after a version and copies them into its old result,
+		// false if a full run is needed or the plan is not full size
+		bool update(long long since, ResultCache::Entry &previous);
+		// part of the output being computed, everything in full runs
+		Region region(const Layer *) const;
+		// storages of the last run hold pixel (x, y) at (x - frame().x, y - frame().y), rows their planned width apart,
+		// kernels get that position as their work-item id; the frame starts at the origin unless framed
+		Region frame() const { return m_frame; }
+		// the frame of a run is the bounding box of the parts it pulls, the plans of tiles are sized to it
+		void set_framed(bool f) { m_framed = f; }
+		// parts pulled through the graph are clipped to the bounds
+		void set_bounds(const Region &r) { m_bounds = r; }
+		Storage storage(const Layer *l) const { return m_plan.storage(l); }
+		// kernels go through the dispatcher instead of the queues, long background runs are sliced
+		void set_dispatcher(Dispatcher *d, Priority p=pr_background) { m_dispatcher = d; m_priority = p; }
+		Dispatcher *dispatcher() const { return m_dispatcher; }
+		Priority priority() const { return m_priority; }
+		// interactive runs never wait for a compile, layers without a kernel yet are skipped
+		void set_priority(Priority p) { m_priority = p; }
+		// called by a layer instead of enqueueing, its consumers are skipped too
+		void skip(const Layer *l) { m_skipped.insert(l); }
+		// false if the last run skipped layers, the root output is not valid
+		bool complete() const { return m_skipped.empty(); }
+		// layers bind scale() to it, outputs are 1/resolution of the full size
+		void set_resolution(size_t r) { m_resolution = std::max<size_t>(r, 1); }
+		size_t resolution() const { return m_resolution; }
+		// a read of the layer output outside the graph, the next writer of the slot waits for it
+		void add_reader(const Layer *, const mcl::Event &);
+		
+		MemoryPlan &plan() { return m_plan; }
+		mcl::Queue &queue(const Layer *);
+		mcl::Buffer buffer(const Layer *l) const { return m_plan.buffer(l); }
+		mcl::Image image(const Layer *l) const { return m_plan.image(l); }
+		const std::vector<mcl::Event> &done(const Layer *) const;
+		size_t dispatched() const { return m_dispatched; }
+	};
+}
+
+#endif // MAY_EXECUTE_HPP
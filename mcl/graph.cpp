@@ -0,0 +1,301 @@
+#include "graph.hpp"
+#include <sstream>
+
+namespace layer {
+	
+	static void visit(Layer *l, std::set<Layer *> &visited, std::vector<Layer *> &r) {
+		if(!visited.insert(l).second)
+			return;
+		for(auto i = l->arguments().begin(); i!=l->arguments().end(); i++)
+			if((bool)i->value())
+				visit(i->value().get(), visited, r);
+		r.push_back(l);
+	}
+	
+	std::vector<Layer *> topological_order(Layer &root) {
+		std::set<Layer *> visited;
+		std::vector<Layer *> r;
+		visit(&root, visited, r);
+		return r;
+	}
+	
+	SavedGraph load_graph(Context &c, std::istream &in) {
+		SavedGraph g;
+		std::string line;
+		for(size_t n=1; std::getline(in, line); n++) {
+			std::istringstream ls(line);
+			std::string kind, id;
+			if(!(ls >> kind) || kind[0]=='#')
+				continue;
+			if(!(ls >> id))
+				throw FormatException(n, "graph: missing layer id");
+			if(kind=="input") {
+				auto i = g.layers.find(id);
+				if(i==g.layers.end())
+					throw FormatException(n, "graph: unknown layer " + id);
+				g.input = i->second;
+				continue;
+			}
+			std::string factory;
+			if(kind!="layer" || !(ls >> factory))
+				throw FormatException(n, "graph: expected \"layer <id> <factory name>\"");
+			std::shared_ptr<Layer> l = c.create(factory);
+			for(std::string a; ls >> a;) {
+				size_t eq = a.find('=');
+				auto v = eq==std::string::npos ? g.layers.end() : g.layers.find(a.substr(eq+1));
+				if(v==g.layers.end())
+					throw FormatException(n, "graph: bad argument " + a);
+				std::string name = a.substr(0, eq);
+				auto arg = l->arguments().begin();
+				while(arg!=l->arguments().end() && arg->name()!=name)
+					arg++;
+				if(arg==l->arguments().end())
+					throw FormatException(n, "graph: " + factory + " has no argument " + name);
+				arg->set_value(v->second);
+			}
+			g.layers[id] = l;
+			g.root = l;
+		}
+		if(!(bool)g.root)
+			throw FormatException(0, "graph: no layers");
+		return g;
+	}
+	
+	void save_graph(Layer &root, const Layer *input, std::ostream &out) {
+		std::vector<Layer *> order = topological_order(root);
+		std::map<const Layer *, size_t> ids;
+		for(size_t i=0; i<order.size(); i++) {
+			Layer *l = order[i];
+			if(l->factory_name().empty())
+				throw NotFoundException(std::string("layer:") + l->class_name());
+			ids[l] = i;
+			out << "layer " << i << " " << l->factory_name();
+			for(auto a = l->arguments().begin(); a!=l->arguments().end(); a++)
+				if((bool)a->value())
+					out << " " << a->name() << "=" << ids[a->value().get()];
+			out << std::endl;
+		}
+		if(input && ids.find(input)!=ids.end())
+			out << "input " << ids[input] << std::endl;
+	}
+	
+	static boost::posix_time::ptime now() {
+		return boost::posix_time::microsec_clock::universal_time();
+	}
+	
+	GraphBuild::GraphBuild(Layer &root, WorkerPool &pool) : m_order(topological_order(root)), m_pool(pool), m_generated(0), m_started(now()), m_done(false) {
+		for(auto i = m_order.begin(); i!=m_order.end(); i++)
+			m_timing[*i];
+		// sources of a layer do not depend on the generated sources of its arguments
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		for(auto i = m_order.begin(); i!=m_order.end(); i++) {
+			Layer *l = *i;
+			m_pool.post([this, l]() { generate(l); });
+		}
+	}
+	
+	GraphBuild::~GraphBuild() {
+		boost::unique_lock<boost::mutex> lk(m_mutex);
+		m_cond.wait(lk, [this]{ return m_generated==m_order.size(); });
+	}
+	
+	void GraphBuild::generate(Layer *l) {
+		boost::posix_time::ptime t = now();
+		std::exception_ptr error;
+		try {
+			l->build_local();
+		} catch(...) {
+			error = std::current_exception();
+		}
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		m_timing[l].started = t;
+		m_timing[l].generated = now();
+		if(error && !m_error)
+			m_error = error;
+		if(++m_generated==m_order.size())
+			m_cond.notify_all();
+	}
+	
+	void GraphBuild::wait() {
+		{
+			boost::unique_lock<boost::mutex> lk(m_mutex);
+			m_cond.wait(lk, [this]{ return m_generated==m_order.size(); });
+			if(m_error)
+				std::rethrow_exception(m_error);
+			if(m_done)
+				return;
+		}
+		std::exception_ptr error;
+		for(auto i = m_order.begin(); i!=m_order.end(); i++) {
+			Timing &t = m_timing[*i];
+			DeviceLayer *d = dynamic_cast<DeviceLayer *>(*i);
+			t.built = d ? std::max(d->wait_built(), t.generated) : t.generated;
+			try {
+				if(d)
+					d->check_build();
+			} catch(...) {
+				if(!error)
+					error = std::current_exception();
+			}
+		}
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		m_finished = m_started;
+		for(auto i = m_timing.begin(); i!=m_timing.end(); i++)
+			m_finished = std::max(m_finished, i->second.built);
+		m_done = true;
+		m_error = error;
+		if(m_error)
+			std::rethrow_exception(m_error);
+	}
+	
+	boost::posix_time::time_duration GraphBuild::critical_path() const {
+		boost::posix_time::time_duration r;
+		for(auto i = m_timing.begin(); i!=m_timing.end(); i++)
+			r = std::max(r, i->second.built - i->second.started);
+		return r;
+	}
+	
+	boost::posix_time::time_duration GraphBuild::total() const {
+		boost::posix_time::time_duration r;
+		for(auto i = m_timing.begin(); i!=m_timing.end(); i++)
+			r += i->second.built - i->second.started;
+		return r;
+	}
+	
+	void GraphBuild::report(std::ostream &s) const {
+		s << "Graph build: " << m_order.size() << " layers on " << m_pool.size() << " threads" << std::endl;
+		s << "	wall: " << wall().total_milliseconds() << " ms" << std::endl;
+		s << "	critical path: " << critical_path().total_milliseconds() << " ms" << std::endl;
+		s << "	serial: " << total().total_milliseconds() << " ms" << std::endl;
+	}
+	
+	MemoryPlan::MemoryPlan(Layer &root, const std::map<const Layer *, Storage> &sizes) : m_order(topological_order(root)), m_unplanned_peak(0), m_live_peak(0) {
+		size_t n = m_order.size();
+		for(size_t i=0; i<n; i++) {
+			m_index[m_order[i]] = i;
+			m_last_use[m_order[i]] = i;
+		}
+		m_last_use[&root] = n;
+		for(size_t i=0; i<n; i++) {
+			Layer *l = m_order[i];
+			for(auto a = l->arguments().begin(); a!=l->arguments().end(); a++)
+				if((bool)a->value() && m_last_use[a->value().get()]<i)
+					m_last_use[a->value().get()] = i;
+		}
+		
+		std::vector<Storage> storage(n);
+		for(size_t i=0; i<n; i++) {
+			auto s = sizes.find(m_order[i]);
+			storage[i] = s==sizes.end() ? m_order[i]->storage() : s->second;
+			m_storage[m_order[i]] = storage[i];
+			m_unplanned_peak += storage[i].size;
+		}
+		
+		// external outputs are written before the run and live from its start, no earlier layer shares their slots
+		std::vector<size_t> start(n), slot_end;
+		for(size_t i=0; i<n; i++) {
+			Layer *l = m_order[i];
+			start[i] = l->external() ? 0 : i;
+			if(!l->external() || storage[i].kind==Storage::sk_none)
+				continue;
+			Slot slot;
+			slot.storage = storage[i];
+			m_slot[l] = m_slots.size();
+			m_slots.push_back(slot);
+			slot_end.push_back(m_last_use[l]);
+		}
+		// interval colouring in execution order, a slot is free once its last occupant is no longer read
+		for(size_t i=0; i<n; i++) {
+			Layer *l = m_order[i];
+			const Storage &st = storage[i];
+			if(st.kind==Storage::sk_none)
+				continue;
+			size_t live = 0;
+			for(size_t j=0; j<n; j++)
+				if(start[j]<=i && m_last_use[m_order[j]]>=i)
+					live += storage[j].size;
+			m_live_peak = std::max(m_live_peak, live);
+			if(m_slot.find(l)!=m_slot.end())
+				continue;
+			
+			size_t s = m_slots.size();
+			const Argument *in_place = l->in_place_argument();
+			if(in_place) {
+				const Layer *input = in_place->value().get();
+				auto is = m_slot.find(input);
+				if(is!=m_slot.end() && m_last_use[input]==i && m_slots[is->second].storage.compatible(st))
+					s = is->second;
+			}
+			if(s==m_slots.size()) {
+				for(size_t j=0; j<m_slots.size(); j++) {
+					if(slot_end[j]>=i || !m_slots[j].storage.compatible(st))
+						continue;
+					if(s==m_slots.size())
+						s = j;
+					else {
+						size_t cur = m_slots[s].storage.size, sz = m_slots[j].storage.size;
+						// best fit, or the largest slot when none fits
+						if(cur<st.size ? sz>cur : (sz>=st.size && sz<cur))
+							s = j;
+					}
+				}
+			}
+			if(s==m_slots.size()) {
+				Slot slot;
+				slot.storage = st;
+				m_slots.push_back(slot);
+				slot_end.push_back(m_last_use[l]);
+			} else {
+				// rows and size stay those of one occupant, pitches derived from the slot storage hold
+				if(m_slots[s].storage.size<st.size)
+					m_slots[s].storage = st;
+				slot_end[s] = m_last_use[l];
+			}
+			m_slot[l] = s;
+		}
+	}
+	
+	size_t MemoryPlan::find(const std::map<const Layer *, size_t> &m, const Layer *l) const {
+		auto i = m.find(l);
+		if(i==m.end())
+			throw NotFoundException(std::string("plan:") + l->class_name());
+		return i->second;
+	}
+	
+	size_t MemoryPlan::planned_peak() const {
+		size_t r = 0;
+		for(auto i = m_slots.begin(); i!=m_slots.end(); i++)
+			r += i->storage.size;
+		return r;
+	}
+	
+	void MemoryPlan::allocate(mcl::Context &c) {
+		for(auto i = m_slots.begin(); i!=m_slots.end(); i++) {
+			if(i->storage.kind==Storage::sk_buffer && !(bool)i->buffer)
+				i->buffer.reset(new mcl::Buffer(c.buffer_rw(i->storage.size)));
+			else if(i->storage.kind==Storage::sk_image && !(bool)i->image)
+				i->image.reset(new mcl::Image(c.image_rw(i->storage.format, i->storage.width, i->storage.height)));
+		}
+	}
+	
+	mcl::Buffer MemoryPlan::buffer(const Layer *l) const {
+		const Slot &s = m_slots[slot(l)];
+		if(!(bool)s.buffer)
+			throw mcl::Error(CL_INVALID_MEM_OBJECT);
+		return *s.buffer;
+	}
+	
+	mcl::Image MemoryPlan::image(const Layer *l) const {
+		const Slot &s = m_slots[slot(l)];
+		if(!(bool)s.image)
+			throw mcl::Error(CL_INVALID_MEM_OBJECT);
+		return *s.image;
+	}
+	
+	void MemoryPlan::report(std::ostream &s) const {
+		s << "Memory plan: " << m_order.size() << " layers, " << m_slots.size() << " slots" << std::endl;
+		s << "\tpeak before: " << m_unplanned_peak << " bytes" << std::endl;
+		s << "\tpeak after: " << planned_peak() << " bytes" << std::endl;
+		s << "\tlive outputs: " << m_live_peak << " bytes" << std::endl;
+	}
+}
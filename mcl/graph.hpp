@@ -0,0 +1,108 @@
+#ifndef MAY_GRAPH_HPP
+#define MAY_GRAPH_HPP
+
+#include "layer.hpp"
+#include "pool.hpp"
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <istream>
+#include <ostream>
+
+namespace layer {
+	
+	// layers reachable from root, arguments before their consumers
+	std::vector<Layer *> topological_order(Layer &root);
+	
+	// graph read from a text file, one layer per line after its arguments:
+	// layer <id> <factory name> [<argument>=<id> ...]
+	// input <id>
+	struct SavedGraph {
+		std::map<std::string, std::shared_ptr<Layer>> layers;
+		std::shared_ptr<Layer> root; // last layer
+		std::shared_ptr<Layer> input; // receives the decoded images, may be empty
+	};
+	SavedGraph load_graph(Context &, std::istream &);
+	void save_graph(Layer &root, const Layer *input, std::ostream &);
+	
+	// generates and compiles every layer of the graph on a worker pool
+	class GraphBuild {
+	public:
+		struct Timing {
+			boost::posix_time::ptime started;
+			boost::posix_time::ptime generated;
+			boost::posix_time::ptime built;
+		};
+	private:
+		std::vector<Layer *> m_order;
+		std::map<Layer *, Timing> m_timing;
+		WorkerPool &m_pool;
+		size_t m_generated;
+		boost::posix_time::ptime m_started;
+		boost::posix_time::ptime m_finished;
+		bool m_done;
+		std::exception_ptr m_error;
+		boost::mutex m_mutex;
+		boost::condition_variable m_cond;
+		void generate(Layer *);
+	public:
+		GraphBuild(Layer &root, WorkerPool &);
+		~GraphBuild();
+		// until every program is built, rethrows the first generation or compile error
+		void wait();
+		const Timing &timing(Layer *l) const { return m_timing.find(l)->second; }
+		// longest generation and compile of one layer, layers do not wait for their arguments
+		boost::posix_time::time_duration critical_path() const;
+		boost::posix_time::time_duration total() const;
+		boost::posix_time::time_duration wall() const { return m_finished - m_started; }
+		void report(std::ostream &) const;
+	};
+	
+	// assigns layer outputs to reusable device memory slots
+	class MemoryPlan {
+	public:
+		struct Slot {
+			Storage storage; // of the largest occupant
+			std::shared_ptr<mcl::Buffer> buffer;
+			std::shared_ptr<mcl::Image> image;
+		};
+	private:
+		std::vector<Layer *> m_order;
+		std::map<const Layer *, size_t> m_index;
+		std::map<const Layer *, size_t> m_last_use;
+		std::map<const Layer *, size_t> m_slot;
+		std::map<const Layer *, Storage> m_storage;
+		std::vector<Slot> m_slots;
+		size_t m_unplanned_peak; // every output allocated separately
+		size_t m_live_peak; // largest total size of simultaneously live outputs
+		size_t find(const std::map<const Layer *, size_t> &, const Layer *) const;
+	public:
+		// storage of the layers missing in sizes comes from Layer::storage(), external layers get slots of their own,
+		// outputs are overwritten in place only by layers whose sources were generated before (GraphBuild, Layer::build)
+		MemoryPlan(Layer &root, const std::map<const Layer *, Storage> &sizes=std::map<const Layer *, Storage>());
+		const std::vector<Layer *> &order() const { return m_order; }
+		size_t index(const Layer *l) const { return find(m_index, l); }
+		// index of the last layer reading the output, order().size() for the root
+		size_t last_use(const Layer *l) const { return find(m_last_use, l); }
+		bool has_slot(const Layer *l) const { return m_slot.find(l)!=m_slot.end(); }
+		size_t slot(const Layer *l) const { return find(m_slot, l); }
+		const std::vector<Slot> &slots() const { return m_slots; }
+		// storage planned for the layer, its slot may be larger
+		Storage storage(const Layer *l) const {
+			auto i = m_storage.find(l);
+			return i==m_storage.end() ? Storage() : i->second;
+		}
+		
+		size_t unplanned_peak() const { return m_unplanned_peak; }
+		size_t planned_peak() const;
+		size_t live_peak() const { return m_live_peak; }
+		
+		void allocate(mcl::Context &);
+		mcl::Buffer buffer(const Layer *) const;
+		mcl::Image image(const Layer *) const;
+		void report(std::ostream &) const;
+	};
+}
+
+#endif // MAY_GRAPH_HPP
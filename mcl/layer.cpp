@@ -1,5 +1,6 @@
 
 #include "layer.hpp"
+#include "execute.hpp"
 #include <typeinfo>
 
 namespace layer {
@@ -17,6 +18,21 @@ namespace layer {
 	
 	BuildException::~BuildException() throw() {}
 	
+	const char *FormatException::what() const throw() {
+		return message.c_str();
+	}
+	
+	FormatException::~FormatException() throw() {}
+	
+	std::shared_ptr<Layer> Context::create(const std::string &nm) {
+		auto fit = m_factory.find(nm);
+		if(fit==m_factory.end())
+			throw NotFoundException(std::string("layer:") + nm);
+		std::shared_ptr<Layer> r = fit->second->create(*this);
+		r->set_factory_name(nm);
+		return r;
+	}
+	
 	const Type::type Type::ltp_float;
 	const Type::type Type::ltp_color;
 	const Type::type Type::ltp_vector2d;
@@ -24,16 +40,84 @@ namespace layer {
 
 	std::map<std::string, LayerFactory *> Context::m_factory;
 	
+	Storage Storage::buffer(size_t sz) {
+		Storage r;
+		r.kind = sk_buffer;
+		r.size = sz;
+		return r;
+	}
+	
+	Storage Storage::buffer(size_t sz, size_t w, size_t h) {
+		Storage r = buffer(sz);
+		r.width = w;
+		r.height = h;
+		return r;
+	}
+	
+	Storage Storage::image(const cl_image_format &f, size_t w, size_t h) {
+		size_t channels = 4, channel_size = 4;
+		switch(f.image_channel_order) {
+		case CL_R: case CL_A: case CL_INTENSITY: case CL_LUMINANCE: case CL_Rx:
+			channels = 1;
+			break;
+		case CL_RG: case CL_RA: case CL_RGx:
+			channels = 2;
+			break;
+		case CL_RGB: case CL_RGBx:
+			channels = 1; // packed formats only
+			break;
+		}
+		switch(f.image_channel_data_type) {
+		case CL_SNORM_INT8: case CL_UNORM_INT8: case CL_SIGNED_INT8: case CL_UNSIGNED_INT8:
+			channel_size = 1;
+			break;
+		case CL_SNORM_INT16: case CL_UNORM_INT16: case CL_SIGNED_INT16: case CL_UNSIGNED_INT16: case CL_HALF_FLOAT:
+		case CL_UNORM_SHORT_565: case CL_UNORM_SHORT_555:
+			channel_size = 2;
+			break;
+		}
+		Storage r;
+		r.kind = sk_image;
+		r.format = f;
+		r.width = w;
+		r.height = h;
+		r.size = channels*channel_size*w*h;
+		return r;
+	}
+	
+	Storage Storage::part(const Region &r) const {
+		if(kind==sk_image)
+			return image(format, r.width, r.height);
+		if(kind==sk_buffer && width && height)
+			return buffer(size/(width*height)*r.width*r.height, r.width, r.height);
+		return *this;
+	}
+	
+	bool Storage::compatible(const Storage &s) const {
+		if(kind!=s.kind)
+			return false;
+		if(kind==sk_image)
+			return width==s.width && height==s.height
+				&& format.image_channel_order==s.format.image_channel_order
+				&& format.image_channel_data_type==s.format.image_channel_data_type;
+		return true;
+	}
+	
 	void Argument::set_value(std::shared_ptr<Layer> v) {
+		if((bool)m_value)
+			m_value->remove_consumer(m_owner);
 		m_value = v;
-		v->set_parent(m_owner);
+		if((bool)v)
+			v->add_consumer(m_owner);
 		m_owner->inc_version();
 		m_owner->reset_cache();
 	}
 	
 	void Argument::set_owner(Layer *l) {
-		if((bool)m_value)
-			m_value->set_parent(l);
+		if((bool)m_value) {
+			m_value->remove_consumer(m_owner);
+			m_value->add_consumer(l);
+		}
 		m_owner = l;	
 	}
 	
@@ -42,55 +126,416 @@ namespace layer {
 	}
 	
 	void Layer::reset_cache() {
-		if(m_parent)
-			m_parent->reset_cache();
+		m_clean_since = m_version;
+		m_dirty.clear();
+		for(auto i = m_consumers.begin(); i!=m_consumers.end(); i++) {
+			(*i)->inc_version();
+			(*i)->reset_cache();
+		}
+	}
+	
+	void Layer::parameters_changed() {
+		inc_version();
+		inc_parameter_version();
+		m_clean_since = m_version;
+		m_dirty.clear();
+		for(auto i = m_consumers.begin(); i!=m_consumers.end(); i++)
+			(*i)->parameters_changed();
+	}
+	
+	const size_t Layer::max_dirty;
+	
+	Region Layer::input_region(const Argument &, const Region &output) const {
+		// the mapping of a position expression is not known on the host
+		return (bool)position() ? Region::everything() : output;
+	}
+	
+	Region Layer::affected_region(const Argument &, const Region &input) const {
+		return (bool)position() ? Region::everything() : input;
+	}
+	
+	void Layer::invalidate(const Region &r) {
+		if(r.is_empty())
+			return;
+		inc_version();
+		m_dirty.push_back(std::make_pair(version(), r));
+		if(m_dirty.size()>max_dirty) {
+			m_clean_since = m_dirty.front().first;
+			m_dirty.pop_front();
+		}
+		for(auto c = m_consumers.begin(); c!=m_consumers.end(); c++) {
+			if(std::find(m_consumers.begin(), c, *c)!=c)
+				continue; // reads this layer through several arguments, already invalidated
+			Region affected(0, 0, 0, 0);
+			for(auto i = (*c)->arguments().begin(); i!=(*c)->arguments().end(); i++)
+				if(i->value().get()==this)
+					affected = affected.united((*c)->affected_region(*i, r));
+			(*c)->invalidate(affected);
+		}
+	}
+	
+	bool Layer::dirty_regions(long long since, std::vector<Region> &r) const {
+		if(since<m_clean_since)
+			return false;
+		for(auto i = m_dirty.begin(); i!=m_dirty.end(); i++)
+			if(i->first>since)
+				r.push_back(i->second);
+		return true;
+	}
+	
+	bool Layer::cached_result(const Region &r, size_t resolution, ResultCache::Entry &e) {
+		return context().cache().find(ResultCache::Key(this, version(), r, resolution), e);
+	}
+	
+	void Layer::cache_result(const Region &r, size_t resolution, const ResultCache::Entry &e) {
+		context().cache().insert(ResultCache::Key(this, version(), r, resolution), e);
 	}
 	
 	void Layer::build() {
 		for(auto i = arguments().begin(); i!=arguments().end(); i++)
 			if(bool(i->value()))
 				i->value()->build();
+		build_local();
+	}
+	Layer::~Layer() {
+		for(auto i = m_arguments.begin(); i!=m_arguments.end(); i++)
+			if((bool)i->value())
+				i->value()->remove_consumer(this);
+		context().cache().erase(this);
 	}
-	Layer::~Layer() {}
 	
-	void DeviceLayer::build() {
-		Layer::build();
+	void DeviceLayer::build_local() {
+		mcl::TraceSpan span("DeviceLayer::build", "build");
 		boost::unique_lock<boost::mutex> lk(m_build_mutex);
 		if(m_build_started)
 			return;
 		m_build_started = true;
 		std::map<std::string, mclang::ExpressionRef> exs = expressions();
-		size_t expr_size = exs.size();
+		if(exs.empty()) {
+			m_built_at = boost::posix_time::microsec_clock::universal_time();
+			m_build_finished = true;
+			m_finish_cond.notify_all();
+			return;
+		}
+		m_in_place = find_in_place(exs);
+		for(auto w = m_waiting.begin(); w!=m_waiting.end();) {
+			if(exs.find(w->first)!=exs.end()) {
+				w++;
+				continue;
+			}
+			for(auto i = w->second.begin(); i!=w->second.end(); i++)
+				(*i)->set_exception(boost::copy_exception(NotFoundException(std::string("kernel:") + w->first)));
+			m_waiting.erase(w++);
+		}
+		size_t expr_size = exs.size(), generation = m_generation;
+		m_pending += expr_size;
 		for(auto i = exs.begin(); i!=exs.end(); i++) {
 			std::string name = i->first;
 			mclang::ExpressionRef expr = i->second;
-			mcl::Program program(context().mcl_context(), expr->build());
+			m_expressions[name] = expr;
+			m_aliased[name] = aliases(name, m_in_place);
+			// analyzed once, every bind of the kernel reuses the live arguments
+			m_analyzed[name] = expr->analyze(0, m_aliased[name]);
 			auto self = this;
-			program.build([name, program, expr, self, expr_size]() mutable {
-				self->program_ready(name, program, expr, expr_size);
+			m_programs[name] = ProgramCache::global().acquire(context().mcl_context(), context().device(), expr->build(m_analyzed[name]), [self, generation]() {
+				return self->is_current(generation);
+			}, [name, expr, self, expr_size, generation](const mcl::Program &p) {
+				mcl::Program program(p);
+				self->program_ready(name, program, expr, expr_size, generation);
 			});
 		}
 	}
-	mcl::Kernel DeviceLayer::kernel(const std::string &nm) {
-		build();
-		wait_for_build();
+	const Argument *DeviceLayer::find_in_place(const std::map<std::string, mclang::ExpressionRef> &exs) {
+		for(auto a = arguments().begin(); a!=arguments().end(); a++) {
+			if(!(bool)a->value() || a->value()->consumers()!=1)
+				continue;
+			bool writes = false, pointwise = true;
+			for(auto i = exs.begin(); i!=exs.end() && pointwise; i++) {
+				mclang::ExpressionRef out = output_buffer(i->first);
+				if(!(bool)out)
+					continue;
+				writes = true;
+				mclang::ExpressionRef in = input_buffer(i->first, *a);
+				pointwise = (bool)in && i->second->is_pointwise(in.get(), out.get());
+			}
+			if(writes && pointwise)
+				return &(*a);
+		}
+		return 0;
+	}
+	boost::posix_time::ptime DeviceLayer::wait_built() {
+		for(;;) {
+			build_local();
+			wait_for_build();
+			boost::lock_guard<boost::mutex> lk(m_build_mutex);
+			if(m_build_finished)
+				return m_built_at;
+		}
+	}
+	void DeviceLayer::check_build() {
+		boost::lock_guard<boost::mutex> lk(m_build_mutex);
+		for(auto i = kernels.begin(); i!=kernels.end(); i++)
+			if(!(bool)i->second.second)
+				throw BuildException(i->first, i->second.first);
+	}
+	mclang::ExpressionsSet DeviceLayer::aliases(const std::string &name, const Argument *in_place) {
+		mclang::ExpressionsSet r;
+		if(in_place) {
+			mclang::ExpressionRef out = output_buffer(name);
+			if((bool)out) {
+				r.insert(input_buffer(name, *in_place).get());
+				r.insert(out.get());
+			}
+		}
+		return r;
+	}
+	bool DeviceLayer::rebind() {
+		std::map<std::string, std::string> built;
+		size_t generation;
+		{
+			boost::lock_guard<boost::mutex> lk(m_build_mutex);
+			if(!m_build_finished)
+				return false;
+			generation = m_generation;
+			for(auto i = kernels.begin(); i!=kernels.end(); i++)
+				built[i->first] = i->second.first.source();
+		}
+		std::map<std::string, mclang::ExpressionRef> exs = expressions();
+		if(exs.size()!=built.size())
+			return false;
+		const Argument *in_place = find_in_place(exs);
+		std::map<std::string, mclang::ExpressionsSet> aliased;
+		std::map<std::string, mclang::Expression::BuildContext> analyzed;
+		for(auto i = exs.begin(); i!=exs.end(); i++) {
+			auto b = built.find(i->first);
+			aliased[i->first] = aliases(i->first, in_place);
+			analyzed[i->first] = i->second->analyze(0, aliased[i->first]);
+			if(b==built.end() || i->second->build(analyzed[i->first])!=b->second)
+				return false;
+		}
 		boost::lock_guard<boost::mutex> lk(m_build_mutex);
+		if(generation!=m_generation)
+			return false; // reset meanwhile
+		m_expressions = exs;
+		m_aliased = aliased;
+		m_analyzed = analyzed;
+		m_in_place = in_place;
+		return true;
+	}
+	const Argument *DeviceLayer::in_place_argument() {
+		boost::lock_guard<boost::mutex> lk(m_build_mutex);
+		// another consumer may have appeared since the build, the kernels stay valid without restrict
+		if(m_in_place && m_in_place->value()->consumers()!=1)
+			return 0;
+		return m_in_place;
+	}
+	void DeviceLayer::request_build(bool settle) {
+		{
+			boost::lock_guard<boost::mutex> lk(m_build_mutex);
+			if(m_build_started)
+				return;
+		}
+		auto self = this;
+		if(settle)
+			BuildScheduler::global().debounce(this, [self]() { self->build(); });
+		else
+			BuildScheduler::global().expedite(this, [self]() { self->build(); });
+	}
+	boost::shared_future<mcl::Kernel> DeviceLayer::kernel_async(const std::string &nm, bool settle) {
+		request_build(settle);
+		boost::lock_guard<boost::mutex> lk(m_build_mutex);
+		std::shared_ptr<boost::promise<mcl::Kernel>> p(new boost::promise<mcl::Kernel>());
+		boost::shared_future<mcl::Kernel> r(p->get_future());
 		auto i = kernels.find(nm);
-		if(i==kernels.end())
-			throw NotFoundException(std::string("kernel:") + nm);
-		else {
-			if((bool)(i->second.second))
-				return *(i->second.second);
+		if(i!=kernels.end()) {
+			if((bool)i->second.second)
+				p->set_value(*(i->second.second));
 			else
-				throw BuildException(i->first, i->second.first);
+				p->set_exception(boost::copy_exception(BuildException(i->first, i->second.first)));
+		} else if(m_build_started && m_expressions.find(nm)==m_expressions.end())
+			throw NotFoundException(std::string("kernel:") + nm);
+		else
+			m_waiting[nm].push_back(p);
+		return r;
+	}
+	std::shared_ptr<mcl::Kernel> DeviceLayer::current_kernel(const std::string &nm) {
+		request_build(true);
+		std::shared_ptr<mcl::Kernel> generic;
+		Stale stale;
+		{
+			boost::lock_guard<boost::mutex> lk(m_build_mutex);
+			auto i = kernels.find(nm);
+			if(i!=kernels.end() && (bool)i->second.second)
+				generic = i->second.second;
+			else {
+				auto s = m_stale.find(nm);
+				if(s==m_stale.end())
+					return std::shared_ptr<mcl::Kernel>();
+				stale = s->second;
+			}
+		}
+		// a kernel object of its own, the caller sets nothing shared with other threads
+		if((bool)generic)
+			return std::shared_ptr<mcl::Kernel>(new mcl::Kernel(bind(*generic, nm, true)));
+		std::shared_ptr<mcl::Kernel> k(new mcl::Kernel(stale.program->kernel("main_kernel")));
+		stale.expression->set_arguments(*k, stale.analyzed);
+		return k;
+	}
+	mcl::Kernel DeviceLayer::kernel(const std::string &nm) {
+		// the caller blocks, the build starts through the scheduler without waiting for edits to settle
+		return kernel_async(nm, false).get();
+	}
+	mcl::Kernel DeviceLayer::bind(const std::string &nm, bool own) {
+		return bind(kernel(nm), nm, own);
+	}
+	mcl::Kernel DeviceLayer::bind(const mcl::Kernel &built, const std::string &nm, bool own) {
+		mcl::Kernel generic = built;
+		mclang::ExpressionRef expr;
+		mclang::ExpressionsSet aliased;
+		mclang::Expression::BuildContext analyzed;
+		{
+			boost::lock_guard<boost::mutex> lk(m_build_mutex);
+			expr = m_expressions[nm];
+			aliased = m_aliased[nm];
+			analyzed = m_analyzed[nm];
+		}
+		// looked up by the specialized values, the source is generated only for a new variant,
+		// key, source and bound arguments come from one snapshot of the values
+		mclang::Expression::Specialization values = expr->specialization();
+		std::string key = nm + "\n" + values.key;
+		boost::unique_lock<boost::mutex> lk(m_build_mutex);
+		auto g = kernels.find(nm);
+		if(g!=kernels.end() && !values.empty()) {
+			auto i = m_variants.find(key);
+			if(i==m_variants.end()) {
+				lk.unlock();
+				mclang::Expression::BuildContext variant = expr->analyze(&values, aliased);
+				std::string source = expr->build(variant);
+				lk.lock();
+				g = kernels.find(nm);
+				if(g!=kernels.end() && m_variants.find(key)==m_variants.end()) {
+					if(m_variants.size()>=max_variants) {
+						m_variants.erase(m_variants_order.front());
+						m_variants_order.pop_front();
+					}
+					auto self = this;
+					ProgramCache::EntryRef entry = ProgramCache::global().acquire(context().mcl_context(), context().device(), source, []() { return true; }, [key, self](const mcl::Program &p) {
+						mcl::Program program(p);
+						self->variant_ready(key, program);
+					});
+					m_variants.insert(std::make_pair(key, Variant(entry, variant)));
+					m_variants_order.push_back(key);
+					m_pending++;
+				}
+			} else if(i->second.ready && (bool)i->second.kernel) {
+				m_variants_order.remove(key);
+				m_variants_order.push_back(key);
+				mcl::Kernel k = own ? i->second.program.kernel("main_kernel") : *(i->second.kernel);
+				mclang::Expression::BuildContext variant = i->second.analyzed;
+				lk.unlock();
+				expr->set_arguments(k, variant);
+				return k;
+			}
+		}
+		if(own && g!=kernels.end())
+			generic = g->second.first.kernel("main_kernel");
+		if(lk.owns_lock())
+			lk.unlock();
+		expr->set_arguments(generic, analyzed);
+		return generic;
+	}
+	mcl::Event DeviceLayer::dispatch(Executor &ex, const std::string &nm, cl_uint dims, const size_t *global, const std::vector<mcl::Event> &deps) {
+		Region r = ex.region(this);
+		size_t offset[] = { 0, 0, 0 };
+		size_t size[] = { 1, 1, 1 };
+		std::copy(global, global+dims, size);
+		if(dims>=2 && !r.is_everything()) {
+			r = r.clipped(size[0], size[1]);
+			if(r.is_empty())
+				return mcl::Event();
+			Region f = ex.frame();
+			offset[0] = r.x - f.x;
+			offset[1] = r.y - f.y;
+			size[0] = r.width;
+			size[1] = r.height;
 		}
+		boost::lock_guard<boost::mutex> lk(m_dispatch_mutex);
+		set_scale(ex.resolution());
+		if(ex.priority()==pr_interactive) {
+			// the last good kernel while a new structure compiles, nothing before the first build
+			std::shared_ptr<mcl::Kernel> k = current_kernel(nm);
+			if(!(bool)k) {
+				check_build();
+				ex.skip(this);
+				return mcl::Event();
+			}
+			if(ex.dispatcher())
+				return ex.dispatcher()->submit(*k, dims, size, offset, NULL, ex.priority(), deps)->done();
+			return ex.queue(this).enqueue(*k, dims, size, offset, NULL, deps);
+		}
+		if(ex.dispatcher()) {
+			// the dispatcher enqueues slices after this returns, other binds must not touch the kernel meanwhile
+			return ex.dispatcher()->submit(bind(nm, true), dims, size, offset, NULL, ex.priority(), deps)->done();
+		}
+		return ex.queue(this).enqueue(bind(nm), dims, size, offset, NULL, deps);
+	}
+	mcl::Event DeviceLayer::execute(Executor &ex, const std::vector<mcl::Event> &deps) {
+		Storage st = storage();
+		if(st.kind==Storage::sk_none)
+			return mcl::Event();
+		if(!st.width || !st.height)
+			throw mcl::Error(CL_INVALID_GLOBAL_WORK_SIZE); // buffers without rows have no pixels to map work-items to
+		size_t global[] = { st.width, st.height };
+		std::map<std::string, mclang::ExpressionRef> exs;
+		{
+			boost::lock_guard<boost::mutex> lk(m_build_mutex);
+			exs = m_expressions;
+		}
+		if(exs.empty())
+			exs = expressions(); // only the names, dispatch requests the build
+		mcl::Event last;
+		std::vector<mcl::Event> d = deps;
+		for(auto i = exs.begin(); i!=exs.end(); i++) {
+			mcl::Event e = dispatch(ex, i->first, 2, global, d);
+			if(!e.empty()) {
+				last = e;
+				d.assign(1, e);
+			}
+		}
+		return last;
 	}
 	void DeviceLayer::reset_cache() {
-		wait_for_build();
 		Layer::reset_cache();
+		if(rebind()) {
+			inc_parameter_version();
+			return;
+		}
 		boost::lock_guard<boost::mutex> lk(m_build_mutex);
+		inc_structure_version();
+		for(auto i = kernels.begin(); i!=kernels.end(); i++) {
+			if(!(bool)i->second.second)
+				continue;
+			Stale &s = m_stale[i->first];
+			s.program.reset(new mcl::Program(i->second.first));
+			s.expression = m_expressions[i->first];
+			s.analyzed = m_analyzed[i->first];
+		}
+		m_generation++;
 		m_build_started = m_build_finished = false;
+		m_finish_cond.notify_all();
 		kernels.clear();
+		m_expressions.clear();
+		m_programs.clear();
+		m_aliased.clear();
+		m_analyzed.clear();
+		m_in_place = 0;
+		m_variants.clear();
+		m_variants_order.clear();
+	}
+	DeviceLayer::~DeviceLayer() {
+		BuildScheduler::global().cancel(this);
+		boost::unique_lock<boost::mutex> lk(m_build_mutex);
+		m_finish_cond.wait(lk, [this]{ return m_pending==0; });
 	}
 	
 }
@@ -5,10 +5,16 @@
 
 #include "mcl.hpp"
 #include "mclang.hpp"
+#include "spill.hpp"
+#include "scheduler.hpp"
+#include "programs.hpp"
+#include "dispatch.hpp"
 #include "CL/cl.h"
 #include <iostream>
 #include <exception>
 #include <map>
+#include <list>
+#include <atomic>
 #include <boost/thread.hpp>
 
 namespace layer {
@@ -38,6 +44,17 @@ namespace layer {
 		~BuildException() throw();
 	};
 	
+	class FormatException : public std::exception {
+	private:
+		size_t m_line;
+		std::string message;
+	public:
+		FormatException(size_t line, const std::string &msg) : m_line(line), message(msg) {}
+		size_t line() const { return m_line; }
+		const char *what() const throw();
+		~FormatException() throw();
+	};
+	
 	class Type {
 	public:
 		typedef long type;
@@ -52,6 +69,26 @@ namespace layer {
 	
 	class Layer;
 	class Context;
+	class Executor;
+	
+	// device memory occupied by a layer output
+	class Storage {
+	public:
+		enum kind_t { sk_none, sk_buffer, sk_image };
+		kind_t kind;
+		size_t size;
+		cl_image_format format;
+		size_t width;
+		size_t height;
+		Storage() : kind(sk_none), size(0), width(0), height(0) {}
+		static Storage buffer(size_t sz);
+		static Storage buffer(size_t sz, size_t w, size_t h); // rows of pixels
+		static Storage image(const cl_image_format &f, size_t w, size_t h);
+		bool compatible(const Storage &) const;
+		bool operator==(const Storage &s) const { return compatible(s) && size==s.size && width==s.width && height==s.height; }
+		// storage of a part, buffers without rows keep their size
+		Storage part(const Region &) const;
+	};
 	
 	class LayerFactory {
 	public:
@@ -61,20 +98,29 @@ namespace layer {
 	class Context {
 	private:
 		mcl::Context m_context;
-		mcl::Queue m_queue;
+		std::vector<mcl::Queue> m_queues; // by priority
+		std::shared_ptr<SpillCache> m_cache; // shared by the copies held in layers
+		std::shared_ptr<Dispatcher> m_dispatcher;
 		static std::map<std::string, LayerFactory *> m_factory;
 	public:
-		Context(mcl::Context &c, mcl::Device &d) : m_context(c), m_queue(c, d) {}
-		mcl::Queue queue() { return m_queue; }
-		mcl::Context mcl_context() { return m_context; }
-		mcl::Device device() { return m_queue.device(); }
-		std::shared_ptr<Layer> create(const std::string &nm) {
-			auto fit = m_factory.find(nm);
-			if(fit==m_factory.end())
-				throw NotFoundException(std::string("layer:") + nm);
-			else
-				return fit->second->create(*this);
+		Context(mcl::Context &c, mcl::Device &d) : m_context(c) {
+			for(int p=0; p<pr_count; p++)
+				m_queues.push_back(mcl::Queue(c, d, true, mcl::Trace::enabled()));
+			m_cache.reset(new SpillCache(m_context, m_queues[pr_transfer]));
+			m_dispatcher.reset(new Dispatcher(m_queues[pr_interactive], m_queues[pr_background]));
+		}
+		// the viewport uses the interactive queue, exports the background one and cache copies the transfer one
+		mcl::Queue queue(Priority p=pr_interactive) { return m_queues[p]; }
+		// enqueues a kernel on the queue of its class, background ones in slices yielding to interactive work
+		DispatchRef submit(const mcl::Kernel &k, cl_uint dims, const size_t *global, const size_t *offset=NULL, const size_t *local=NULL,
+				Priority p=pr_interactive, const std::vector<mcl::Event> &deps=std::vector<mcl::Event>()) {
+			return m_dispatcher->submit(k, dims, global, offset, local, p, deps);
 		}
+		Dispatcher &dispatcher() { return *m_dispatcher; }
+		SpillCache &cache() { return *m_cache; }
+		mcl::Context mcl_context() { return m_context; }
+		mcl::Device device() { return m_queues[pr_interactive].device(); }
+		std::shared_ptr<Layer> create(const std::string &nm);
 		static inline void register_factory(const std::string &nm, LayerFactory &f) {
 			m_factory.insert(std::pair<std::string, LayerFactory *>(nm, &f));
 		}
@@ -87,7 +133,7 @@ namespace layer {
 		Layer *m_owner;
 		std::string m_name;
 	public:
-		Argument(Type::type tp, std::string nm) : m_type(tp), m_name(nm) {}
+		Argument(Type::type tp, std::string nm) : m_type(tp), m_owner(0), m_name(nm) {}
 		const std::string &name() const {
 			return m_name;	
 		}
@@ -113,14 +159,32 @@ namespace layer {
 		std::map<std::string, std::vector<Argument>::iterator> p_arguments;
 		Context m_context;
 		mclang::ExpressionRef m_position;
-		long long m_version;
-		Layer *m_parent;
+		std::atomic<long long> m_version; // read by background renders
+		long long m_structure_version;
+		long long m_parameter_version;
+		long long m_clean_since; // whole output changed at this version
+		std::list<std::pair<long long, Region>> m_dirty; // output parts changed after it
+		std::vector<Layer *> m_consumers; // owner of every argument this layer is the value of
+		std::shared_ptr<mclang::Argument<cl_float>> m_scale;
+		std::string m_factory_name;
 	protected:
 		mclang::ExpressionRef position() const {
 			return m_position;
 		}
+		// full resolution distance (stencil radius, position offset) in preview pixels
+		mclang::ExpressionRef scaled(const mclang::ExpressionRef &d) const {
+			return d/scale();
+		}
+		// value bound to scale() by the next bind, set by the caller holding the dispatch lock
+		void set_scale(size_t resolution) { m_scale->set(cl_float(resolution)); }
+		// value bound to the kernels, the sources and the built programs stay valid
+		template<typename T>
+		void set_parameter(mclang::Argument<T> &a, const T &v) {
+			a.set(v);
+			parameters_changed();
+		}
 	public:
-		Layer(Context &c, const std::vector<Argument> &args) : m_arguments(args), m_context(c), m_version(1), m_parent(0) {
+		Layer(Context &c, const std::vector<Argument> &args) : m_arguments(args), m_context(c), m_version(1), m_structure_version(1), m_parameter_version(1), m_clean_since(1), m_scale(mclang::arg<cl_float>(1.0f)) {
 			for(auto i = m_arguments.begin(); i!=m_arguments.end(); i++) {
 				i->set_owner(this);
 				p_arguments.insert(std::pair<std::string, std::vector<Argument>::iterator>(i->name(), i));
@@ -128,28 +192,71 @@ namespace layer {
 		}
 		
 		virtual void build();
+		// builds this layer only, arguments are built separately
+		virtual void build_local() {}
 		virtual void reset_cache();
 		
 		Context &context() { return m_context; }
 		virtual std::string class_name() const;
+		// name the layer was created by, empty if not created through a factory
+		const std::string &factory_name() const { return m_factory_name; }
+		void set_factory_name(const std::string &nm) { m_factory_name = nm; }
 		const std::vector<Argument> &arguments() const { return m_arguments; }
 		std::vector<Argument> &arguments() { return m_arguments; }
 		const Argument &argument(const std::string &name) const {
 			return *(p_arguments.find(name)->second);
 		}
 		Argument &argument(const std::string &name) { return *p_arguments[name]; }
-		void set_position(const mclang::ExpressionRef &e) { reset_cache(); m_position = e;	}
+		void set_position(const mclang::ExpressionRef &e) { inc_version(); reset_cache(); m_position = e;	}
 		
-		Layer *parent() { return m_parent; }
-		const Layer *parent() const { return m_parent; }
-		void set_parent(Layer *p) { m_parent = p; }
+		// layers reading this one, once per argument
+		const std::vector<Layer *> &consumer_layers() const { return m_consumers; }
+		size_t consumers() const { return m_consumers.size(); }
+		void add_consumer(Layer *c) { m_consumers.push_back(c); }
+		void remove_consumer(Layer *c) {
+			auto i = std::find(m_consumers.begin(), m_consumers.end(), c);
+			if(i!=m_consumers.end())
+				m_consumers.erase(i);
+		}
+		// argument whose output this layer can overwrite with its own result, decided by the build, none before it
+		virtual const Argument *in_place_argument() { return 0; }
+		virtual Storage storage() const { return Storage(); }
+		// output written from outside the graph instead of by execute, only full size plans hold it
+		virtual bool external() const { return false; }
+		// part of an argument read to compute a part of the output, identity unless the layer moves pixels
+		virtual Region input_region(const Argument &, const Region &output) const;
+		// part of the output depending on a part of an argument
+		virtual Region affected_region(const Argument &, const Region &input) const;
+		// enqueues the commands writing the output after deps, an empty event if the layer has no commands of its own
+		virtual mcl::Event execute(Executor &, const std::vector<mcl::Event> & /*deps*/) { return mcl::Event(); }
 		
 		virtual mclang::ExpressionRef compute(size_t) = 0;
 		
-		// version
+		// previews are 1/resolution of the full size, stencil radii and positions are divided by scale() in the kernels,
+		// the resolution comes from the executor of each render
+		mclang::ExpressionRef scale() const { return m_scale; }
+		
+		// version, changes with the layer or any of its arguments
 		long long version() const { return m_version; }
 		void inc_version() { m_version++; }
 		void set_version(long long v) { m_version = v; }
+		// source of the layer changed, kernels are rebuilt
+		long long structure_version() const { return m_structure_version; }
+		void inc_structure_version() { m_structure_version++; }
+		// only values bound to the kernels changed
+		long long parameter_version() const { return m_parameter_version; }
+		void inc_parameter_version() { m_parameter_version++; }
+		// whole output of this layer and its consumers changed, their kernels are kept
+		void parameters_changed();
+		static const size_t max_dirty = 64;
+		// marks a part of the output changed and propagates it to the consumers
+		void invalidate(const Region &);
+		// parts of the output changed after a version, false if the whole output changed
+		bool dirty_regions(long long since, std::vector<Region> &) const;
+		
+		// computed outputs of the current version
+		bool cached_result(const Region &, size_t resolution, ResultCache::Entry &);
+		void cache_result(const Region &, size_t resolution, const ResultCache::Entry &);
 		
 		virtual ~Layer();
 	};
@@ -182,32 +289,127 @@ namespace layer {
 	
 	class DeviceLayer : public Layer {
 	private:
+		struct Variant {
+			ProgramCache::EntryRef entry;
+			mcl::Program program;
+			std::shared_ptr<mcl::Kernel> kernel;
+			mclang::Expression::BuildContext analyzed; // the source was generated from it, binds the kernel
+			bool ready;
+			Variant(const ProgramCache::EntryRef &e, const mclang::Expression::BuildContext &a) : entry(e), program(e->program()), analyzed(a), ready(false) {}
+		};
+		static const size_t max_variants = 16;
 		std::map<std::string, std::pair<mcl::Program, std::shared_ptr<mcl::Kernel>>> kernels;
+		std::map<std::string, mclang::ExpressionRef> m_expressions;
+		std::map<std::string, ProgramCache::EntryRef> m_programs; // shared programs in use
+		std::map<std::string, Variant> m_variants; // specialized programs by kernel name and specialized values
+		std::list<std::string> m_variants_order;
+		std::map<std::string, mclang::ExpressionsSet> m_aliased; // input and output buffers of in-place kernels
+		std::map<std::string, mclang::Expression::BuildContext> m_analyzed; // of the generic sources, binds their kernels
+		const Argument *m_in_place;
+		struct Stale {
+			std::shared_ptr<mcl::Program> program;
+			mclang::ExpressionRef expression;
+			mclang::Expression::BuildContext analyzed;
+		};
+		std::map<std::string, Stale> m_stale; // last good kernels, served while a new structure compiles
+		std::map<std::string, std::list<std::shared_ptr<boost::promise<mcl::Kernel>>>> m_waiting;
+		size_t m_generation; // builds of older generations are ignored
+		size_t m_pending;
 		volatile bool m_build_started;
 		volatile bool m_build_finished;
+		boost::posix_time::ptime m_built_at;
 		boost::mutex m_build_mutex;
+		boost::mutex m_dispatch_mutex; // scale, arguments and enqueue of one dispatch
 		boost::condition_variable m_finish_cond;
 		void wait_for_build() {
+			mcl::TraceSpan span("DeviceLayer::wait_for_build", "build");
 			boost::unique_lock<boost::mutex> lk(m_build_mutex);
 			if(m_build_started && !m_build_finished)
-				m_finish_cond.wait(lk, [&m_build_finished]{ return m_build_finished; });
+				m_finish_cond.wait(lk, [this]{ return m_build_finished || !m_build_started; });
 		}
-		void program_ready(const std::string &name, mcl::Program &program, mclang::ExpressionRef expr, size_t sz) {
+		void program_ready(const std::string &name, mcl::Program &program, mclang::ExpressionRef expr, size_t sz, size_t generation) {
+			mcl::TraceSpan span("DeviceLayer::program_ready", "build");
 			boost::lock_guard<boost::mutex> lk(m_build_mutex);
-			if(program.build_status(context().device())!=CL_BUILD_SUCCESS)
-				kernels.insert(std::make_pair(name, std::make_pair(program, std::shared_ptr<mcl::Kernel>(new mcl::Kernel(program.kernel("main_kernel"))))));
-			else
-				kernels.insert(std::make_pair(name, std::make_pair(program, std::shared_ptr<mcl::Kernel>())));
+			m_pending--;
+			m_finish_cond.notify_all();
+			if(generation!=m_generation)
+				return;
+			std::shared_ptr<mcl::Kernel> k;
+			if(program.build_status(context().device())==CL_BUILD_SUCCESS)
+				k.reset(new mcl::Kernel(program.kernel("main_kernel")));
+			kernels.insert(std::make_pair(name, std::make_pair(program, k)));
+			if((bool)k)
+				m_stale.erase(name);
+			auto w = m_waiting.find(name);
+			if(w!=m_waiting.end()) {
+				for(auto i = w->second.begin(); i!=w->second.end(); i++) {
+					if((bool)k)
+						(*i)->set_value(*k);
+					else
+						(*i)->set_exception(boost::copy_exception(BuildException(name, program)));
+				}
+				m_waiting.erase(w);
+			}
 			if(kernels.size()==sz) {
+				m_built_at = boost::posix_time::microsec_clock::universal_time();
 				m_build_finished = true;
 				m_finish_cond.notify_all();
 			}
 		}
+		void variant_ready(const std::string &key, mcl::Program &program) {
+			boost::lock_guard<boost::mutex> lk(m_build_mutex);
+			m_pending--;
+			m_finish_cond.notify_all();
+			auto i = m_variants.find(key);
+			if(i==m_variants.end() || i->second.program.id()!=program.id())
+				return; // dropped by reset_cache
+			if(program.build_status(context().device())==CL_BUILD_SUCCESS)
+				i->second.kernel.reset(new mcl::Kernel(program.kernel("main_kernel")));
+			i->second.ready = true;
+		}
+		const Argument *find_in_place(const std::map<std::string, mclang::ExpressionRef> &);
+		mclang::ExpressionsSet aliases(const std::string &, const Argument *in_place);
+		// generates the sources without the build lock, keeps the kernels if they did not change
+		bool rebind();
+		bool is_current(size_t generation) {
+			boost::lock_guard<boost::mutex> lk(m_build_mutex);
+			return generation==m_generation;
+		}
+		// settle: the build waits for edits to stop, otherwise it starts as soon as the scheduler runs it
+		void request_build(bool settle);
 	protected:
+		// waits for the kernel of the current structure, throws BuildException if it failed
 		mcl::Kernel kernel(const std::string &);
+		// own: a kernel object no other bind returns, for commands enqueued after the call,
+		// otherwise the shared kernel, bound and enqueued while holding m_dispatch_mutex
+		mcl::Kernel bind(const std::string &, bool own=false);
+		// binds a built generic kernel or its specialized variant, never waits for a build
+		mcl::Kernel bind(const mcl::Kernel &generic, const std::string &, bool own);
+		// binds the kernel and enqueues it on the executor queue of this layer, 2D ranges cover the region
+		// at its position in the frame of the executor,
+		// interactive executors get the current kernel and skip the layer while none is built
+		mcl::Event dispatch(Executor &, const std::string &, cl_uint dims, const size_t *global, const std::vector<mcl::Event> &deps);
+		// buffer nodes of an expression reading an argument's output and writing this layer's output
+		virtual mclang::ExpressionRef input_buffer(const std::string &, const Argument &) { return mclang::ExpressionRef(); }
+		virtual mclang::ExpressionRef output_buffer(const std::string &) { return mclang::ExpressionRef(); }
 	public:
+		DeviceLayer(Context &c, const std::vector<Argument> &args) : Layer(c, args), m_in_place(0), m_generation(0), m_pending(0), m_build_started(false), m_build_finished(false) {}
+		~DeviceLayer();
 		virtual std::map<std::string, mclang::ExpressionRef> expressions() = 0;
-		void build();
+		void build_local();
+		// waits for the programs of the current structure, returns when they finished building
+		boost::posix_time::ptime wait_built();
+		// throws BuildException for the first kernel of the current structure that failed to compile
+		void check_build();
+		// completes when the kernel of the current structure is built, the build starts once edits settle
+		// unless the caller is about to block on it
+		boost::shared_future<mcl::Kernel> kernel_async(const std::string &, bool settle=true);
+		// bound kernel of the current structure, or of the last successful one while it compiles, empty if none,
+		// never waits for a build and is not shared with other callers
+		std::shared_ptr<mcl::Kernel> current_kernel(const std::string &);
+		const Argument *in_place_argument();
+		// one work-item per pixel of storage(), the expressions run one after another in name order
+		mcl::Event execute(Executor &, const std::vector<mcl::Event> &deps);
 		virtual void reset_cache();
 	};
 }
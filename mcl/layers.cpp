@@ -0,0 +1,109 @@
+#include "layers.hpp"
+#include "execute.hpp"
+
+namespace layer {
+
+	void SourceLayer::set_size(size_t w, size_t h) {
+		if(w==m_width && h==m_height)
+			return;
+		{
+			boost::lock_guard<boost::mutex> lk(m_pixels_mutex);
+			m_pixels.reset();
+			m_width = w;
+			m_height = h;
+		}
+		parameters_changed();
+	}
+	
+	void SourceLayer::set_pixels(const cl_uchar4 *p, size_t w, size_t h) {
+		std::shared_ptr<const std::vector<cl_uchar4>> pixels(new std::vector<cl_uchar4>(p, p + w*h));
+		{
+			boost::lock_guard<boost::mutex> lk(m_pixels_mutex);
+			m_pixels = pixels;
+			m_width = w;
+			m_height = h;
+		}
+		parameters_changed();
+	}
+	
+	bool SourceLayer::external() const {
+		boost::lock_guard<boost::mutex> lk(m_pixels_mutex);
+		return !(bool)m_pixels;
+	}
+	
+	mcl::Event SourceLayer::execute(Executor &ex, const std::vector<mcl::Event> &deps) {
+		std::shared_ptr<const std::vector<cl_uchar4>> pixels;
+		size_t w, h;
+		{
+			boost::lock_guard<boost::mutex> lk(m_pixels_mutex);
+			pixels = m_pixels;
+			w = m_width;
+			h = m_height;
+		}
+		if(!(bool)pixels)
+			return mcl::Event();
+		// the pulled part goes to its position in the frame
+		Region r = ex.region(this).clipped(w, h), f = ex.frame();
+		if(r.is_empty())
+			return mcl::Event();
+		size_t pixel = sizeof(cl_uchar4);
+		size_t buffer_origin[] = { (r.x - f.x)*pixel, r.y - f.y, 0 };
+		size_t host_origin[] = { r.x*pixel, r.y, 0 };
+		size_t region[] = { r.width*pixel, r.height, 1 };
+		mcl::Event e = ex.queue(this).write(pixels->data(), ex.buffer(this), buffer_origin, host_origin, region, ex.storage(this).width*pixel, w*pixel, deps);
+		// the write reads the copy after set_pixels may have replaced it
+		e.on_complete([pixels]() {});
+		return e;
+	}
+
+	PointLayer::PointLayer(Context &c) : DeviceLayer(c, std::vector<Argument>(1, Argument(Type::ltp_color, "image"))),
+			m_input(mclang::argv<cl_uchar4>()), m_output(mclang::argv<cl_uchar4>()), m_pitch(mclang::arg<cl_uint>(0)) {}
+
+	std::map<std::string, mclang::ExpressionRef> PointLayer::expressions() {
+		std::map<std::string, mclang::ExpressionRef> r;
+		// row-major over a 2D range, still one element per work-item
+		mclang::ExpressionRef i = mclang::get_global_id(1)*m_pitch + mclang::get_global_id(0);
+		r["main"] = mclang::set(mclang::select(m_output, i), pixel(mclang::select(m_input, i)));
+		return r;
+	}
+
+	mclang::ExpressionRef PointLayer::input_buffer(const std::string &, const Argument &a) {
+		return &a==&argument("image") ? mclang::ExpressionRef(m_input) : mclang::ExpressionRef();
+	}
+
+	mclang::ExpressionRef PointLayer::output_buffer(const std::string &) {
+		return m_output;
+	}
+
+	Storage PointLayer::storage() const {
+		const std::shared_ptr<Layer> v = argument("image").value();
+		return (bool)v ? v->storage() : Storage();
+	}
+
+	mcl::Event PointLayer::execute(Executor &ex, const std::vector<mcl::Event> &deps) {
+		const std::shared_ptr<Layer> v = argument("image").value();
+		if(!(bool)v)
+			return mcl::Event();
+		// only the region is computed, the argument has the same planned storage and frame
+		Storage full = storage(), st = ex.storage(this);
+		if(!full.width || !full.height)
+			return mcl::Event();
+		size_t global[] = { full.width, full.height };
+		boost::lock_guard<boost::mutex> lk(m_buffers_mutex);
+		m_input->set(ex.buffer(v.get()));
+		m_output->set(ex.buffer(this));
+		m_pitch->set(cl_uint(st.width));
+		return dispatch(ex, "main", 2, global, deps);
+	}
+
+	InvertLayer::InvertLayer(Context &c) : PointLayer(c) {
+		cl_uchar4 mask = {{ 255, 255, 255, 0 }};
+		m_mask = mclang::arg<cl_uchar4>(mask);
+		m_mask->set_specialized(true); // rarely changes, every mask gets a specialized variant
+	}
+
+	void register_layers() {
+		static LayerFactoryRegistrar<SourceLayer> source("source");
+		static LayerFactoryRegistrar<InvertLayer> invert("invert");
+	}
+}
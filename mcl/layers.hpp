@@ -0,0 +1,64 @@
+#ifndef MAY_LAYERS_HPP
+#define MAY_LAYERS_HPP
+
+#include "layer.hpp"
+
+namespace layer {
+
+	// outputs are 8 bit RGBA buffers with rows, one work-item per pixel
+
+	// output written from the host, the input of batch graphs
+	class SourceLayer : public Layer {
+	private:
+		size_t m_width;
+		size_t m_height;
+		std::shared_ptr<const std::vector<cl_uchar4>> m_pixels; // host copy the parts are uploaded from, absent if written from outside
+		mutable boost::mutex m_pixels_mutex;
+	public:
+		SourceLayer(Context &c) : Layer(c, std::vector<Argument>()), m_width(1), m_height(1) {}
+		// no kernel depends on the size, consumers keep their programs; pixels of another size are dropped
+		void set_size(size_t w, size_t h);
+		// copies the pixels, runs then upload the part they pull, tiled and preview renders need them
+		void set_pixels(const cl_uchar4 *, size_t w, size_t h);
+		Storage storage() const { return Storage::buffer(m_width*m_height*sizeof(cl_uchar4), m_width, m_height); }
+		bool external() const;
+		mcl::Event execute(Executor &, const std::vector<mcl::Event> &deps);
+		mclang::ExpressionRef compute(size_t) { return mclang::ExpressionRef(); }
+	};
+
+	// one pixel of the output from the same pixel of the argument, overwrites it when this layer is its only reader
+	class PointLayer : public DeviceLayer {
+	private:
+		std::shared_ptr<mclang::BuffArgument<cl_uchar4>> m_input;
+		std::shared_ptr<mclang::BuffArgument<cl_uchar4>> m_output;
+		std::shared_ptr<mclang::Argument<cl_uint>> m_pitch; // pixels between rows of both buffers
+		boost::mutex m_buffers_mutex; // buffers of one executor from setting them to the enqueue
+	protected:
+		virtual mclang::ExpressionRef pixel(const mclang::ExpressionRef &) = 0;
+		mclang::ExpressionRef input_buffer(const std::string &, const Argument &);
+		mclang::ExpressionRef output_buffer(const std::string &);
+	public:
+		PointLayer(Context &c);
+		std::map<std::string, mclang::ExpressionRef> expressions();
+		Storage storage() const;
+		mcl::Event execute(Executor &, const std::vector<mcl::Event> &deps);
+		mclang::ExpressionRef compute(size_t) { return mclang::ExpressionRef(); }
+	};
+
+	// inverts the colour, keeps the alpha
+	class InvertLayer : public PointLayer {
+	private:
+		std::shared_ptr<mclang::Argument<cl_uchar4>> m_mask;
+	protected:
+		mclang::ExpressionRef pixel(const mclang::ExpressionRef &p) { return p ^ m_mask; }
+	public:
+		InvertLayer(Context &c);
+		// bits flipped in every channel, 255 for the colour and 0 for the alpha by default
+		void set_mask(const cl_uchar4 &m) { set_parameter(*m_mask, m); }
+	};
+
+	// factories of the layers above, by the names used in saved graphs
+	void register_layers();
+}
+
+#endif // MAY_LAYERS_HPP
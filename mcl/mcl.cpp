@@ -29,6 +29,8 @@ static const std::vector<err_message_t> err_messages = {
 	{ CL_INVALID_OPERATION, "CL_INVALID_OPERATION: the build of a program executable for any of the devices listed in device_list by a previous call to clBuildProgram for program has not completed." },
 	{ CL_COMPILER_NOT_AVAILABLE, "CL_COMPILER_NOT_AVAILABLE: program is created with clCreateProgramWithSource and a compiler is not available i.e. CL_DEVICE_COMPILER_AVAILABLE specified in the table of OpenCL Device Queries for clGetDeviceInfo is set to CL_FALSE." },
 	{ CL_BUILD_PROGRAM_FAILURE, "CL_BUILD_PROGRAM_FAILURE: there is a failure to build the program executable. This error will be returned if clBuildProgram does not return until the build has completed." },
+	{ CL_INVALID_MEM_OBJECT, "CL_INVALID_MEM_OBJECT: memory object is not valid (e.g. a planned slot that was not allocated)." },
+	{ CL_INVALID_ARG_VALUE, "CL_INVALID_ARG_VALUE: argument value is not valid for the kernel parameter (e.g. one buffer bound to two restrict parameters)." },
 	{ CL_INVALID_KERNEL_ARGS, "CL_INVALID_KERNEL_ARGS: the kernel argument values have not been specified."},
 	{ CL_INVALID_KERNEL_NAME, "CL_INVALID_KERNEL_NAME: kernel_name is not found in program." },
 	{ CL_SUCCESS, "CL_SUCCESS: all right." }
@@ -77,6 +79,9 @@ namespace mcl {
 	Buffer Context::buffer_rw(const size_t sz) const {
 		return buffer(sz);
 	}
+	Buffer Context::buffer_host(const size_t sz) const {
+		return Buffer(*this, sz, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR);
+	}
 	Image Context::image(const cl_image_format &f, const size_t w, const size_t h) const {
 		return Image(*this, f, w, h, CL_MEM_READ_WRITE);	
 	}
@@ -94,6 +99,8 @@ namespace mcl {
 		kernel = clCreateKernel(p.id(), nm.c_str(), &err_code);
 		if(err_code!=CL_SUCCESS)
 			throw Error(err_code);
+		if(Capture::active())
+			Capture::kernel(kernel, p.id(), nm);
 	}
 	
 	template<>
@@ -102,6 +109,8 @@ namespace mcl {
 		cl_int err_code = clSetKernelArg(kernel, arg_index, sizeof(cl_mem), &buff_id);
 		if(err_code!=CL_SUCCESS)
 			throw Error(err_code);
+		if(Capture::active())
+			Capture::arg(kernel, arg_index, buff_id);
 		return *this;
 	}
 	template<>
@@ -110,6 +119,8 @@ namespace mcl {
 		cl_int err_code = clSetKernelArg(kernel, arg_index, sizeof(cl_mem), &buff_id);
 		if(err_code!=CL_SUCCESS)
 			throw Error(err_code);
+		if(Capture::active())
+			Capture::arg(kernel, arg_index, buff_id);
 		return *this;
 	}
 	template<>
@@ -11,6 +11,8 @@
 #include <assert.h>
 #include <iostream>
 #include <iomanip>
+#include "trace.hpp"
+#include "capture.hpp"
 
 namespace mcl {
 	class Error : public std::exception {
@@ -442,6 +444,7 @@ namespace mcl {
 		Buffer buffer_r(size_t sz) const;
 		Buffer buffer_w(size_t sz) const;
 		Buffer buffer_rw(size_t sz) const;
+		Buffer buffer_host(size_t sz) const; // pinned host memory
 		Image image(const cl_image_format &f, size_t w, size_t h) const;
 		Image image_r(const cl_image_format &f, size_t w, size_t h) const;
 		Image image_w(const cl_image_format &f, size_t w, size_t h) const;
@@ -456,12 +459,23 @@ namespace mcl {
 		Buffer(const Context &ctx, size_t sz, bool readable, bool writable) {
 			cl_int err_code;
 			if(readable || writable) {
-				buffer = clCreateBuffer(ctx.id(), (readable && writable) ? CL_MEM_READ_WRITE : (readable ? CL_MEM_READ_ONLY : CL_MEM_WRITE_ONLY), sz, NULL, &err_code);
+				cl_mem_flags flags = (readable && writable) ? CL_MEM_READ_WRITE : (readable ? CL_MEM_READ_ONLY : CL_MEM_WRITE_ONLY);
+				buffer = clCreateBuffer(ctx.id(), flags, sz, NULL, &err_code);
 				if(err_code!=CL_SUCCESS)
 					throw new Error(err_code);
+				if(Capture::active())
+					Capture::buffer(buffer, flags, sz);
 			} else
 				throw Error(CL_INVALID_VALUE);
 		}
+		Buffer(const Context &ctx, size_t sz, cl_mem_flags flags) {
+			cl_int err_code;
+			buffer = clCreateBuffer(ctx.id(), flags, sz, NULL, &err_code);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+			if(Capture::active())
+				Capture::buffer(buffer, flags, sz);
+		}
 		template<typename T>
 		T info_t(const cl_mem_info mi) const {
 			T r;
@@ -499,7 +513,7 @@ namespace mcl {
 		}
 		~Buffer() {
 			if(buffer)
-				clRetainMemObject(buffer);
+				clReleaseMemObject(buffer);
 		}
 		bool is_read_only() const {
 			return (info_t<cl_mem_flags>(CL_MEM_FLAGS) & CL_MEM_READ_ONLY)!=0;
@@ -557,6 +571,8 @@ namespace mcl {
 			image = clCreateImage2D(c.id(), flags, &format, w, h, 0, 0, &err_code);
 			if(err_code!=CL_SUCCESS)
 				throw Error(err_code);
+			if(Capture::active())
+				Capture::image(image, flags, format, w, h);
 		}
 	public:
 		Image(const Image &img) : image(img.image) {
@@ -722,6 +738,8 @@ namespace mcl {
 		cl_int err_code = clSetKernelArg(kernel, arg_index, sizeof(T), &arg);
 		if(err_code!=CL_SUCCESS)
 			throw Error(err_code);
+		if(Capture::active())
+			Capture::arg(kernel, arg_index, sizeof(T), &arg);
 		return *this;
 	}
 	
@@ -751,6 +769,8 @@ namespace mcl {
 					delete [] lengths;
 					if(err_code!=CL_SUCCESS)
 						throw Error(err_code);
+					if(Capture::active())
+						Capture::program(program, sv);
 				} catch(...) {
 					delete [] strings;
 					delete [] lengths;
@@ -807,18 +827,25 @@ namespace mcl {
 				return program;	
 			}
 			void build(const std::string &s = "") {
+				TraceSpan span("Program::build", "compile");
+				if(Capture::active())
+					Capture::build(program, s);
 				cl_int err_code = clBuildProgram(program, 0, NULL, s.c_str(), NULL, NULL);
 				if(err_code!=CL_SUCCESS)
 					throw Error(err_code);
 			}
 			template<class T>
 			void build(T cb) {
+				if(Capture::active())
+					Capture::build(program, "");
 				cl_int err_code = clBuildProgram(program, 0, NULL, "", program_cb<T>, new T(cb));
 				if(err_code!=CL_SUCCESS)
 					throw Error(err_code);
 			}
 			template<class T>
 			void build(const std::string &s, T cb) {
+				if(Capture::active())
+					Capture::build(program, s);
 				cl_int err_code = clBuildProgram(program, 0, NULL, s.c_str(), program_cb<T>, new T(cb));
 				if(err_code!=CL_SUCCESS)
 					throw Error(err_code);
@@ -878,14 +905,137 @@ namespace mcl {
 					throw;
 				}
 			}
+			std::string source() const {
+				size_t sz;
+				cl_int err_code = clGetProgramInfo(program, CL_PROGRAM_SOURCE, 0, NULL, &sz);
+				if(err_code!=CL_SUCCESS)
+					throw Error(err_code);
+				std::vector<char> s(sz);
+				err_code = clGetProgramInfo(program, CL_PROGRAM_SOURCE, sz, s.data(), NULL);
+				if(err_code!=CL_SUCCESS)
+					throw Error(err_code);
+				return std::string(s.data());
+			}
 			Kernel kernel(const std::string &nm) const {
 				return Kernel(*this, nm);
 			}
 	};
 	
+	template<class T>
+	void event_cb(cl_event, cl_int, void *data) {
+		try {
+			(*reinterpret_cast<T *>(data))();
+			delete reinterpret_cast<T *>(data);
+		} catch(...) {
+			delete reinterpret_cast<T *>(data);
+			throw;
+		}
+	}
+	
+	class Event {
+	private:
+		cl_event event;
+		template<typename T>
+		T info_t(const cl_event_info param_name) const {
+			T r;
+			cl_int err_code = clGetEventInfo(event, param_name, sizeof(T), &r, NULL);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+			return r;
+		}
+	public:
+		Event(cl_event e=NULL) : event(e) {}
+		Event(const Event &e) : event(e.event) {
+			if(event) {
+				cl_int err_code = clRetainEvent(event);
+				if(err_code!=CL_SUCCESS)
+					throw Error(err_code);
+			}
+		}
+		Event(Event &&e) : event(e.event) {
+			e.event = NULL;
+		}
+		Event &operator=(const Event &e) {
+			if(this!=&e) {
+				if(event) {
+					cl_int err_code = clReleaseEvent(event);
+					if(err_code!=CL_SUCCESS)
+						throw Error(err_code);
+				}
+				event = e.event;
+				if(event) {
+					cl_int err_code = clRetainEvent(event);
+					if(err_code!=CL_SUCCESS)
+						throw Error(err_code);
+				}
+			}
+			return *this;
+		}
+		~Event() {
+			if(event)
+				clReleaseEvent(event);
+		}
+		cl_event id() const {
+			return event;
+		}
+		bool empty() const {
+			return event==NULL;
+		}
+		// completed from the host with set_status
+		static Event user(const Context &c) {
+			cl_int err_code;
+			cl_event e = clCreateUserEvent(c.id(), &err_code);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+			return Event(e);
+		}
+		void set_status(cl_int st) const {
+			cl_int err_code = clSetUserEventStatus(event, st);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+		}
+		cl_int status() const {
+			return event ? info_t<cl_int>(CL_EVENT_COMMAND_EXECUTION_STATUS) : CL_COMPLETE;
+		}
+		const Event &wait() const {
+			if(event) {
+				cl_int err_code = clWaitForEvents(1, &event);
+				if(err_code!=CL_SUCCESS)
+					throw Error(err_code);
+			}
+			return *this;
+		}
+		template<class T>
+		void on_complete(T cb) {
+			if(!event) {
+				cb();
+				return;
+			}
+			cl_int err_code = clSetEventCallback(event, CL_COMPLETE, event_cb<T>, new T(cb));
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+		}
+		static std::vector<cl_event> ids(const std::vector<Event> &ev) {
+			std::vector<cl_event> r;
+			for(auto i = ev.begin(); i!=ev.end(); i++)
+				if(!i->empty())
+					r.push_back(i->id());
+			return r;
+		}
+	};
+	
 	class Queue {
 	private:
 		cl_command_queue queue;
+		// events of fire-and-forget commands are only requested while tracing
+		static cl_event *traced(cl_event &e) {
+			e = NULL;
+			return Trace::enabled() ? &e : NULL;
+		}
+		static void trace(const char *name, cl_event e) {
+			if(e)
+				Trace::device(name, e, Trace::now());
+		}
 		template<typename T, cl_command_queue_info QI>
 		const T info_t() const {
 			T r;
@@ -940,16 +1090,26 @@ namespace mcl {
 		}
 		template<typename T>
 		Queue &mov(const Buffer &b, T *v) {
-			cl_int err_code = clEnqueueReadBuffer(queue, b.id(), false, 0, b.size(), v, 0, NULL, NULL);
+			TraceSpan span("Queue::mov", "queue");
+			cl_event e;
+			cl_int err_code = clEnqueueReadBuffer(queue, b.id(), false, 0, b.size(), v, 0, NULL, traced(e));
 			if(err_code!=CL_SUCCESS)
 				throw Error(err_code);
+			if(Capture::active())
+				Capture::read(b.id(), b.size());
+			trace("read", e);
 			return *this;
 		}
 		template<typename T>
 		Queue &mov(const T *v, const Buffer &b) {
-			cl_int err_code = clEnqueueWriteBuffer(queue, b.id(), false, 0, b.size(), v, 0, NULL, NULL);
+			TraceSpan span("Queue::mov", "queue");
+			cl_event e;
+			cl_int err_code = clEnqueueWriteBuffer(queue, b.id(), false, 0, b.size(), v, 0, NULL, traced(e));
 			if(err_code!=CL_SUCCESS)
 				throw Error(err_code);
+			if(Capture::active())
+				Capture::write(b.id(), v, b.size());
+			trace("write", e);
 			return *this;
 		}
 		template<typename T>
@@ -969,18 +1129,28 @@ namespace mcl {
 		Queue &mov(const Image &img, T *v) {
 			size_t origin[] = { 0, 0, 0 };
 			size_t region[] = { img.width(), img.height(), 1 };
-			cl_int err_code = clEnqueueReadImage(queue, img.id(), false, origin, region, 0, 0, v, 0, NULL, NULL);
+			TraceSpan span("Queue::mov", "queue");
+			cl_event e;
+			cl_int err_code = clEnqueueReadImage(queue, img.id(), false, origin, region, 0, 0, v, 0, NULL, traced(e));
 			if(err_code!=CL_SUCCESS)
 				throw Error(err_code);
+			if(Capture::active())
+				Capture::read(img.id(), img.element_size()*img.width()*img.height());
+			trace("read", e);
 			return *this;
 		}
 		template<typename T>
 		Queue &mov(const T *v, const Image &img) {
 			size_t origin[] = { 0, 0, 0 };
 			size_t region[] = { img.width(), img.height(), 1 };
-			cl_int err_code = clEnqueueWriteImage(queue, img.id(), false, origin, region, 0, 0, v, 0, NULL, NULL);
+			TraceSpan span("Queue::mov", "queue");
+			cl_event e;
+			cl_int err_code = clEnqueueWriteImage(queue, img.id(), false, origin, region, 0, 0, v, 0, NULL, traced(e));
 			if(err_code!=CL_SUCCESS)
 				throw Error(err_code);
+			if(Capture::active())
+				Capture::write(img.id(), v, img.element_size()*img.width()*img.height());
+			trace("write", e);
 			return *this;
 		}
 		template<typename T>
@@ -995,6 +1165,175 @@ namespace mcl {
 			mov(v.data(), img);
 			return *this;
 		}
+		Event read(const Buffer &b, void *v, const std::vector<Event> &deps=std::vector<Event>()) {
+			std::vector<cl_event> w = Event::ids(deps);
+			cl_event e;
+			cl_int err_code = clEnqueueReadBuffer(queue, b.id(), false, 0, b.size(), v, w.size(), w.empty() ? NULL : w.data(), &e);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+			if(Capture::active())
+				Capture::read(b.id(), b.size());
+			if(Trace::enabled() && clRetainEvent(e)==CL_SUCCESS)
+				trace("read", e);
+			return Event(e);
+		}
+		Event write(const void *v, const Buffer &b, const std::vector<Event> &deps=std::vector<Event>()) {
+			std::vector<cl_event> w = Event::ids(deps);
+			cl_event e;
+			cl_int err_code = clEnqueueWriteBuffer(queue, b.id(), false, 0, b.size(), v, w.size(), w.empty() ? NULL : w.data(), &e);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+			if(Capture::active())
+				Capture::write(b.id(), v, b.size());
+			if(Trace::enabled() && clRetainEvent(e)==CL_SUCCESS)
+				trace("write", e);
+			return Event(e);
+		}
+		Event read(const Image &img, void *v, const std::vector<Event> &deps=std::vector<Event>()) {
+			std::vector<cl_event> w = Event::ids(deps);
+			size_t origin[] = { 0, 0, 0 };
+			size_t region[] = { img.width(), img.height(), 1 };
+			cl_event e;
+			cl_int err_code = clEnqueueReadImage(queue, img.id(), false, origin, region, 0, 0, v, w.size(), w.empty() ? NULL : w.data(), &e);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+			if(Capture::active())
+				Capture::read(img.id(), img.element_size()*img.width()*img.height());
+			if(Trace::enabled() && clRetainEvent(e)==CL_SUCCESS)
+				trace("read", e);
+			return Event(e);
+		}
+		Event write(const void *v, const Image &img, const std::vector<Event> &deps=std::vector<Event>()) {
+			std::vector<cl_event> w = Event::ids(deps);
+			size_t origin[] = { 0, 0, 0 };
+			size_t region[] = { img.width(), img.height(), 1 };
+			cl_event e;
+			cl_int err_code = clEnqueueWriteImage(queue, img.id(), false, origin, region, 0, 0, v, w.size(), w.empty() ? NULL : w.data(), &e);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+			if(Capture::active())
+				Capture::write(img.id(), v, img.element_size()*img.width()*img.height());
+			if(Trace::enabled() && clRetainEvent(e)==CL_SUCCESS)
+				trace("write", e);
+			return Event(e);
+		}
+		Event enqueue(const Kernel &k, cl_uint dims, const size_t *global, const size_t *offset=NULL, const size_t *local=NULL, const std::vector<Event> &deps=std::vector<Event>()) {
+			std::vector<cl_event> w = Event::ids(deps);
+			cl_event e;
+			cl_int err_code = clEnqueueNDRangeKernel(queue, k.id(), dims, offset, global, local, w.size(), w.empty() ? NULL : w.data(), &e);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+			if(Capture::active())
+				Capture::ndrange(k.id(), dims, offset, global, local);
+			if(Trace::enabled() && clRetainEvent(e)==CL_SUCCESS)
+				trace("kernel", e);
+			return Event(e);
+		}
+		Event copy(const Buffer &src, const Buffer &dst, const std::vector<Event> &deps=std::vector<Event>()) {
+			std::vector<cl_event> w = Event::ids(deps);
+			cl_event e;
+			cl_int err_code = clEnqueueCopyBuffer(queue, src.id(), dst.id(), 0, 0, std::min(src.size(), dst.size()), w.size(), w.empty() ? NULL : w.data(), &e);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+			if(Capture::active())
+				Capture::copy(src.id(), dst.id());
+			if(Trace::enabled() && clRetainEvent(e)==CL_SUCCESS)
+				trace("copy", e);
+			return Event(e);
+		}
+		Event copy(const Image &src, const Image &dst, const std::vector<Event> &deps=std::vector<Event>()) {
+			std::vector<cl_event> w = Event::ids(deps);
+			size_t origin[] = { 0, 0, 0 };
+			size_t region[] = { std::min(src.width(), dst.width()), std::min(src.height(), dst.height()), 1 };
+			cl_event e;
+			cl_int err_code = clEnqueueCopyImage(queue, src.id(), dst.id(), origin, origin, region, w.size(), w.empty() ? NULL : w.data(), &e);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+			if(Capture::active())
+				Capture::copy(src.id(), dst.id());
+			if(Trace::enabled() && clRetainEvent(e)==CL_SUCCESS)
+				trace("copy", e);
+			return Event(e);
+		}
+		// origins and region in pixels
+		Event copy(const Image &src, const Image &dst, const size_t *src_origin, const size_t *dst_origin, const size_t *region, const std::vector<Event> &deps=std::vector<Event>()) {
+			std::vector<cl_event> w = Event::ids(deps);
+			cl_event e;
+			cl_int err_code = clEnqueueCopyImage(queue, src.id(), dst.id(), src_origin, dst_origin, region, w.size(), w.empty() ? NULL : w.data(), &e);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+			if(Capture::active())
+				Capture::copy(src.id(), dst.id(), src_origin, dst_origin, region, 0, 0);
+			if(Trace::enabled() && clRetainEvent(e)==CL_SUCCESS)
+				trace("copy", e);
+			return Event(e);
+		}
+		// origins and region in bytes and rows
+		Event copy(const Buffer &src, const Buffer &dst, const size_t *src_origin, const size_t *dst_origin, const size_t *region, size_t src_pitch, size_t dst_pitch, const std::vector<Event> &deps=std::vector<Event>()) {
+			std::vector<cl_event> w = Event::ids(deps);
+			cl_event e;
+			cl_int err_code = clEnqueueCopyBufferRect(queue, src.id(), dst.id(), src_origin, dst_origin, region, src_pitch, 0, dst_pitch, 0, w.size(), w.empty() ? NULL : w.data(), &e);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+			if(Capture::active())
+				Capture::copy(src.id(), dst.id(), src_origin, dst_origin, region, src_pitch, dst_pitch);
+			if(Trace::enabled() && clRetainEvent(e)==CL_SUCCESS)
+				trace("copy", e);
+			return Event(e);
+		}
+		// origin and region in pixels, host rows row_pitch bytes apart
+		// origins and region in bytes and rows
+		Event write(const void *v, const Buffer &b, const size_t *buffer_origin, const size_t *host_origin, const size_t *region, size_t buffer_pitch, size_t host_pitch, const std::vector<Event> &deps=std::vector<Event>()) {
+			std::vector<cl_event> w = Event::ids(deps);
+			cl_event e;
+			cl_int err_code = clEnqueueWriteBufferRect(queue, b.id(), false, buffer_origin, host_origin, region, buffer_pitch, 0, host_pitch, 0, v, w.size(), w.empty() ? NULL : w.data(), &e);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+			if(Capture::active())
+				Capture::write(b.id(), v, buffer_origin, host_origin, region, buffer_pitch, host_pitch);
+			if(Trace::enabled() && clRetainEvent(e)==CL_SUCCESS)
+				trace("write", e);
+			return Event(e);
+		}
+		Event read(const Image &img, void *v, const size_t *origin, const size_t *region, size_t row_pitch, const std::vector<Event> &deps=std::vector<Event>()) {
+			std::vector<cl_event> w = Event::ids(deps);
+			cl_event e;
+			cl_int err_code = clEnqueueReadImage(queue, img.id(), false, origin, region, row_pitch, 0, v, w.size(), w.empty() ? NULL : w.data(), &e);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+			if(Capture::active())
+				Capture::read(img.id(), region[0]*region[1]*img.element_size());
+			if(Trace::enabled() && clRetainEvent(e)==CL_SUCCESS)
+				trace("read", e);
+			return Event(e);
+		}
+		// origins and region in bytes and rows
+		Event read(const Buffer &b, void *v, const size_t *buffer_origin, const size_t *host_origin, const size_t *region, size_t buffer_pitch, size_t host_pitch, const std::vector<Event> &deps=std::vector<Event>()) {
+			std::vector<cl_event> w = Event::ids(deps);
+			cl_event e;
+			cl_int err_code = clEnqueueReadBufferRect(queue, b.id(), false, buffer_origin, host_origin, region, buffer_pitch, 0, host_pitch, 0, v, w.size(), w.empty() ? NULL : w.data(), &e);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+			if(Capture::active())
+				Capture::read(b.id(), region[0]*region[1]*region[2]);
+			if(Trace::enabled() && clRetainEvent(e)==CL_SUCCESS)
+				trace("read", e);
+			return Event(e);
+		}
+		void *map(const Buffer &b, cl_map_flags flags=CL_MAP_READ | CL_MAP_WRITE) {
+			cl_int err_code;
+			void *r = clEnqueueMapBuffer(queue, b.id(), true, flags, 0, b.size(), 0, NULL, NULL, &err_code);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+			return r;
+		}
+		Event unmap(const Buffer &b, void *v) {
+			cl_event e;
+			cl_int err_code = clEnqueueUnmapMemObject(queue, b.id(), v, 0, NULL, &e);
+			if(err_code!=CL_SUCCESS)
+				throw Error(err_code);
+			return Event(e);
+		}
 		Queue &flush() {
 			cl_int err_code = clFlush(queue);
 			if(err_code!=CL_SUCCESS)
@@ -1005,6 +1344,8 @@ namespace mcl {
 			cl_int err_code = clFinish(queue);
 			if(err_code!=CL_SUCCESS)
 				throw Error(err_code);
+			if(Capture::active())
+				Capture::finish();
 			return *this;
 		}
 		Queue &barrier() {
@@ -1014,29 +1355,51 @@ namespace mcl {
 			return *this;
 		}
 		Queue &task(const Kernel &k) {
-			cl_int err_code = clEnqueueTask(queue, k.id(), 0, NULL, NULL);
+			TraceSpan span("Queue::task", "queue");
+			cl_event e;
+			cl_int err_code = clEnqueueTask(queue, k.id(), 0, NULL, traced(e));
 			if(err_code!=CL_SUCCESS)
 				throw Error(err_code);
+			if(Capture::active()) {
+				size_t one = 1;
+				Capture::ndrange(k.id(), 1, NULL, &one, NULL);
+			}
+			trace("kernel", e);
 			return *this;
 		}
 		Queue &task(const Kernel &k, size_t items) {
-			cl_int err_code = clEnqueueNDRangeKernel(queue, k.id(), 1, NULL, &items, NULL, 0, NULL, NULL);
+			TraceSpan span("Queue::task", "queue");
+			cl_event e;
+			cl_int err_code = clEnqueueNDRangeKernel(queue, k.id(), 1, NULL, &items, NULL, 0, NULL, traced(e));
 			if(err_code!=CL_SUCCESS)
 				throw Error(err_code);
+			if(Capture::active())
+				Capture::ndrange(k.id(), 1, NULL, &items, NULL);
+			trace("kernel", e);
 			return *this;
 		}
 		Queue &task(const Kernel &k, size_t items_x, size_t items_y) {
 			size_t sz[] = { items_x, items_y };
-			cl_int err_code = clEnqueueNDRangeKernel(queue, k.id(), 2, NULL, sz, NULL, 0, NULL, NULL);
+			TraceSpan span("Queue::task", "queue");
+			cl_event e;
+			cl_int err_code = clEnqueueNDRangeKernel(queue, k.id(), 2, NULL, sz, NULL, 0, NULL, traced(e));
 			if(err_code!=CL_SUCCESS)
 				throw Error(err_code);
+			if(Capture::active())
+				Capture::ndrange(k.id(), 2, NULL, sz, NULL);
+			trace("kernel", e);
 			return *this;
 		}
 		Queue &task(const Kernel &k, size_t items_x, size_t items_y, size_t items_z) {
 			size_t sz[] = { items_x, items_y, items_z };
-			cl_int err_code = clEnqueueNDRangeKernel(queue, k.id(), 3, NULL, sz, NULL, 0, NULL, NULL);
+			TraceSpan span("Queue::task", "queue");
+			cl_event e;
+			cl_int err_code = clEnqueueNDRangeKernel(queue, k.id(), 3, NULL, sz, NULL, 0, NULL, traced(e));
 			if(err_code!=CL_SUCCESS)
 				throw Error(err_code);
+			if(Capture::active())
+				Capture::ndrange(k.id(), 3, NULL, sz, NULL);
+			trace("kernel", e);
 			return *this;	
 		}
 		~Queue() {
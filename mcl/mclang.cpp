@@ -2,6 +2,7 @@
 #include "mclang.hpp"
 #include <map>
 #include <sstream>
+#include <cstdlib>
 
 namespace mclang {
 	const int Type::UNSIGNED_FLAG;
@@ -61,6 +62,45 @@ namespace mclang {
 		}
 	}
 	
+	int Expression::BuildContext::index() {
+		static const int i = std::ios_base::xalloc();
+		return i;
+	}
+	
+	const Expression::BuildContext &Expression::BuildContext::context(std::ostream &s) {
+		static const BuildContext generic;
+		void *c = s.pword(index());
+		return c ? *static_cast<const BuildContext *>(c) : generic;
+	}
+	
+	bool Expression::BuildContext::hoist(const Expression *e, std::ostream &s) const {
+		if(!m_variant)
+			return false;
+		auto h = m_hoisted.find(e);
+		if(h==m_hoisted.end()) {
+			Type t = e->type();
+			if(!t.is_numeric() && !t.is_vector())
+				return false;
+			Usage u(*this, false);
+			e->push_usage(u);
+			// the loop may run zero times or the expression may sit in a branch
+			if(!u.writes.empty() || u.partial)
+				return false;
+			for(auto i=u.reads.begin(); i!=u.reads.end(); i++) {
+				// memory reads stay inside the loop, they may be guarded by a branch
+				if(m_variant->find(*i)!=m_variant->end() || (*i)->type().is_pointer() || (*i)->type().is_image())
+					return false;
+			}
+			std::string name = e->id() + "_h";
+			*m_preheader << t.name() << " " << name << " = ";
+			e->value_source(*m_preheader);
+			*m_preheader << ";\n";
+			h = m_hoisted.insert(std::make_pair(e, name)).first;
+		}
+		s << h->second;
+		return true;
+	}
+	
 	std::string Expression::id() const {
 		std::stringstream ss;
 		const Expression *t = this;
@@ -80,8 +120,121 @@ namespace mclang {
 	void Expression::value_source(std::ostream &) const {};
 	void Expression::push_arguments(ArgumentsStream &) const {};
 	void Expression::set_arguments(ValuesStream &vs) const {};
+	void Expression::push_usage(Usage &) const {};
+	void Expression::push_target(Usage &u) const {
+		u.writes.insert(this);
+	}
+	bool Expression::is_dead(const BuildContext &) const {
+		return false;
+	}
+	bool Expression::constant_condition(const BuildContext &, bool &) const {
+		return false;
+	}
+	bool Expression::constant_integer(const BuildContext &, cl_long &) const {
+		return false;
+	}
+	size_t Expression::cost() const {
+		return 0;
+	}
 	Expression::~Expression() {};
 	
+	Expression::BuildContext Expression::analyze(const Specialization *sp, const ExpressionsSet &aliased) const {
+		// liveness grows from the empty set until stores and branches stop reviving variables
+		BuildContext ctx(sp, aliased);
+		ctx.set_live(ExpressionsSet());
+		size_t live_size;
+		do {
+			live_size = ctx.live().size();
+			Usage u(ctx);
+			push_usage(u);
+			ctx.set_live(u.reads);
+			ctx.set_written(u.writes);
+		} while(ctx.live().size()!=live_size);
+		return ctx;
+	}
+	
+	Expression::Specialization Expression::specialization() const {
+		BuildContext ctx;
+		Usage u(ctx);
+		push_usage(u);
+		Specialization r;
+		std::stringstream s;
+		for(auto i=u.reads.begin(); i!=u.reads.end(); i++) {
+			ExpressionRef v = (*i)->specialized_value();
+			if(!(bool)v)
+				continue;
+			r.values[*i] = v;
+			s << (*i)->id() << "=";
+			v->value_source(s);
+			s << ";";
+		}
+		r.key = s.str();
+		return r;
+	}
+	
+	// length of get_global_id(n) starting at pos, 0 if there is none
+	static size_t global_id_at(const std::string &s, size_t pos, unsigned long &n) {
+		static const std::string prefix = "get_global_id(";
+		if(s.compare(pos, prefix.size(), prefix)!=0)
+			return 0;
+		size_t begin = pos + prefix.size(), end = s.find(')', begin);
+		if(end==std::string::npos || end==begin)
+			return 0;
+		std::string d = s.substr(begin, end-begin);
+		if(d[d.size()-1]=='u')
+			d.erase(d.size()-1);
+		char *e;
+		n = std::strtoul(d.c_str(), &e, 0);
+		if(d.empty() || *e)
+			return 0;
+		return end + 1 - pos;
+	}
+	
+	// exactly get_global_id(n), or get_global_id(1) rows of a pitch argument apart plus get_global_id(0),
+	// distinct for every work-item while the range is no wider than the pitch; other arithmetic may map two work-items to one element
+	static bool is_work_item_index(const std::string &index) {
+		unsigned long x, y;
+		if(global_id_at(index, 0, x)==index.size())
+			return true;
+		size_t p = 2, l;
+		if(index.compare(0, p, "((")!=0 || !(l = global_id_at(index, p, y)) || y!=1 || index.compare(p += l, 3, " * ")!=0)
+			return false;
+		p += 3;
+		size_t e = index.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_", p);
+		if(e==std::string::npos || e==p || index.compare(e, 4, ") + ")!=0)
+			return false;
+		p = e + 4;
+		l = global_id_at(index, p, x);
+		return l && x==0 && p + l + 1==index.size() && index[p + l]==')';
+	}
+	
+	bool Expression::is_pointwise(const Expression *input, const Expression *output) const {
+		// element i of output may overwrite element i of input: both are only touched at one
+		// work-item index, outside loops, and input is never read after the first store
+		BuildContext ctx = analyze();
+		Usage::accesses_type acc;
+		Usage u(ctx);
+		u.accesses = &acc;
+		push_usage(u);
+		auto in = acc.find(input), out = acc.find(output);
+		if(in==acc.end() || out==acc.end())
+			return false;
+		const std::string &index = out->second.front().index;
+		if(!is_work_item_index(index))
+			return false;
+		size_t first_write = u.steps;
+		for(auto i=out->second.begin(); i!=out->second.end(); i++) {
+			if(!i->write || i->in_loop || i->index!=index)
+				return false;
+			first_write = std::min(first_write, i->step);
+		}
+		for(auto i=in->second.begin(); i!=in->second.end(); i++) {
+			if(i->write || i->in_loop || i->index!=index || i->step>first_write)
+				return false;
+		}
+		return true;
+	}
+	
 	Type SelectVector::type() const {
 		return expr->type().vector_of();	
 	}
@@ -104,9 +257,21 @@ namespace mclang {
 	void SelectVector::set_arguments(ValuesStream &vs) const {
 		expr->set_arguments(vs);
 	}
+	void SelectVector::push_usage(Usage &u) const {
+		expr->push_usage(u);
+	}
+	void SelectVector::push_target(Usage &u) const {
+		expr->push_target(u);
+	}
+	size_t SelectVector::cost() const {
+		return expr->cost();
+	}
 	bool SelectVector::is_lvalue() const {
 		return expr->is_lvalue();
 	}
+	bool SelectVector::is_dead(const BuildContext &c) const {
+		return expr->is_dead(c);
+	}
 	
 	Sampler Sampler::self;
 	void Sampler::global_source(std::ostream &s, ExpressionsSet &es) const {
@@ -119,6 +284,61 @@ namespace mclang {
 		}
 	}
 	
+	size_t call_cost(const char *name) {
+		// a few instructions each, anything else is a library routine
+		static const std::set<std::string> cheap = {
+			"get_global_size", "get_global_id", "get_local_size", "get_local_id", "get_group_id", "get_global_offset", "get_work_dim",
+			"abs", "abs_diff", "add_sat", "sub_sat", "hadd", "rhadd", "clz", "mad24", "mul24", "mad_hi", "mad_sat", "rotate",
+			"clamp", "min", "max", "mix", "step", "sign", "radians", "ceil", "floor", "rint", "round", "trunc",
+			"copysign", "fabs", "fdim", "fma", "fmax", "fmin", "mad", "maxmag", "minmag"
+		};
+		return cheap.find(name)!=cheap.end() ? 1 : library_cost;
+	}
+	
+	static const size_t predication_budget = 16; // weighted operations evaluated by both sides of select()
+	
+	static std::string source_of(const Expression *e, std::ostream &s) {
+		std::stringstream r;
+		Expression::BuildContext::context(s).attach(r);
+		e->value_source(r);
+		return r.str();
+	}
+	
+	static bool is_predicable(const Expression *e, const Expression::BuildContext &c) {
+		// both arms are evaluated unconditionally: no stores, no guarded memory reads, nothing expensive
+		if(e->cost()>predication_budget)
+			return false;
+		Expression::Usage u(c, false);
+		e->push_usage(u);
+		if(!u.writes.empty())
+			return false;
+		for(auto i=u.reads.begin(); i!=u.reads.end(); i++) {
+			if((*i)->type().is_pointer() || (*i)->type().is_image())
+				return false;
+		}
+		return true;
+	}
+	
+	static bool select_source(std::ostream &s, Type t, const Expression *cond, const std::string &if_false, const std::string &if_true) {
+		Type et = t.is_vector() ? t.vector_of() : t;
+		if(!(et.is_float() || (et.is_integer() && et!=Type::tp_ptrdiff_t && et!=Type::tp_size_t)))
+			return false;
+		Type m = et.is_float() ? Type(Type::tp_int) : Type::to_signed(et);
+		Type ct = cond->type();
+		std::string c = source_of(cond, s);
+		std::stringstream mask;
+		if(!t.is_vector())
+			mask << "((" << m.name() << ")(" << c << " != 0))";
+		else if(!ct.is_vector())
+			mask << "((" << Type::vector(t.vector_size(), m).name() << ")(-(" << m.name() << ")(" << c << " != 0)))";
+		else if(ct.vector_of().is_integer() && Type::to_signed(ct)==Type::vector(t.vector_size(), m))
+			mask << c;
+		else
+			return false;
+		s << "select(" << if_false << ", " << if_true << ", " << mask.str() << ")";
+		return true;
+	}
+	
 	void TernaryOp::global_source(std::ostream &s, ExpressionsSet &es) const {
 		op1->global_source(s, es);
 		op2->global_source(s, es);
@@ -130,13 +350,16 @@ namespace mclang {
 		op3->local_source(s, es);
 	}
 	void TernaryOp::value_source(std::ostream &s) const {
+		if(hoisted_source(s))
+			return;
+		const BuildContext &c = BuildContext::context(s);
+		std::string v2 = source_of(op2.get(), s), v3 = source_of(op3.get(), s);
+		if(op2->type()==op3->type() && is_predicable(op2.get(), c) && is_predicable(op3.get(), c)
+				&& select_source(s, op2->type(), op1.get(), v3, v2))
+			return;
 		s << "(";
 		op1->value_source(s);
-		s << " ? ";
-		op2->value_source(s);
-		s << " : ";
-		op3->value_source(s);
-		s << ")";
+		s << " ? " << v2 << " : " << v3 << ")";
 	}
 	void TernaryOp::push_arguments(ArgumentsStream &as) const {
 		op1->push_arguments(as);
@@ -148,12 +371,74 @@ namespace mclang {
 		op2->set_arguments(vs);
 		op3->set_arguments(vs);
 	}
+	void TernaryOp::push_usage(Usage &u) const {
+		op1->push_usage(u);
+		op2->push_usage(u);
+		op3->push_usage(u);
+	}
+	size_t TernaryOp::cost() const {
+		return 1 + op1->cost() + op2->cost() + op3->cost();
+	}
 	Type TernaryOp::type() const {
 		return Type::max(op2->type(), op3->type());	
 	}
 	
 	
+	const Expression *ConditionalOp::taken(const BuildContext &c, bool &known) const {
+		bool v;
+		known = op1->constant_condition(c, v);
+		return known ? (v ? op2.get() : op3.get()) : 0;
+	}
+	bool ConditionalOp::predicated_source(std::ostream &s) const {
+		// if(c) x = a; else x = b;  ->  x = select(b, a, c);
+		const BuildContext &c = BuildContext::context(s);
+		const Set *on_true = dynamic_cast<const Set *>(op2.get());
+		const Set *on_false = dynamic_cast<const Set *>(op3.get());
+		if(((bool)op2 && !on_true) || ((bool)op3 && !on_false))
+			return false;
+		const Set *any = on_true ? on_true : on_false;
+		if(!any || any->target()->is_dead(c))
+			return false;
+		Type t = any->target()->type();
+		std::string target = source_of(any->target().get(), s);
+		if(on_true && on_false) {
+			if(source_of(on_false->target().get(), s)!=target)
+				return false;
+		} else {
+			// a one-armed store becomes unconditional, allow it for private variables only
+			Usage u(c);
+			any->target()->push_target(u);
+			for(auto i=u.writes.begin(); i!=u.writes.end(); i++) {
+				if((*i)->type().is_pointer() || (*i)->type().is_image())
+					return false;
+			}
+		}
+		std::string v_true = target, v_false = target;
+		if(on_true) {
+			v_true = source_of(on_true->value().get(), s);
+			if(on_true->value()->type()!=t || !is_predicable(on_true->value().get(), c))
+				return false;
+		}
+		if(on_false) {
+			v_false = source_of(on_false->value().get(), s);
+			if(on_false->value()->type()!=t || !is_predicable(on_false->value().get(), c))
+				return false;
+		}
+		std::stringstream r;
+		c.attach(r);
+		if(!select_source(r, t, op1.get(), v_false, v_true))
+			return false;
+		s << target << " = " << r.str();
+		return true;
+	}
 	void ConditionalOp::global_source(std::ostream &s, ExpressionsSet &es) const {
+		bool known;
+		const Expression *t = taken(BuildContext::context(s), known);
+		if(known) {
+			if(t)
+				t->global_source(s, es);
+			return;
+		}
 		op1->global_source(s, es);
 		if((bool)op2)
 			op2->global_source(s, es);
@@ -163,6 +448,13 @@ namespace mclang {
 	void ConditionalOp::local_source(std::ostream &s, ExpressionsSet &es) const {
 		if(es.find(this)==es.end()) {
 			es.insert(this);
+			bool known;
+			const Expression *t = taken(BuildContext::context(s), known);
+			if(known) {
+				if(t)
+					t->local_source(s, es);
+				return;
+			}
 			op1->local_source(s, es);
 			if((bool)op2)
 				op2->local_source(s, es);
@@ -171,7 +463,14 @@ namespace mclang {
 		}
 	}
 	void ConditionalOp::value_source(std::ostream &s) const {
-		if((bool)op2) {
+		bool known;
+		const Expression *t = taken(BuildContext::context(s), known);
+		if(known) {
+			if(t)
+				t->value_source(s);
+		} else if(predicated_source(s)) {
+			return;
+		} else if((bool)op2) {
 			s << "if(";
 			op1->value_source(s);
 			s << ") {\n";
@@ -186,11 +485,18 @@ namespace mclang {
 			s << "if(!";
 			op1->value_source(s);
 			s << ") {\n";
-			op2->value_source(s);
+			op3->value_source(s);
 			s << ";\n}\n";
 		}
 	}
 	void ConditionalOp::push_arguments(ArgumentsStream &as) const {
+		bool known;
+		const Expression *t = taken(as.context(), known);
+		if(known) {
+			if(t)
+				t->push_arguments(as);
+			return;
+		}
 		op1->push_arguments(as);
 		if((bool)op2)
 			op2->push_arguments(as);
@@ -198,35 +504,79 @@ namespace mclang {
 			op3->push_arguments(as);
 	}
 	void ConditionalOp::set_arguments(ValuesStream &vs) const {
+		bool known;
+		const Expression *t = taken(vs.context(), known);
+		if(known) {
+			if(t)
+				t->set_arguments(vs);
+			return;
+		}
 		op1->set_arguments(vs);
 		if((bool)op2)
 			op2->set_arguments(vs);
 		if((bool)op3)
 			op3->set_arguments(vs);
 	}
+	void ConditionalOp::push_usage(Usage &u) const {
+		bool known;
+		const Expression *t = taken(u.context, known);
+		if(known) {
+			if(t)
+				t->push_usage(u);
+			return;
+		}
+		op1->push_usage(u);
+		if((bool)op2)
+			op2->push_usage(u);
+		if((bool)op3)
+			op3->push_usage(u);
+	}
 	
 	
+	bool Set::is_dead_store(const BuildContext &c) const {
+		if(!e1->is_dead(c))
+			return false;
+		Usage u(c);
+		e2->push_usage(u);
+		return u.writes.empty();
+	}
 	void Set::global_source(std::ostream &s, ExpressionsSet &es) const {
+		if(is_dead_store(BuildContext::context(s)))
+			return;
 		e1->global_source(s, es);
 		e2->global_source(s, es);
 	}
 	void Set::local_source(std::ostream &s, ExpressionsSet &es) const {
+		if(is_dead_store(BuildContext::context(s)))
+			return;
 		e1->local_source(s, es);
 		e2->local_source(s, es);
 	}
 	void Set::value_source(std::ostream &s) const {
+		if(is_dead_store(BuildContext::context(s)))
+			return;
 		e1->value_source(s);
 		s << " = ";
 		e2->value_source(s);
 	}
 	void Set::push_arguments(ArgumentsStream &as) const {
+		if(is_dead_store(as.context()))
+			return;
 		e1->push_arguments(as);
 		e2->push_arguments(as);
 	}
 	void Set::set_arguments(ValuesStream &vs) const {
+		if(is_dead_store(vs.context()))
+			return;
 		e1->set_arguments(vs);
 		e2->set_arguments(vs);
 	}
+	void Set::push_usage(Usage &u) const {
+		if(is_dead_store(u.context))
+			return;
+		e2->push_usage(u);
+		e1->push_target(u);
+	}
 	Type Set::type() const {
 		return e1->type();	
 	}
@@ -260,6 +610,11 @@ namespace mclang {
 		position->set_arguments(vs);
 		color->set_arguments(vs);
 	}
+	void SetImage::push_usage(Usage &u) const {
+		image->push_target(u);
+		position->push_usage(u);
+		color->push_usage(u);
+	}
 	
 	void Sequence::global_source(std::ostream &s, ExpressionsSet &es) const {
 		std::for_each(children.begin(), children.end(), [&](const std::shared_ptr<Expression> &i) {
@@ -287,6 +642,11 @@ namespace mclang {
 			i->set_arguments(vs);
 		});
 	}
+	void Sequence::push_usage(Usage &u) const {
+		std::for_each(children.begin(), children.end(), [&](const std::shared_ptr<Expression> &i) {
+			i->push_usage(u);
+		});
+	}
 	
 	void ForRange::global_source(std::ostream &s, ExpressionsSet &es) const {
 		index->global_source(s, es);
@@ -301,6 +661,43 @@ namespace mclang {
 		expression->local_source(s, es);
 	}
 	void ForRange::value_source(std::ostream &s) const {
+		const BuildContext &c = BuildContext::context(s);
+		Usage u(c);
+		expression->push_usage(u);
+		ExpressionsSet variant = u.writes;
+		variant.insert(index.get());
+		std::stringstream preheader, body;
+		c.attach(preheader);
+		BuildContext inner = c.loop(variant, preheader);
+		inner.attach(body);
+		expression->value_source(body);
+		body << ";\n";
+		std::string b = body.str();
+		// hoisted values are scoped to the loop, a node shared by sibling loops is declared by each
+		std::string ph = preheader.str();
+		if(!ph.empty())
+			s << "{\n" << ph;
+		loop_source(s, b, c, u.writes.find(index.get())!=u.writes.end());
+		if(!ph.empty())
+			s << "}\n";
+	}
+	void ForRange::loop_source(std::ostream &s, const std::string &b, const BuildContext &c, bool index_written) const {
+		cl_long first, last;
+		bool fixed = !index_written
+			&& begin->constant_integer(c, first) && end->constant_integer(c, last) && first<last;
+		size_t count = fixed ? last - first : 0;
+		if(fixed && count*b.size()<=unroll_budget) {
+			for(cl_long i=first; i<last; i++) {
+				index->value_source(s);
+				s << " = " << std::dec << std::noshowbase << i << ";\n" << b;
+			}
+			index->value_source(s);
+			s << " = " << std::dec << std::noshowbase << last << ";\n";
+			return;
+		}
+		size_t factor = 8;
+		while(factor>1 && (factor*b.size()>unroll_budget || count<2*factor))
+			factor /= 2;
 		s << "for(";
 		index->value_source(s);
 		s << " = ";
@@ -308,12 +705,21 @@ namespace mclang {
 		s << "; ";
 		index->value_source(s);
 		s << " < ";
+		if(fixed && factor>1) {
+			s << std::dec << std::noshowbase << (first + cl_long(count/factor*factor)) << "; ) {\n";
+			for(size_t i=0; i<factor; i++) {
+				s << b;
+				index->value_source(s);
+				s << "++;\n";
+			}
+			s << "};\nfor(; ";
+			index->value_source(s);
+			s << " < ";
+		}
 		end->value_source(s);
 		s << "; ";
 		index->value_source(s);
-		s << "++) {\n";
-		expression->value_source(s);
-		s << ";\n};\n";
+		s << "++) {\n" << b << "};\n";
 	}
 	void ForRange::push_arguments(ArgumentsStream &as) const {
 		index->push_arguments(as);
@@ -327,6 +733,15 @@ namespace mclang {
 		end->set_arguments(vs);
 		expression->set_arguments(vs);
 	}
+	void ForRange::push_usage(Usage &u) const {
+		begin->push_usage(u);
+		end->push_usage(u);
+		index->push_target(u);
+		index->push_usage(u);
+		u.loops++;
+		expression->push_usage(u);
+		u.loops--;
+	}
 	
 	void Cast::global_source(std::ostream &s, ExpressionsSet &es) const {
 		e->global_source(s, es);
@@ -354,6 +769,12 @@ namespace mclang {
 	void Cast::set_arguments(ValuesStream &vs) const {
 		e->set_arguments(vs);
 	}
+	void Cast::push_usage(Usage &u) const {
+		e->push_usage(u);
+	}
+	size_t Cast::cost() const {
+		return (cast_to==e->type() ? 0 : 1) + e->cost();
+	}
 	Type Cast::type() const {
 		return cast_to;
 	}
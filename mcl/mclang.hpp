@@ -5,6 +5,7 @@
 #include "mcl.hpp"
 #include <string>
 #include <list>
+#include <vector>
 #include <ostream>
 #include <sstream>
 #include <iostream>
@@ -14,6 +15,8 @@
 #include <iterator>
 #include <array>
 #include <set>
+#include <map>
+#include <type_traits>
 #include <assert.h>
 
 
@@ -228,16 +231,113 @@ namespace mclang {
 	typedef std::shared_ptr<Expression> ExpressionRef;
 	typedef std::set<const Expression *> ExpressionsSet;
 	
+	// weights of Expression::cost(), an arithmetic operation is 1
+	static const size_t memory_cost = 4;
+	static const size_t division_cost = 8;
+	static const size_t library_cost = 32; // exp, pow, sin and other routines of the OpenCL library
+	// weight of a call of a builtin function by its name
+	size_t call_cost(const char *name);
+	
 	class Expression {
 	public:
+		class Specialization { // values of the specialized arguments taken at one moment
+		public:
+			std::map<const Expression *, ExpressionRef> values; // constants by argument
+			std::string key; // equal keys give equal sources
+			bool empty() const { return values.empty(); }
+		};
+		class BuildContext { // build mode, reachable from the source stream via context(std::ostream &)
+		private:
+			std::shared_ptr<const Specialization> m_specialization;
+			bool m_analyzed;
+			ExpressionsSet m_live;
+			ExpressionsSet m_written;
+			ExpressionsSet m_aliased; // buffers bound to the same memory, never restrict
+			const ExpressionsSet *m_variant; // written inside the enclosing loop body
+			std::ostream *m_preheader;
+			mutable std::map<const Expression *, std::string> m_hoisted;
+			static int index();
+		public:
+			BuildContext(const Specialization *sp = 0, const ExpressionsSet &aliased = ExpressionsSet()) : m_analyzed(false), m_aliased(aliased), m_variant(0), m_preheader(0) {
+				if(sp)
+					m_specialization.reset(new Specialization(*sp));
+			}
+			// snapshot of a specialized argument, null in generic builds
+			const Expression *constant(const Expression *e) const {
+				if(!m_specialization)
+					return 0;
+				auto i = m_specialization->values.find(e);
+				return i==m_specialization->values.end() ? 0 : i->second.get();
+			}
+			bool is_restrict(const Expression *e) const {
+				return m_aliased.find(e)==m_aliased.end();
+			}
+			bool is_live(const Expression *e) const {
+				return !m_analyzed || m_live.find(e)!=m_live.end();
+			}
+			const ExpressionsSet &live() const { return m_live; }
+			void set_live(const ExpressionsSet &l) {
+				m_analyzed = true;
+				m_live = l;
+			}
+			bool is_written(const Expression *e) const {
+				return !m_analyzed || m_written.find(e)!=m_written.end();
+			}
+			void set_written(const ExpressionsSet &w) {
+				m_written = w;
+			}
+			BuildContext loop(const ExpressionsSet &variant, std::ostream &preheader) const {
+				BuildContext r(*this);
+				r.m_variant = &variant;
+				r.m_preheader = &preheader;
+				return r;
+			}
+			bool hoist(const Expression *e, std::ostream &s) const;
+			void attach(std::ostream &s) const {
+				s.pword(index()) = const_cast<BuildContext *>(this);
+			}
+			static const BuildContext &context(std::ostream &s);
+		};
+		class Usage { // expressions read and written by the reachable code
+		public:
+			struct Access { // one buffer element access, in evaluation order
+				std::string index;
+				size_t step;
+				bool write;
+				bool in_loop;
+			};
+			typedef std::map<const Expression *, std::vector<Access>> accesses_type;
+			const BuildContext &context;
+			ExpressionsSet reads;
+			ExpressionsSet writes;
+			bool initializers; // follow variable initializers, off when only the expression itself matters
+			accesses_type *accesses; // filled by buffer selections when set
+			size_t steps;
+			size_t loops;
+			bool partial; // reaches an operation undefined for some operands (integer division), never hoisted
+			Usage(const BuildContext &c, bool init = true) : context(c), initializers(init), accesses(0), steps(0), loops(0), partial(false) {}
+			void access(const Expression *buffer, const Expression *index, bool write) {
+				if(accesses) {
+					std::stringstream s;
+					index->value_source(s);
+					Access a = { s.str(), steps++, write, loops>0 };
+					(*accesses)[buffer].push_back(a);
+				}
+			}
+		};
 		class ValuesStream {
 		private:
 			mcl::Kernel kernel;
 			cl_uint position;
 			ExpressionsSet expessions;
+			BuildContext m_context;
+			std::map<cl_mem, bool> m_restrict; // buffers bound to restrict parameters, true if one of them is written
 		public:
-			ValuesStream(const mcl::Kernel &k) : kernel(k), position(0) {}
-			ValuesStream(mcl::Kernel &&k) : kernel(k), position(0) {}
+			ValuesStream(const mcl::Kernel &k, const BuildContext &c = BuildContext()) : kernel(k), position(0), m_context(c) {}
+			ValuesStream(mcl::Kernel &&k, const BuildContext &c = BuildContext()) : kernel(k), position(0), m_context(c) {}
+			const BuildContext &context() const {
+				return m_context;
+			}
 			template<typename T>
 			void append(const Expression *e, const T &v) {
 				if(expessions.find(e)==expessions.end()) {
@@ -246,20 +346,45 @@ namespace mclang {
 					position++;
 				}
 			}
+			void append(const Expression *e, const mcl::Buffer &v) {
+				if(expessions.find(e)==expessions.end()) {
+					if(m_context.is_restrict(e)) {
+						bool written = m_context.is_written(e);
+						auto r = m_restrict.insert(std::make_pair(v.id(), written));
+						// reading one buffer through two restrict parameters is fine, a write through either is not
+						if(!r.second && (written || r.first->second))
+							throw mcl::Error(CL_INVALID_ARG_VALUE);
+						r.first->second = r.first->second || written;
+					}
+					expessions.insert(e);
+					kernel.set_arg(position, v);
+					position++;
+				}
+			}
 		};
 		class ArgumentsStream {
 		public:
-			typedef std::list<std::pair<Type, std::string>> items_type;
+			struct Item {
+				const Expression *expression;
+				Type type;
+				std::string name;
+				Item(const Expression *e, const std::string &nm) : expression(e), type(e->type()), name(nm) {}
+			};
+			typedef std::list<Item> items_type;
 		private:
 			bool first;
 			items_type m_items;
 			ExpressionsSet expessions;
+			BuildContext m_context;
 		public:
-			ArgumentsStream() : first(true) {}
+			ArgumentsStream(const BuildContext &c = BuildContext()) : first(true), m_context(c) {}
+			const BuildContext &context() const {
+				return m_context;
+			}
 			void append(const Expression *e, const std::string &nm) {
 				if(expessions.find(e)==expessions.end()) {
 					expessions.insert(e);
-					m_items.push_back(make_pair(e->type(), nm));
+					m_items.push_back(Item(e, nm));
 				}	
 			}
 			const items_type &items() const {
@@ -271,7 +396,16 @@ namespace mclang {
 		virtual void value_source(std::ostream &) const;
 		virtual void push_arguments(ArgumentsStream &) const;
 		virtual void set_arguments(ValuesStream &vs) const;
+		virtual void push_usage(Usage &) const;
+		virtual void push_target(Usage &) const;
 		virtual bool is_lvalue() const;
+		virtual bool is_dead(const BuildContext &) const;
+		virtual bool constant_condition(const BuildContext &, bool &) const;
+		virtual bool constant_integer(const BuildContext &, cl_long &) const;
+		// weighted operations evaluated by a side-effect-free expression, 0 for values already at hand
+		virtual size_t cost() const;
+		// constant holding the current value of a specialized argument, empty for other nodes
+		virtual ExpressionRef specialized_value() const { return ExpressionRef(); }
 		Expression() {}
 		virtual std::string id() const;
 		virtual Type type() const;
@@ -280,21 +414,60 @@ namespace mclang {
 		}
 		Expression(const Expression &) = delete;
 		Expression &operator=(const Expression &e) = delete;
-		void set_arguments(mcl::Kernel &k) const {
-			ValuesStream vs(k);
+		BuildContext analyze(const Specialization *sp = 0, const ExpressionsSet &aliased = ExpressionsSet()) const;
+		bool is_pointwise(const Expression *input, const Expression *output) const;
+		// current values of the reachable specialized arguments, builds from one snapshot agree with each other
+		Specialization specialization() const;
+		void set_arguments(mcl::Kernel &k, bool specialize = false, const ExpressionsSet &aliased = ExpressionsSet()) const {
+			if(specialize)
+				set_arguments(k, specialization(), aliased);
+			else {
+				ValuesStream vs(k, analyze(0, aliased));
+				set_arguments(vs);
+			}
+		}
+		void set_arguments(mcl::Kernel &k, const Specialization &sp, const ExpressionsSet &aliased = ExpressionsSet()) const {
+			ValuesStream vs(k, analyze(&sp, aliased));
 			set_arguments(vs);
 		}
-		std::string build() {
+		// binds a kernel built from the analyzed context without analyzing again
+		void set_arguments(mcl::Kernel &k, const BuildContext &analyzed) const {
+			ValuesStream vs(k, analyzed);
+			set_arguments(vs);
+		}
+		std::string build(bool specialize = false, const ExpressionsSet &aliased = ExpressionsSet()) {
+			return specialize ? build(specialization(), aliased) : build_source(analyze(0, aliased));
+		}
+		// specialized arguments become the constants of the snapshot
+		std::string build(const Specialization &sp, const ExpressionsSet &aliased = ExpressionsSet()) {
+			return build_source(analyze(&sp, aliased));
+		}
+		// source for a context returned by analyze, kept to bind the built kernel
+		std::string build(const BuildContext &analyzed) {
+			return build_source(analyzed);
+		}
+		virtual ~Expression();
+	protected:
+		bool hoisted_source(std::ostream &s) const {
+			return BuildContext::context(s).hoist(this, s);
+		}
+	private:
+		std::string build_source(const BuildContext &ctx) {
+			mcl::TraceSpan span("Expression::build", "codegen");
 			ExpressionsSet c;
 			std::stringstream sout;
+			ctx.attach(sout);
 			global_source(sout, c);
-			ArgumentsStream args;
+			ArgumentsStream args(ctx);
 			push_arguments(args);
 			sout << "kernel void main_kernel(";
 			for(auto i=args.items().begin(); i!=args.items().end(); i++) {
 				if(i!=args.items().begin())
 					sout << ", ";
-				sout << i->first.name() << " " << i->second;
+				if(i->type.is_pointer())
+					sout << (ctx.is_written(i->expression) ? "" : "const ") << i->type.name() << (ctx.is_restrict(i->expression) ? " restrict " : " ") << i->name;
+				else
+					sout << i->type.name() << " " << i->name;
 			}
 			sout << ") {\n";
 			local_source(sout, c);
@@ -302,7 +475,6 @@ namespace mclang {
 			sout << ";\n};\n";
 			return sout.str();
 		}
-		virtual ~Expression();
 	};
 	
 	inline void format_const(std::ostream &s, cl_char c) { s << std::hex << std::showbase << c; }
@@ -340,6 +512,25 @@ namespace mclang {
 #undef MCLANG_FORMAT_VS
 #undef MCLANG_FORMAT_V
 	
+	template<typename T>
+	inline typename std::enable_if<std::is_arithmetic<T>::value, bool>::type constant_truth(const T &v, bool &r) {
+		r = v!=0;
+		return true;
+	}
+	template<typename T>
+	inline typename std::enable_if<!std::is_arithmetic<T>::value, bool>::type constant_truth(const T &, bool &) {
+		return false;
+	}
+	template<typename T>
+	inline typename std::enable_if<std::is_integral<T>::value, bool>::type constant_integral(const T &v, cl_long &r) {
+		r = v;
+		return true;
+	}
+	template<typename T>
+	inline typename std::enable_if<!std::is_integral<T>::value, bool>::type constant_integral(const T &, cl_long &) {
+		return false;
+	}
+	
 	template<typename T>
 	class Const : public Expression {
 	private:
@@ -352,6 +543,15 @@ namespace mclang {
 			format_const(s, m_value);
 		}
 		Const(T x) : m_value(x) {}
+		void push_usage(Usage &u) const {
+			u.reads.insert(this);
+		}
+		bool constant_condition(const BuildContext &, bool &r) const {
+			return constant_truth(m_value, r);
+		}
+		bool constant_integer(const BuildContext &, cl_long &r) const {
+			return constant_integral(m_value, r);
+		}
 		Type type() const { return Type::type<T>();	 }
 		const T &value() const { return m_value; } 
 	};
@@ -361,20 +561,46 @@ namespace mclang {
 	private:
 		T m_value;
 		std::string name;
+		bool m_specialized;
 	public:
-		void value_source(std::ostream &s) const { s << name; }
+		void value_source(std::ostream &s) const {
+			const Expression *c = BuildContext::context(s).constant(this);
+			if(c)
+				c->value_source(s);
+			else
+				s << name;
+		}
 		void push_arguments(ArgumentsStream &as) const {
-			as.append(this, name);
+			if(!as.context().constant(this))
+				as.append(this, name);
 		}
 		void set_arguments(ValuesStream &vs) const {
-			vs.append(this, m_value);
+			if(!vs.context().constant(this))
+				vs.append(this, m_value);
+		}
+		void push_usage(Usage &u) const {
+			u.reads.insert(this);
+		}
+		bool constant_condition(const BuildContext &c, bool &r) const {
+			const Expression *k = c.constant(this);
+			return k && k->constant_condition(c, r);
+		}
+		bool constant_integer(const BuildContext &c, cl_long &r) const {
+			const Expression *k = c.constant(this);
+			return k && k->constant_integer(c, r);
+		}
+		ExpressionRef specialized_value() const {
+			return m_specialized ? ExpressionRef(new Const<T>(m_value)) : ExpressionRef();
 		}
-		Argument() : name(id()) {}
-		Argument(const T &v) : name(id()), m_value(v) {}
+		Argument() : name(id()), m_specialized(false) {}
+		Argument(const T &v) : m_value(v), name(id()), m_specialized(false) {}
 		Type type() const {
 			return Type::type<T>();	
 		}
-		const T &value() const { return value; }
+		// specialized arguments are emitted as constants by builds from a specialization
+		bool is_specialized() const { return m_specialized; }
+		void set_specialized(bool s) { m_specialized = s; }
+		const T &value() const { return m_value; }
 		T &value() { return m_value; }
 		T &set(const T &v) {
 			m_value = v;
@@ -398,12 +624,15 @@ namespace mclang {
 		void set_arguments(ValuesStream &vs) const {
 			vs.append(this, *m_value);
 		}
+		void push_usage(Usage &u) const {
+			u.reads.insert(this);
+		}
 		BuffArgument() : name(id()) {}
 		BuffArgument(const mcl::Buffer &b) : name(id()), m_value(new mcl::Buffer(b)) {}
 		mcl::Buffer &value() { return *m_value; }
 		mcl::Buffer &set(const mcl::Buffer &v) {
-			value = new mcl::Buffer(v);
-			return *value;
+			m_value.reset(new mcl::Buffer(v));
+			return *m_value;
 		}
 		Type type() const {
 			return Type::pointer(Type::type<T>());	
@@ -424,6 +653,9 @@ namespace mclang {
 		void set_arguments(ValuesStream &vs) const {
 			vs.append(this, *m_value);
 		}
+		void push_usage(Usage &u) const {
+			u.reads.insert(this);
+		}
 		ImageArgument() : name(id()) {}
 		ImageArgument(const mcl::Image &b) : name(id()), m_value(new mcl::Image(b)) {}
 		mcl::Image &value() { return *m_value; }
@@ -487,6 +719,9 @@ namespace mclang {
 			}
 		}
 		void value_source(std::ostream &s) const { s << name; }
+		void push_usage(Usage &u) const {
+			u.reads.insert(this);
+		}
 		const std::vector<T> &value() const {
 			return data;	
 		}
@@ -554,6 +789,19 @@ namespace mclang {
 			expr->set_arguments(vs);
 			index->set_arguments(vs);
 		}
+		void push_usage(Usage &u) const {
+			expr->push_usage(u);
+			index->push_usage(u);
+			u.access(expr.get(), index.get(), false);
+		}
+		void push_target(Usage &u) const {
+			expr->push_target(u);
+			index->push_usage(u);
+			u.access(expr.get(), index.get(), true);
+		}
+		size_t cost() const {
+			return memory_cost + index->cost();
+		}
 		Type type() const {
 			return expr->type().pointer_to();	
 		}
@@ -576,8 +824,12 @@ namespace mclang {
 		void value_source(std::ostream &s) const;
 		void push_arguments(ArgumentsStream &as) const;
 		void set_arguments(ValuesStream &vs) const;
+		void push_usage(Usage &u) const;
+		void push_target(Usage &u) const;
+		size_t cost() const;
 		Type type() const;
 		bool is_lvalue() const;
+		bool is_dead(const BuildContext &c) const;
 	};
 	
 	class Sampler : public Expression {
@@ -625,8 +877,15 @@ namespace mclang {
 			img->set_arguments(vs);
 			pos->set_arguments(vs);
 		}
+		void push_usage(Usage &u) const {
+			img->push_usage(u);
+			pos->push_usage(u);
+		}
+		size_t cost() const {
+			return memory_cost + pos->cost();
+		}
 		Type type() const {
-			Type::vector(4, Type::tp_float);
+			return Type::vector(4, Type::tp_float);
 		}
 	};
 	
@@ -670,6 +929,17 @@ namespace mclang {
 			for(auto i=idx.begin(); i!=idx.end(); i++)
 				(*i)->set_arguments(vs);
 		}
+		void push_usage(Usage &u) const {
+			arr->push_usage(u);
+			for(auto i=idx.begin(); i!=idx.end(); i++)
+				(*i)->push_usage(u);
+		}
+		size_t cost() const {
+			size_t r = memory_cost;
+			for(auto i=idx.begin(); i!=idx.end(); i++)
+				r += (*i)->cost();
+			return r;
+		}
 		Type type() const {
 			return Type::type<T>();	
 		}
@@ -695,6 +965,8 @@ namespace mclang {
 			op2->local_source(s, es);
 		}
 		void value_source(std::ostream &s) const {
+			if(hoisted_source(s))
+				return;
 			s << "(";
 			op1->value_source(s);
 			s << " " << OP << " ";
@@ -709,6 +981,16 @@ namespace mclang {
 			op1->set_arguments(vs);
 			op2->set_arguments(vs);
 		}
+		void push_usage(Usage &u) const {
+			op1->push_usage(u);
+			op2->push_usage(u);
+			Type t = type();
+			if((OP[0]=='/' || OP[0]=='%') && !OP[1] && (t.is_integer() || (t.is_vector() && t.vector_of().is_integer())))
+				u.partial = true;
+		}
+		size_t cost() const {
+			return ((OP[0]=='/' || OP[0]=='%') && !OP[1] ? division_cost : 1) + op1->cost() + op2->cost();
+		}
 		Type type() const {
 			return Type::max(op1->type(), op2->type());	
 		}
@@ -727,6 +1009,8 @@ namespace mclang {
 			op1->local_source(s, es);
 		}
 		void value_source(std::ostream &s) const {
+			if(hoisted_source(s))
+				return;
 			s << "(" << OP;
 			op1->value_source(s);
 			s << ")";
@@ -737,6 +1021,19 @@ namespace mclang {
 		void set_arguments(ValuesStream &vs) const {
 			op1->set_arguments(vs);
 		}
+		void push_usage(Usage &u) const {
+			op1->push_usage(u);
+		}
+		size_t cost() const {
+			return 1 + op1->cost();
+		}
+		bool constant_condition(const BuildContext &c, bool &r) const {
+			if(OP[0]=='!' && op1->constant_condition(c, r)) {
+				r = !r;
+				return true;
+			} else
+				return false;
+		}
 		Type type() const {
 			return op1->type();	
 		}
@@ -752,12 +1049,16 @@ namespace mclang {
 		void value_source(std::ostream &s) const;
 		void push_arguments(ArgumentsStream &as) const;
 		void set_arguments(ValuesStream &vs) const;
+		void push_usage(Usage &u) const;
+		size_t cost() const;
 		Type type() const;
 	};
 	
 	class ConditionalOp : public Expression {
 	private:
 		const std::shared_ptr<Expression> op1, op2, op3;
+		const Expression *taken(const BuildContext &c, bool &known) const;
+		bool predicated_source(std::ostream &s) const;
 	public:
 		ConditionalOp(const std::shared_ptr<Expression> &o1, const std::shared_ptr<Expression> &o2, const std::shared_ptr<Expression> &o3) : op1(o1), op2(o2), op3(o3) {
 			assert(op1->type().is_numeric() || op1->type()==Type::tp_bool);
@@ -767,6 +1068,7 @@ namespace mclang {
 		void value_source(std::ostream &s) const;
 		void push_arguments(ArgumentsStream &as) const;
 		void set_arguments(ValuesStream &vs) const;
+		void push_usage(Usage &u) const;
 	};
 	
 	template<typename T>
@@ -778,25 +1080,44 @@ namespace mclang {
 		Variable(const std::shared_ptr<Expression> &e) : name(id()), initializer(e) {
 			assert(((bool)e) ? e->type()==Type::type<T>() : true);
 		}
+		void global_source(std::ostream &s, ExpressionsSet &es) const {
+			if((bool) initializer)
+				initializer->global_source(s, es);
+		}
 		void local_source(std::ostream &s, ExpressionsSet &es) const {
-			s << type().name() << " " << name;
-			if((bool) initializer) {
-				s << " = ";
-				initializer->value_source(s);
+			if(es.find(this)==es.end() && BuildContext::context(s).is_live(this)) {
+				es.insert(this);
+				if((bool) initializer)
+					initializer->local_source(s, es);
+				s << type().name() << " " << name;
+				if((bool) initializer) {
+					s << " = ";
+					initializer->value_source(s);
+				}
+				s << ";\n";
 			}
-			s << ";\n";
 		}
 		void value_source(std::ostream &s) const {
 			s << name;
 		}
 		void push_arguments(ArgumentsStream &as) const {
-			if((bool) initializer)
+			if((bool) initializer && as.context().is_live(this))
 				initializer->push_arguments(as);
 		}
 		void set_arguments(ValuesStream &vs) const {
-			if((bool) initializer)
+			if((bool) initializer && vs.context().is_live(this))
 				initializer->set_arguments(vs);
 		}
+		void push_usage(Usage &u) const {
+			if(u.reads.insert(this).second && u.initializers && (bool) initializer)
+				initializer->push_usage(u);
+		}
+		void push_target(Usage &u) const {
+			u.writes.insert(this);
+		}
+		bool is_dead(const BuildContext &c) const {
+			return !c.is_live(this);
+		}
 		Type type() const {
 			return Type::type<T>();
 		}
@@ -808,6 +1129,7 @@ namespace mclang {
 	class Set : public Expression {
 	private:
 		const std::shared_ptr<Expression> e1, e2;
+		bool is_dead_store(const BuildContext &c) const;
 	public:
 		Set(const std::shared_ptr<Expression> &ex1, const std::shared_ptr<Expression> &ex2) : e1(ex1), e2(ex2) {
 			assert(e1->is_lvalue());
@@ -817,7 +1139,10 @@ namespace mclang {
 		void value_source(std::ostream &s) const;
 		void push_arguments(ArgumentsStream &as) const;
 		void set_arguments(ValuesStream &vs) const;
+		void push_usage(Usage &u) const;
 		Type type() const;
+		const std::shared_ptr<Expression> &target() const { return e1; }
+		const std::shared_ptr<Expression> &value() const { return e2; }
 	};
 	
 	class SetImage : public Expression {
@@ -835,6 +1160,7 @@ namespace mclang {
 		void value_source(std::ostream &s) const;
 		void push_arguments(ArgumentsStream &as) const;
 		void set_arguments(ValuesStream &vs) const;
+		void push_usage(Usage &u) const;
 	};
 	
 	class Sequence : public Expression {
@@ -847,11 +1173,14 @@ namespace mclang {
 		void value_source(std::ostream &s) const;
 		void push_arguments(ArgumentsStream &as) const;
 		void set_arguments(ValuesStream &vs) const;
+		void push_usage(Usage &u) const;
 	};
 	
 	class ForRange : public Expression {
 	private:
 		const std::shared_ptr<Expression> index, begin, end, expression;
+		static const size_t unroll_budget = 4096; // characters of unrolled body source
+		void loop_source(std::ostream &s, const std::string &body, const BuildContext &c, bool index_written) const;
 	public:
 		ForRange(const std::shared_ptr<Expression> &i, const std::shared_ptr<Expression> &b, const std::shared_ptr<Expression> &e, const std::shared_ptr<Expression> &ex) : index(i), begin(b), end(e), expression(ex) {}
 		void global_source(std::ostream &s, ExpressionsSet &es) const;
@@ -859,6 +1188,7 @@ namespace mclang {
 		void value_source(std::ostream &s) const;
 		void push_arguments(ArgumentsStream &as) const;
 		void set_arguments(ValuesStream &vs) const;
+		void push_usage(Usage &u) const;
 	};
 	
 	template<const char *NM, unsigned ARGC>
@@ -896,6 +1226,8 @@ namespace mclang {
 			}
 		}
 		void value_source(std::ostream &s) const {
+			if(hoisted_source(s))
+				return;
 			s << NM << "(";
 			bool first = true;
 			for(auto i=arguments.begin(); i!=arguments.end(); i++) {
@@ -915,6 +1247,16 @@ namespace mclang {
 			for(auto i=arguments.begin(); i!=arguments.end(); i++)
 				(*i)->set_arguments(vs);
 		}
+		void push_usage(Usage &u) const {
+			for(auto i=arguments.begin(); i!=arguments.end(); i++)
+				(*i)->push_usage(u);
+		}
+		size_t cost() const {
+			size_t r = call_cost(NM);
+			for(auto i=arguments.begin(); i!=arguments.end(); i++)
+				r += (*i)->cost();
+			return r;
+		}
 		Type type() const {
 			return result_type;
 		}
@@ -931,6 +1273,8 @@ namespace mclang {
 		void value_source(std::ostream &s) const;
 		void push_arguments(ArgumentsStream &as) const;
 		void set_arguments(ValuesStream &vs) const;
+		void push_usage(Usage &u) const;
+		size_t cost() const;
 		Type type() const;
 	};
 	
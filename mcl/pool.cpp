@@ -0,0 +1,65 @@
+#include "pool.hpp"
+#include <algorithm>
+
+namespace layer {
+	
+	WorkerPool::WorkerPool(size_t threads) : m_busy(0), m_stop(false) {
+		threads = std::max<size_t>(threads, 1);
+		for(size_t i=0; i<threads; i++)
+			m_threads.push_back(std::shared_ptr<boost::thread>(new boost::thread([this]() { run(); })));
+	}
+	
+	WorkerPool::~WorkerPool() {
+		{
+			boost::lock_guard<boost::mutex> lk(m_mutex);
+			m_stop = true;
+			m_task_cond.notify_all();
+		}
+		for(auto i = m_threads.begin(); i!=m_threads.end(); i++)
+			(*i)->join();
+	}
+	
+	size_t WorkerPool::default_size() {
+		return std::max<size_t>(boost::thread::hardware_concurrency(), 1);
+	}
+	
+	void WorkerPool::post(const task_t &t) {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		m_tasks.push_back(t);
+		m_task_cond.notify_one();
+	}
+	
+	void WorkerPool::wait() {
+		boost::unique_lock<boost::mutex> lk(m_mutex);
+		m_idle_cond.wait(lk, [this]{ return m_tasks.empty() && m_busy==0; });
+		if(m_error) {
+			std::exception_ptr e = m_error;
+			m_error = std::exception_ptr();
+			std::rethrow_exception(e);
+		}
+	}
+	
+	void WorkerPool::run() {
+		boost::unique_lock<boost::mutex> lk(m_mutex);
+		for(;;) {
+			m_task_cond.wait(lk, [this]{ return m_stop || !m_tasks.empty(); });
+			if(m_tasks.empty())
+				return;
+			task_t t = m_tasks.front();
+			m_tasks.pop_front();
+			m_busy++;
+			lk.unlock();
+			try {
+				t();
+			} catch(...) {
+				boost::lock_guard<boost::mutex> elk(m_mutex);
+				if(!m_error)
+					m_error = std::current_exception();
+			}
+			lk.lock();
+			m_busy--;
+			if(m_tasks.empty() && m_busy==0)
+				m_idle_cond.notify_all();
+		}
+	}
+}
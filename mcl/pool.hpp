@@ -0,0 +1,38 @@
+#ifndef MAY_POOL_HPP
+#define MAY_POOL_HPP
+
+#include <list>
+#include <vector>
+#include <memory>
+#include <exception>
+#include <functional>
+#include <boost/thread.hpp>
+
+namespace layer {
+	
+	// fixed number of threads running posted tasks in order
+	class WorkerPool {
+	public:
+		typedef std::function<void()> task_t;
+	private:
+		std::vector<std::shared_ptr<boost::thread>> m_threads;
+		std::list<task_t> m_tasks;
+		size_t m_busy;
+		bool m_stop;
+		std::exception_ptr m_error; // first failure, rethrown by wait
+		boost::mutex m_mutex;
+		boost::condition_variable m_task_cond;
+		boost::condition_variable m_idle_cond;
+		void run();
+	public:
+		WorkerPool(size_t threads=default_size());
+		~WorkerPool();
+		static size_t default_size();
+		size_t size() const { return m_threads.size(); }
+		void post(const task_t &);
+		// until every posted task has finished
+		void wait();
+	};
+}
+
+#endif // MAY_POOL_HPP
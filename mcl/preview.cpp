@@ -0,0 +1,93 @@
+#include "preview.hpp"
+
+namespace layer {
+	
+	const size_t PreviewRenderer::default_first;
+	const long PreviewRenderer::retry_delay;
+	
+	PreviewRenderer::PreviewRenderer(Layer &root, size_t width, size_t height, size_t first, size_t tile) :
+			m_root(root), m_width(width), m_height(height), m_first(std::max<size_t>(first, 1)), m_tile(tile), m_done(0), m_cancel(false) {}
+	
+	PreviewRenderer::~PreviewRenderer() {
+		cancel();
+	}
+	
+	void PreviewRenderer::start(const ready_t &ready) {
+		cancel();
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		m_cancel = false;
+		m_done = 0;
+		m_error = std::exception_ptr();
+		long long version = m_root.version();
+		m_thread = boost::thread([this, version, ready]() {
+			try {
+				refine(version, ready);
+			} catch(...) {
+				boost::lock_guard<boost::mutex> lk(m_mutex);
+				m_error = std::current_exception();
+			}
+		});
+	}
+	
+	void PreviewRenderer::cancel() {
+		m_cancel = true;
+		if(m_thread.joinable())
+			m_thread.join();
+	}
+	
+	bool PreviewRenderer::refining() {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		return m_done!=1 && !m_cancel && m_thread.joinable() && !m_thread.timed_join(boost::posix_time::seconds(0));
+	}
+	
+	size_t PreviewRenderer::resolution() {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		return m_done;
+	}
+	
+	void PreviewRenderer::check() {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		if(m_error)
+			std::rethrow_exception(m_error);
+	}
+	
+	void PreviewRenderer::refine(long long version, ready_t ready) {
+		for(size_t r = m_first; r>=1 && !cancelled(version); r /= 2) {
+			size_t w = (m_width + r - 1)/r, h = (m_height + r - 1)/r;
+			std::shared_ptr<TiledRenderer> &renderer = m_renderers[r];
+			if(!(bool)renderer)
+				renderer.reset(new TiledRenderer(m_root, w, h, m_tile, m_tile, r));
+			Storage st = m_root.storage();
+			size_t pixel = st.kind==Storage::sk_image ? Storage::image(st.format, 1, 1).size : (st.width && st.height ? st.size/(st.width*st.height) : 0);
+			if(!pixel)
+				break;
+			std::vector<char> pixels(pixel*w*h);
+			std::vector<Region> tiles = renderer->tiles(Region(0, 0, w, h));
+			bool complete = true;
+			for(auto t = tiles.begin(); t!=tiles.end(); t++) {
+				if(cancelled(version)) {
+					complete = false;
+					break;
+				}
+				// layers still compiling are skipped, the tile is rendered again once they are built
+				bool read;
+				while(!(read = renderer->read(*t, &pixels[(t->y*w + t->x)*pixel], pixel*w)) && !cancelled(version))
+					boost::this_thread::sleep(boost::posix_time::milliseconds(retry_delay));
+				if(!read) {
+					complete = false;
+					break;
+				}
+			}
+			// a level interrupted on its last tile is not published either
+			if(!complete || cancelled(version))
+				break;
+			{
+				boost::lock_guard<boost::mutex> lk(m_mutex);
+				m_done = r;
+			}
+			ready(r, w, h, pixels);
+			if(r==1)
+				break;
+		}
+	}
+}
@@ -0,0 +1,52 @@
+#ifndef MAY_PREVIEW_HPP
+#define MAY_PREVIEW_HPP
+
+#include "tiles.hpp"
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <boost/thread.hpp>
+
+namespace layer {
+	
+	// renders the root at decreasing resolutions on a background thread until cancelled,
+	// the thread reads the graph without locks: call cancel() before editing any layer of it and start() after
+	class PreviewRenderer {
+	public:
+		// resolution, width, height and pixels of a finished level
+		typedef std::function<void(size_t, size_t, size_t, const std::vector<char> &)> ready_t;
+		static const size_t default_first = 8;
+		static const long retry_delay = 20; // milliseconds between renders of a tile waiting for a compile
+	private:
+		Layer &m_root;
+		size_t m_width;
+		size_t m_height;
+		size_t m_first;
+		size_t m_tile;
+		size_t m_done; // finest finished resolution, 0 if none
+		volatile bool m_cancel;
+		std::exception_ptr m_error; // stopped the refinement
+		std::map<size_t, std::shared_ptr<TiledRenderer>> m_renderers; // by resolution, kept to reuse the tiles edits missed
+		boost::mutex m_mutex;
+		boost::thread m_thread;
+		void refine(long long version, ready_t ready);
+		// the version check only catches an edit made without cancel(), the tile being rendered may be wrong then
+		bool cancelled(long long version) const { return m_cancel || m_root.version()!=version; }
+	public:
+		// full size of the output
+		PreviewRenderer(Layer &root, size_t width, size_t height, size_t first=default_first, size_t tile=TiledRenderer::default_tile);
+		~PreviewRenderer();
+		// restarts from the coarsest resolution, the graph must not change until cancel()
+		void start(const ready_t &);
+		// stops between tiles and waits for the thread
+		void cancel();
+		bool refining();
+		size_t resolution();
+		// rethrows the error that stopped the refinement, a graph with sources or a failed build
+		void check();
+	};
+}
+
+#endif // MAY_PREVIEW_HPP
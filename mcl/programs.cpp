@@ -0,0 +1,95 @@
+#include "programs.hpp"
+
+namespace layer {
+	
+	ProgramCache &ProgramCache::global() {
+		static ProgramCache c;
+		return c;
+	}
+	
+	ProgramCache::EntryRef ProgramCache::acquire(const mcl::Context &c, const mcl::Device &d, const std::string &source, const wanted_t &w, const action_t &done) {
+		Key k;
+		k.source = source;
+		k.context = c.id();
+		k.device = d.id();
+		boost::unique_lock<boost::mutex> lk(m_mutex);
+		auto i = m_entries.find(k);
+		EntryRef e;
+		if(i!=m_entries.end())
+			e = i->second.lock();
+		if((bool)e) {
+			m_avoided++;
+			if(e->m_ready) {
+				lk.unlock();
+				BuildScheduler::global().post([done, e]() { done(e->program()); });
+			} else
+				e->m_waiting.push_back(std::make_pair(w, done));
+			return e;
+		}
+		for(auto j = m_entries.begin(); j!=m_entries.end();) {
+			if(j->second.expired())
+				m_entries.erase(j++);
+			else
+				j++;
+		}
+		e.reset(new Entry(mcl::Program(c, source), d));
+		e->m_waiting.push_back(std::make_pair(w, done));
+		m_entries[k] = e;
+		m_compiled++;
+		lk.unlock();
+		submit(k, e);
+		return e;
+	}
+	
+	void ProgramCache::submit(const Key &k, const EntryRef &e) {
+		auto self = this;
+		BuildScheduler::global().submit(e->m_program, e->m_device, [self, e]() {
+			return self->wanted(e);
+		}, [self, k, e]() {
+			self->built(k, e);
+		});
+	}
+	
+	bool ProgramCache::wanted(const EntryRef &e) {
+		std::list<std::pair<wanted_t, action_t>> waiting;
+		{
+			boost::lock_guard<boost::mutex> lk(m_mutex);
+			waiting = e->m_waiting;
+		}
+		for(auto i = waiting.begin(); i!=waiting.end(); i++)
+			if(i->first())
+				return true;
+		return false;
+	}
+	
+	void ProgramCache::built(const Key &k, const EntryRef &e) {
+		bool abandoned = e->m_program.build_status(e->m_device)==CL_BUILD_NONE;
+		if(abandoned && wanted(e)) {
+			submit(k, e); // a user arrived after the job was dropped
+			return;
+		}
+		std::list<std::pair<wanted_t, action_t>> waiting;
+		{
+			boost::lock_guard<boost::mutex> lk(m_mutex);
+			std::swap(waiting, e->m_waiting);
+			if(abandoned) {
+				auto i = m_entries.find(k);
+				if(i!=m_entries.end() && i->second.lock()==e)
+					m_entries.erase(i);
+				m_compiled--;
+			} else
+				e->m_ready = true;
+		}
+		for(auto i = waiting.begin(); i!=waiting.end(); i++)
+			i->second(e->m_program);
+	}
+	
+	size_t ProgramCache::size() {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		size_t r = 0;
+		for(auto i = m_entries.begin(); i!=m_entries.end(); i++)
+			if(!i->second.expired())
+				r++;
+		return r;
+	}
+}
@@ -0,0 +1,62 @@
+#ifndef MAY_PROGRAMS_HPP
+#define MAY_PROGRAMS_HPP
+
+#include "mcl.hpp"
+#include "scheduler.hpp"
+#include <map>
+#include <list>
+#include <memory>
+#include <functional>
+
+namespace layer {
+	
+	// built programs shared by source and device, each user creates its own kernels
+	class ProgramCache {
+	public:
+		typedef std::function<bool()> wanted_t;
+		typedef std::function<void(const mcl::Program &)> action_t;
+		class Entry {
+		private:
+			friend class ProgramCache;
+			mcl::Program m_program;
+			mcl::Device m_device;
+			bool m_ready;
+			std::list<std::pair<wanted_t, action_t>> m_waiting;
+		public:
+			Entry(const mcl::Program &p, const mcl::Device &d) : m_program(p), m_device(d), m_ready(false) {}
+			const mcl::Program &program() const { return m_program; }
+			bool ready() const { return m_ready; }
+		};
+		typedef std::shared_ptr<Entry> EntryRef;
+	private:
+		struct Key {
+			std::string source;
+			cl_context context;
+			cl_device_id device;
+			bool operator<(const Key &k) const {
+				if(context!=k.context) return context<k.context;
+				if(device!=k.device) return device<k.device;
+				return source<k.source;
+			}
+		};
+		std::map<Key, std::weak_ptr<Entry>> m_entries; // released when the last user drops its reference
+		size_t m_compiled;
+		size_t m_avoided;
+		boost::mutex m_mutex;
+		void submit(const Key &, const EntryRef &);
+		bool wanted(const EntryRef &);
+		void built(const Key &, const EntryRef &);
+	public:
+		ProgramCache() : m_compiled(0), m_avoided(0) {}
+		static ProgramCache &global();
+		
+		// done is called once the program is built, or when the build is abandoned because no user wants it
+		EntryRef acquire(const mcl::Context &, const mcl::Device &, const std::string &source, const wanted_t &, const action_t &done);
+		
+		size_t compilations() const { return m_compiled; }
+		size_t compilations_avoided() const { return m_avoided; }
+		size_t size();
+	};
+}
+
+#endif // MAY_PROGRAMS_HPP
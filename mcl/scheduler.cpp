@@ -0,0 +1,185 @@
+#include "scheduler.hpp"
+#include <algorithm>
+#include <atomic>
+
+namespace layer {
+	
+	const long BuildScheduler::default_window;
+	
+	BuildScheduler::BuildScheduler(size_t max_builds, long window) : m_active(0), m_max_builds(std::max<size_t>(max_builds, 1)), m_window(window),
+			m_started(0), m_abandoned(0), m_coalesced(0), m_stop(false) {
+		m_thread = boost::thread([this]() { run(); });
+	}
+	
+	BuildScheduler::~BuildScheduler() {
+		{
+			boost::lock_guard<boost::mutex> lk(m_mutex);
+			m_stop = true;
+			m_cond.notify_all();
+		}
+		m_thread.join();
+		for(auto i = m_posted.begin(); i!=m_posted.end(); i++)
+			(*i)();
+		for(auto i = m_jobs.begin(); i!=m_jobs.end(); i++)
+			i->done();
+	}
+	
+	BuildScheduler &BuildScheduler::global() {
+		static BuildScheduler s;
+		return s;
+	}
+	
+	size_t BuildScheduler::default_max_builds() {
+		return std::max<size_t>(boost::thread::hardware_concurrency()/2, 1);
+	}
+	
+	void BuildScheduler::set_max_builds(size_t n) {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		m_max_builds = std::max<size_t>(n, 1);
+		m_cond.notify_all();
+	}
+	
+	void BuildScheduler::submit(const mcl::Program &p, const mcl::Device &d, const std::function<bool()> &wanted, const action_t &done) {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		m_jobs.push_back(Job(p, d.id(), wanted, done));
+		m_cond.notify_all();
+	}
+	
+	void BuildScheduler::post(const action_t &a) {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		m_posted.push_back(a);
+		m_cond.notify_all();
+	}
+	
+	void BuildScheduler::debounce(const void *owner, const action_t &a) {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		auto i = m_delayed.find(owner);
+		if(i!=m_delayed.end())
+			m_coalesced++;
+		Delayed &d = m_delayed[owner];
+		d.deadline = boost::get_system_time() + boost::posix_time::milliseconds(m_window);
+		d.action = a;
+		m_cond.notify_all();
+	}
+	
+	void BuildScheduler::expedite(const void *owner, const action_t &a) {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		Delayed &d = m_delayed[owner];
+		d.deadline = boost::get_system_time();
+		d.action = a;
+		m_cond.notify_all();
+	}
+	
+	void BuildScheduler::cancel(const void *owner) {
+		boost::unique_lock<boost::mutex> lk(m_mutex);
+		m_delayed.erase(owner);
+		m_cond.wait(lk, [this, owner]{ return m_active!=owner; });
+	}
+	
+	void BuildScheduler::finished(cl_device_id d) {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		m_running[d]--;
+		m_cond.notify_all();
+	}
+	
+	void BuildScheduler::run() {
+		boost::unique_lock<boost::mutex> lk(m_mutex);
+		while(!m_stop) {
+			if(!m_posted.empty()) {
+				action_t a = m_posted.front();
+				m_posted.pop_front();
+				lk.unlock();
+				try {
+					a();
+				} catch(...) {
+				}
+				lk.lock();
+				continue;
+			}
+			boost::system_time now = boost::get_system_time();
+			auto due = m_delayed.end();
+			for(auto i = m_delayed.begin(); i!=m_delayed.end(); i++)
+				if(i->second.deadline<=now && (due==m_delayed.end() || i->second.deadline<due->second.deadline))
+					due = i;
+			if(due!=m_delayed.end()) {
+				action_t a = due->second.action;
+				m_active = due->first;
+				m_delayed.erase(due);
+				lk.unlock();
+				try {
+					a();
+				} catch(...) {
+					// errors surface again when the owner needs the result
+				}
+				lk.lock();
+				m_active = 0;
+				m_cond.notify_all();
+				continue;
+			}
+			
+			auto job = m_jobs.begin();
+			while(job!=m_jobs.end() && m_running[job->device]>=m_max_builds)
+				job++;
+			if(job!=m_jobs.end()) {
+				Job j = *job;
+				m_jobs.erase(job);
+				m_running[j.device]++;
+				lk.unlock();
+				bool started = false;
+				try {
+					started = j.wanted();
+				} catch(...) {
+				}
+				if(started) {
+					cl_device_id device = j.device;
+					action_t done = j.done;
+					auto self = this;
+					std::shared_ptr<std::atomic<bool>> reported(new std::atomic<bool>(false));
+					auto report = [done, device, self, reported]() {
+						if(reported->exchange(true))
+							return;
+						try {
+							done();
+						} catch(...) {
+							self->finished(device);
+							throw;
+						}
+						self->finished(device);
+					};
+					try {
+						j.program.build(report);
+					} catch(...) {
+						// the driver may have called back before failing, done still runs once
+						try {
+							report();
+						} catch(...) {
+						}
+					}
+				}
+				lk.lock();
+				if(started)
+					m_started++;
+				else {
+					m_abandoned++;
+					m_running[j.device]--;
+					lk.unlock();
+					try {
+						j.done();
+					} catch(...) {
+					}
+					lk.lock();
+				}
+				continue;
+			}
+			
+			if(m_delayed.empty())
+				m_cond.wait(lk);
+			else {
+				boost::system_time next = m_delayed.begin()->second.deadline;
+				for(auto i = m_delayed.begin(); i!=m_delayed.end(); i++)
+					next = std::min(next, i->second.deadline);
+				m_cond.timed_wait(lk, next);
+			}
+		}
+	}
+}
@@ -0,0 +1,72 @@
+#ifndef MAY_SCHEDULER_HPP
+#define MAY_SCHEDULER_HPP
+
+#include "mcl.hpp"
+#include <map>
+#include <list>
+#include <functional>
+#include <boost/thread.hpp>
+
+namespace layer {
+	
+	// starts program builds with a per device limit and runs delayed actions coalescing rapid requests
+	class BuildScheduler {
+	public:
+		typedef std::function<void()> action_t;
+		static const long default_window = 100; // ms
+	private:
+		struct Job {
+			mcl::Program program;
+			cl_device_id device;
+			std::function<bool()> wanted;
+			action_t done;
+			Job(const mcl::Program &p, cl_device_id d, const std::function<bool()> &w, const action_t &a) : program(p), device(d), wanted(w), done(a) {}
+		};
+		struct Delayed {
+			boost::system_time deadline;
+			action_t action;
+		};
+		std::list<Job> m_jobs;
+		std::list<action_t> m_posted;
+		std::map<cl_device_id, size_t> m_running;
+		std::map<const void *, Delayed> m_delayed;
+		const void *m_active; // owner of the delayed action being run
+		size_t m_max_builds;
+		long m_window;
+		size_t m_started;
+		size_t m_abandoned;
+		size_t m_coalesced;
+		bool m_stop;
+		boost::mutex m_mutex;
+		boost::condition_variable m_cond;
+		boost::thread m_thread;
+		void run();
+		void finished(cl_device_id);
+	public:
+		BuildScheduler(size_t max_builds=default_max_builds(), long window=default_window);
+		~BuildScheduler();
+		static BuildScheduler &global();
+		static size_t default_max_builds();
+		
+		// done is called once the build finishes, or immediately if wanted returns false when the job is due
+		void submit(const mcl::Program &, const mcl::Device &, const std::function<bool()> &wanted, const action_t &done);
+		// runs the action on the scheduler thread as soon as possible
+		void post(const action_t &);
+		// runs the action after the window passes without another request of the same owner
+		void debounce(const void *owner, const action_t &);
+		// runs the action of the owner as soon as possible, replacing a delayed one
+		void expedite(const void *owner, const action_t &);
+		// drops the delayed action of the owner, waits if it is running
+		void cancel(const void *owner);
+		
+		long window() const { return m_window; }
+		void set_window(long ms) { m_window = ms; }
+		size_t max_builds() const { return m_max_builds; }
+		void set_max_builds(size_t);
+		size_t builds_started() const { return m_started; }
+		size_t builds_abandoned() const { return m_abandoned; }
+		size_t requests_coalesced() const { return m_coalesced; }
+	};
+}
+
+#endif // MAY_SCHEDULER_HPP
@@ -0,0 +1,385 @@
+#include "spill.hpp"
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace layer {
+	
+	const unsigned long long SpillCache::default_disk_budget;
+	
+	// lz77 block with lz4 style sequences: token, literals, 16 bit offset, match length
+	static const size_t lz_hash_bits = 12;
+	static const size_t lz_min_match = 4;
+	
+	static inline cl_uint lz_read32(const unsigned char *p) {
+		cl_uint r;
+		std::memcpy(&r, p, sizeof(r));
+		return r;
+	}
+	
+	static void lz_length(std::vector<unsigned char> &out, size_t l) {
+		for(; l>=255; l-=255)
+			out.push_back(255);
+		out.push_back((unsigned char) l);
+	}
+	
+	static void lz_sequence(std::vector<unsigned char> &out, const unsigned char *lit, size_t lit_len, size_t offset, size_t match_len) {
+		size_t ml = match_len ? match_len-lz_min_match : 0;
+		out.push_back((unsigned char) ((std::min<size_t>(lit_len, 15) << 4) | std::min<size_t>(ml, 15)));
+		if(lit_len>=15)
+			lz_length(out, lit_len-15);
+		out.insert(out.end(), lit, lit+lit_len);
+		if(match_len) {
+			out.push_back((unsigned char) (offset & 0xFF));
+			out.push_back((unsigned char) (offset >> 8));
+			if(ml>=15)
+				lz_length(out, ml-15);
+		}
+	}
+	
+	static std::vector<unsigned char> lz_compress(const unsigned char *src, size_t n) {
+		std::vector<unsigned char> out;
+		out.reserve(n/2 + 16);
+		std::vector<size_t> table(size_t(1) << lz_hash_bits, 0); // position + 1
+		size_t anchor = 0, i = 0;
+		while(i+lz_min_match<=n) {
+			cl_uint v = lz_read32(src+i);
+			size_t h = (v*2654435761u) >> (32-lz_hash_bits);
+			size_t candidate = table[h];
+			table[h] = i+1;
+			if(candidate && i-(candidate-1)<65536 && lz_read32(src+candidate-1)==v) {
+				size_t m = candidate-1, len = lz_min_match;
+				while(i+len<n && src[m+len]==src[i+len])
+					len++;
+				lz_sequence(out, src+anchor, i-anchor, i-m, len);
+				i += len;
+				anchor = i;
+			} else
+				i++;
+		}
+		lz_sequence(out, src+anchor, n-anchor, 0, 0);
+		return out;
+	}
+	
+	static bool lz_read_length(const unsigned char *&p, const unsigned char *end, size_t &l) {
+		unsigned char b;
+		do {
+			if(p==end)
+				return false;
+			b = *p++;
+			l += b;
+		} while(b==255);
+		return true;
+	}
+	
+	static bool lz_decompress(const unsigned char *p, size_t n, unsigned char *dst, size_t dst_size) {
+		const unsigned char *end = p+n;
+		size_t o = 0;
+		while(p<end) {
+			unsigned char token = *p++;
+			size_t lit = token >> 4;
+			if(lit==15 && !lz_read_length(p, end, lit))
+				return false;
+			if(lit>size_t(end-p) || o+lit>dst_size)
+				return false;
+			std::memcpy(dst+o, p, lit);
+			p += lit;
+			o += lit;
+			if(p==end)
+				break;
+			if(end-p<2)
+				return false;
+			size_t offset = p[0] | (size_t(p[1]) << 8);
+			p += 2;
+			size_t len = token & 15;
+			if(len==15 && !lz_read_length(p, end, len))
+				return false;
+			len += lz_min_match;
+			if(offset==0 || offset>o || o+len>dst_size)
+				return false;
+			for(size_t i=0; i<len; i++, o++)
+				dst[o] = dst[o-offset];
+		}
+		return o==dst_size;
+	}
+	
+	static std::string temp_directory() {
+		const char *names[] = { "TMPDIR", "TEMP", "TMP" };
+		for(size_t i=0; i<sizeof(names)/sizeof(names[0]); i++) {
+			const char *d = std::getenv(names[i]);
+			if(d && *d)
+				return d;
+		}
+		return ".";
+	}
+	
+	SpillCache::SpillCache(mcl::Context &c, mcl::Queue &q, size_t host_budget, unsigned long long disk_budget, const std::string &directory) :
+			ResultCache(q.device()), m_context(c), m_queue(q),
+			m_host_budget(host_budget), m_host_size(0),
+			m_disk_budget(disk_budget), m_disk_size(0),
+			m_directory(directory.empty() ? temp_directory() : directory), m_files(0), m_stop(false) {
+		init();
+	}
+	
+	SpillCache::SpillCache(mcl::Context &c, mcl::Queue &q) :
+			ResultCache(q.device()), m_context(c), m_queue(q),
+			m_host_budget(q.device().global_mem_size()/2), m_host_size(0),
+			m_disk_budget(default_disk_budget), m_disk_size(0),
+			m_directory(temp_directory()), m_files(0), m_stop(false) {
+		init();
+	}
+	
+	void SpillCache::init() {
+		for(size_t i=0; i<tiers_count; i++)
+			m_hits[i] = m_lookups[i] = 0;
+		m_worker = boost::thread([this]() { work(); });
+	}
+	
+	SpillCache::~SpillCache() {
+		{
+			boost::lock_guard<boost::mutex> lk(m_spill_mutex);
+			m_stop = true;
+			m_jobs_cond.notify_all();
+		}
+		m_worker.join();
+		for(auto i = m_disk.begin(); i!=m_disk.end(); i++)
+			std::remove(i->second.path.c_str());
+	}
+	
+	void SpillCache::work() {
+		for(;;) {
+			std::function<void()> job;
+			{
+				boost::unique_lock<boost::mutex> lk(m_spill_mutex);
+				m_jobs_cond.wait(lk, [this]{ return m_stop || !m_jobs.empty(); });
+				if(m_jobs.empty())
+					return;
+				job = m_jobs.front();
+				m_jobs.pop_front();
+			}
+			try {
+				job();
+			} catch(...) {
+				// the entry is lost and will be recomputed
+			}
+		}
+	}
+	
+	void SpillCache::post(const std::function<void()> &job) {
+		m_jobs.push_back(job);
+		m_jobs_cond.notify_one();
+	}
+	
+	// called with m_spill_mutex held
+	void SpillCache::evict_host(size_t needed, std::vector<std::shared_ptr<Pinned>> &released) {
+		while(!m_host_order.empty() && m_host_size+needed>m_host_budget) {
+			Key k = m_host_order.front();
+			auto i = m_host.find(k);
+			HostEntry h = i->second;
+			released.push_back(h.pinned);
+			m_host_size -= h.layout.size;
+			m_host.erase(i);
+			m_host_order.pop_front();
+			if(m_disk.find(k)==m_disk.end() && m_storing.find(k)==m_storing.end() && h.layout.size<=m_disk_budget) {
+				m_storing.insert(k);
+				post([this, k, h]() { store(k, h); });
+			}
+		}
+	}
+	
+	// runs on the worker
+	void SpillCache::store(const Key &k, const HostEntry &h) {
+		std::string path;
+		{
+			boost::lock_guard<boost::mutex> lk(m_spill_mutex);
+			std::ostringstream name;
+			name << m_directory << "/img_cl_" << this << "_" << m_files++ << ".lz";
+			path = name.str();
+		}
+		size_t stored = 0;
+		try {
+			h.pinned->last.wait();
+			std::vector<unsigned char> packed = lz_compress(reinterpret_cast<const unsigned char *>(h.pinned->data()), h.layout.size);
+			std::ofstream f(path.c_str(), std::ios::binary);
+			f.write(reinterpret_cast<const char *>(packed.data()), packed.size());
+			f.close();
+			if(f)
+				stored = packed.size();
+		} catch(...) {
+		}
+		boost::lock_guard<boost::mutex> lk(m_spill_mutex);
+		// the key is dropped from m_storing when its layer is erased meanwhile
+		if(!m_storing.erase(k) || !stored || m_disk.find(k)!=m_disk.end()) {
+			std::remove(path.c_str());
+			return;
+		}
+		while(!m_disk_order.empty() && m_disk_size+stored>m_disk_budget) {
+			auto i = m_disk.find(m_disk_order.front());
+			m_disk_size -= i->second.stored;
+			std::remove(i->second.path.c_str());
+			m_disk.erase(i);
+			m_disk_order.pop_front();
+		}
+		DiskEntry d;
+		d.layout = h.layout;
+		d.path = path;
+		d.stored = stored;
+		m_disk_order.push_back(k);
+		d.order = --m_disk_order.end();
+		m_disk.insert(std::make_pair(k, d));
+		m_disk_size += d.stored;
+	}
+	
+	// runs on the worker
+	void SpillCache::promote(const Key &k, const DiskEntry &d) {
+		std::shared_ptr<Pinned> p;
+		try {
+			std::vector<unsigned char> packed(d.stored);
+			std::ifstream f(d.path.c_str(), std::ios::binary);
+			f.read(reinterpret_cast<char *>(packed.data()), packed.size());
+			if(f) {
+				p.reset(new Pinned(m_context, m_queue, d.layout.size));
+				if(!lz_decompress(packed.data(), packed.size(), reinterpret_cast<unsigned char *>(p->data()), d.layout.size))
+					p.reset();
+			}
+		} catch(...) {
+			p.reset();
+		}
+		std::vector<std::shared_ptr<Pinned>> released;
+		boost::lock_guard<boost::mutex> lk(m_spill_mutex);
+		if(!m_promoting.erase(k) || !p || m_host.find(k)!=m_host.end() || m_disk.find(k)==m_disk.end())
+			return;
+		evict_host(d.layout.size, released);
+		HostEntry h;
+		h.layout = d.layout;
+		h.pinned = p;
+		m_host_order.push_back(k);
+		h.order = --m_host_order.end();
+		m_host.insert(std::make_pair(k, h));
+		m_host_size += d.layout.size;
+	}
+	
+	void SpillCache::evicted(const Key &k, const Entry &e) {
+		Layout l;
+		l.is_image = (bool)e.image;
+		if(l.is_image) {
+			l.format = e.image->format();
+			l.width = e.image->width();
+			l.height = e.image->height();
+		}
+		l.size = e.size;
+		if(l.size>m_host_budget)
+			return;
+		// mapping blocks on the transfer queue, it is done before the lock and dropped after it if the key is already held
+		std::shared_ptr<Pinned> pinned(new Pinned(m_context, m_queue, l.size));
+		std::vector<std::shared_ptr<Pinned>> released;
+		boost::lock_guard<boost::mutex> lk(m_spill_mutex);
+		if(m_host.find(k)!=m_host.end())
+			return;
+		evict_host(l.size, released);
+		HostEntry h;
+		h.layout = l;
+		h.pinned = pinned;
+		std::vector<mcl::Event> deps(1, e.ready);
+		h.pinned->last = l.is_image ? m_queue.read(*e.image, h.pinned->data(), deps) : m_queue.read(*e.buffer, h.pinned->data(), deps);
+		m_host_order.push_back(k);
+		h.order = --m_host_order.end();
+		m_host.insert(std::make_pair(k, h));
+		m_host_size += l.size;
+		m_queue.flush();
+	}
+	
+	ResultCache::Entry SpillCache::upload(const Layout &l, const std::shared_ptr<Pinned> &p) {
+		Entry e;
+		std::vector<mcl::Event> deps(1, p->last);
+		if(l.is_image) {
+			e = Entry(m_context.image_rw(l.format, l.width, l.height));
+			e.ready = m_queue.write(p->data(), *e.image, deps);
+		} else {
+			e = Entry(m_context.buffer_rw(l.size));
+			e.ready = m_queue.write(p->data(), *e.buffer, deps);
+		}
+		p->last = e.ready;
+		m_queue.flush();
+		return e;
+	}
+	
+	bool SpillCache::find(const Key &k, Entry &e) {
+		if(ResultCache::find(k, e))
+			return true;
+		boost::unique_lock<boost::mutex> lk(m_spill_mutex);
+		m_lookups[tier_host]++;
+		auto h = m_host.find(k);
+		if(h!=m_host.end()) {
+			m_hits[tier_host]++;
+			m_host_order.splice(m_host_order.end(), m_host_order, h->second.order);
+			e = upload(h->second.layout, h->second.pinned);
+			lk.unlock();
+			ResultCache::insert(k, e);
+			return true;
+		}
+		m_lookups[tier_disk]++;
+		auto d = m_disk.find(k);
+		if(d==m_disk.end())
+			return false;
+		m_hits[tier_disk]++;
+		m_disk_order.splice(m_disk_order.end(), m_disk_order, d->second.order);
+		if(d->second.layout.size<=m_host_budget && m_promoting.insert(k).second) {
+			DiskEntry de = d->second;
+			post([this, k, de]() { promote(k, de); });
+		}
+		return false;
+	}
+	
+	void SpillCache::erase(const Layer *l) {
+		ResultCache::erase(l);
+		std::vector<std::shared_ptr<Pinned>> released; // unmapped after the lock is dropped
+		boost::lock_guard<boost::mutex> lk(m_spill_mutex);
+		for(auto i = m_host.begin(); i!=m_host.end();) {
+			if(i->first.layer==l) {
+				m_host_size -= i->second.layout.size;
+				m_host_order.erase(i->second.order);
+				released.push_back(i->second.pinned);
+				m_host.erase(i++);
+			} else
+				i++;
+		}
+		for(auto i = m_disk.begin(); i!=m_disk.end();) {
+			if(i->first.layer==l) {
+				m_disk_size -= i->second.stored;
+				m_disk_order.erase(i->second.order);
+				std::remove(i->second.path.c_str());
+				m_disk.erase(i++);
+			} else
+				i++;
+		}
+		for(auto i = m_storing.begin(); i!=m_storing.end();) {
+			if(i->layer==l)
+				m_storing.erase(i++);
+			else
+				i++;
+		}
+		for(auto i = m_promoting.begin(); i!=m_promoting.end();) {
+			if(i->layer==l)
+				m_promoting.erase(i++);
+			else
+				i++;
+		}
+	}
+	
+	size_t SpillCache::hits(tier_t t) const {
+		return t==tier_device ? ResultCache::hits() : m_hits[t];
+	}
+	
+	size_t SpillCache::lookups(tier_t t) const {
+		return t==tier_device ? ResultCache::hits()+ResultCache::misses() : m_lookups[t];
+	}
+	
+	double SpillCache::hit_rate(tier_t t) const {
+		size_t l = lookups(t);
+		return l ? double(hits(t))/l : 0.0;
+	}
+}
@@ -0,0 +1,102 @@
+#ifndef MAY_SPILL_HPP
+#define MAY_SPILL_HPP
+
+#include "cache.hpp"
+#include <string>
+#include <functional>
+#include <set>
+
+namespace layer {
+	
+	// result cache with lower tiers, outputs evicted from the device go to pinned host memory, then to compressed files
+	class SpillCache : public ResultCache {
+	public:
+		enum tier_t { tier_device, tier_host, tier_disk, tiers_count };
+		static const unsigned long long default_disk_budget = 1ULL << 32;
+	private:
+		struct Layout {
+			bool is_image;
+			cl_image_format format;
+			size_t width;
+			size_t height;
+			size_t size;
+		};
+		class Pinned {
+		private:
+			mcl::Queue m_queue;
+			mcl::Buffer m_buffer;
+			void *m_data;
+		public:
+			mcl::Event last; // last transfer using the memory
+			Pinned(mcl::Context &c, mcl::Queue &q, size_t sz) : m_queue(q), m_buffer(c.buffer_host(sz)), m_data(q.map(m_buffer)) {}
+			void *data() { return m_data; }
+			~Pinned() {
+				last.wait();
+				m_queue.unmap(m_buffer, m_data);
+			}
+		};
+		struct HostEntry {
+			Layout layout;
+			std::shared_ptr<Pinned> pinned;
+			std::list<Key>::iterator order;
+		};
+		struct DiskEntry {
+			Layout layout;
+			std::string path;
+			size_t stored;
+			std::list<Key>::iterator order;
+		};
+		mcl::Context m_context;
+		mcl::Queue m_queue;
+		std::map<Key, HostEntry> m_host;
+		std::list<Key> m_host_order;
+		size_t m_host_budget;
+		size_t m_host_size;
+		std::map<Key, DiskEntry> m_disk;
+		std::list<Key> m_disk_order;
+		unsigned long long m_disk_budget;
+		unsigned long long m_disk_size;
+		std::string m_directory;
+		size_t m_files;
+		size_t m_hits[tiers_count];
+		size_t m_lookups[tiers_count];
+		boost::mutex m_spill_mutex;
+		
+		std::set<Key> m_storing; // written to disk by a queued job
+		std::set<Key> m_promoting; // read back from disk by a queued job
+		std::list<std::function<void()>> m_jobs; // disk reads and writes
+		boost::condition_variable m_jobs_cond;
+		bool m_stop;
+		boost::thread m_worker;
+		void work();
+		void post(const std::function<void()> &);
+		
+		// the evicted memory is unmapped by dropping released after the lock
+		void evict_host(size_t, std::vector<std::shared_ptr<Pinned>> &released);
+		void store(const Key &, const HostEntry &);
+		void promote(const Key &, const DiskEntry &);
+		Entry upload(const Layout &, const std::shared_ptr<Pinned> &);
+		void init();
+	protected:
+		void evicted(const Key &, const Entry &);
+	public:
+		SpillCache(mcl::Context &, mcl::Queue &, size_t host_budget, unsigned long long disk_budget=default_disk_budget, const std::string &directory="");
+		SpillCache(mcl::Context &, mcl::Queue &);
+		~SpillCache();
+		
+		// a disk hit is reported as a miss, the entry is promoted to host memory in the background
+		bool find(const Key &, Entry &);
+		void erase(const Layer *);
+		
+		using ResultCache::hits;
+		size_t hits(tier_t) const;
+		size_t lookups(tier_t) const;
+		double hit_rate(tier_t) const;
+		size_t host_size() const { return m_host_size; }
+		size_t host_budget() const { return m_host_budget; }
+		unsigned long long disk_size() const { return m_disk_size; }
+		unsigned long long disk_budget() const { return m_disk_budget; }
+	};
+}
+
+#endif // MAY_SPILL_HPP
@@ -0,0 +1,177 @@
+#include "tiles.hpp"
+
+namespace layer {
+	
+	const size_t TiledRenderer::default_tile;
+	
+	TiledRenderer::TiledRenderer(Layer &root, size_t width, size_t height, size_t tile_width, size_t tile_height, size_t resolution, Priority priority) :
+			m_root(root), m_queue(root.context().queue(priority)), m_width(width), m_height(height),
+			m_tile_width(std::max<size_t>(tile_width, 1)), m_tile_height(std::max<size_t>(tile_height, 1)), m_resolution(resolution), m_priority(priority) {}
+	
+	Region TiledRenderer::tile(size_t column, size_t row) const {
+		return Region(column*m_tile_width, row*m_tile_height, m_tile_width, m_tile_height).clipped(m_width, m_height);
+	}
+	
+	std::vector<Region> TiledRenderer::tiles(const Region &r) const {
+		std::vector<Region> result;
+		Region c = r.clipped(m_width, m_height);
+		if(c.is_empty())
+			return result;
+		for(size_t y = c.y/m_tile_height; y*m_tile_height<c.bottom(); y++)
+			for(size_t x = c.x/m_tile_width; x*m_tile_width<c.right(); x++)
+				result.push_back(tile(x, y));
+		return result;
+	}
+	
+	// input parts of every layer needed for a root part, halos come from Layer::input_region
+	void TiledRenderer::pull(const Region &r, std::map<const Layer *, Region> &regions) const {
+		std::vector<Layer *> order = topological_order(m_root);
+		regions[&m_root] = r;
+		for(auto i = order.rbegin(); i!=order.rend(); i++) {
+			Region out = regions[*i];
+			for(auto a = (*i)->arguments().begin(); a!=(*i)->arguments().end(); a++) {
+				if(!(bool)a->value())
+					continue;
+				Region in = (*i)->input_region(*a, out).clipped(m_width, m_height);
+				auto j = regions.find(a->value().get());
+				if(j==regions.end())
+					regions[a->value().get()] = in;
+				else
+					j->second = j->second.united(in);
+			}
+		}
+	}
+	
+	void TiledRenderer::prepare() {
+		std::vector<Layer *> order = topological_order(m_root);
+		std::vector<Storage> storages;
+		for(auto i = order.begin(); i!=order.end(); i++) {
+			if((*i)->external())
+				throw mcl::Error(CL_INVALID_OPERATION); // written from outside, no part of it is uploaded into the part slots
+			storages.push_back((*i)->storage());
+		}
+		if((bool)m_plan && m_plan->order()==order && m_storages==storages)
+			return;
+		// every storage of a tile holds the frame of its pulled parts, slots fit the largest frame
+		size_t width = 0, height = 0;
+		for(size_t y=0; y<rows(); y++) {
+			for(size_t x=0; x<columns(); x++) {
+				std::map<const Layer *, Region> regions;
+				pull(tile(x, y), regions);
+				Region frame;
+				for(auto i = regions.begin(); i!=regions.end(); i++)
+					frame = frame.united(i->second);
+				width = std::max(width, frame.width);
+				height = std::max(height, frame.height);
+			}
+		}
+		std::map<const Layer *, Storage> sizes;
+		for(auto i = order.begin(); i!=order.end(); i++)
+			sizes[*i] = (*i)->storage().part(Region(0, 0, width, height));
+		m_executor.reset();
+		m_plan.reset(new MemoryPlan(m_root, sizes));
+		m_storages = storages;
+		mcl::Context c = m_root.context().mcl_context();
+		m_plan->allocate(c);
+		m_executor.reset(new Executor(*m_plan, m_queue));
+		m_executor->set_bounds(Region(0, 0, m_width, m_height));
+		m_executor->set_framed(true);
+		m_executor->set_resolution(m_resolution);
+		if(m_priority!=pr_interactive)
+			m_executor->set_dispatcher(&m_root.context().dispatcher(), m_priority);
+		else
+			m_executor->set_priority(pr_interactive);
+	}
+	
+	bool TiledRenderer::reuse(const Region &t, ResultCache::Entry &e) {
+		auto i = m_rendered.find(t);
+		std::vector<Region> dirty;
+		if(i==m_rendered.end() || !m_root.dirty_regions(i->second, dirty))
+			return false;
+		ResultCache::Entry previous;
+		if(!m_root.context().cache().find(ResultCache::Key(&m_root, i->second, t, m_resolution), previous))
+			return false;
+		bool changed = false;
+		for(auto d = dirty.begin(); d!=dirty.end() && !changed; d++)
+			changed = d->reduced(m_resolution).intersects(t);
+		if(changed) {
+			// only a plan of the full size updates a part in place
+			if(!(t==Region(0, 0, m_width, m_height)))
+				return false;
+			prepare();
+			if(!m_executor->update(i->second, previous) || !m_executor->complete())
+				return false;
+		}
+		e = previous;
+		m_root.cache_result(t, m_resolution, e);
+		i->second = m_root.version();
+		return true;
+	}
+	
+	ResultCache::Entry TiledRenderer::render(const Region &t, bool *complete) {
+		ResultCache::Entry e;
+		if(complete)
+			*complete = true;
+		if(m_root.cached_result(t, m_resolution, e) || reuse(t, e))
+			return e;
+		prepare();
+		std::vector<mcl::Event> done = m_executor->run(t);
+		// the root slot is reused by the next tile, the tile is copied out of the frame
+		Storage st = m_plan->storage(&m_root);
+		Region f = m_executor->frame();
+		mcl::Context c = m_root.context().mcl_context();
+		size_t origin[] = { 0, 0, 0 };
+		mcl::Event copied;
+		if(st.kind==Storage::sk_image) {
+			e = ResultCache::Entry(c.image_rw(st.format, t.width, t.height));
+			size_t src[] = { t.x - f.x, t.y - f.y, 0 };
+			size_t size[] = { t.width, t.height, 1 };
+			copied = m_queue.copy(m_executor->image(&m_root), *e.image, src, origin, size, done);
+		} else if(st.kind==Storage::sk_buffer && st.width && st.height) {
+			size_t pixel = st.size/(st.width*st.height);
+			e = ResultCache::Entry(c.buffer_rw(pixel*t.width*t.height));
+			size_t src[] = { (t.x - f.x)*pixel, t.y - f.y, 0 };
+			size_t size[] = { pixel*t.width, t.height, 1 };
+			copied = m_queue.copy(m_executor->buffer(&m_root), *e.buffer, src, origin, size, pixel*st.width, pixel*t.width, done);
+		} else
+			throw mcl::Error(CL_INVALID_MEM_OBJECT);
+		m_executor->add_reader(&m_root, copied);
+		e.ready = copied;
+		m_queue.flush();
+		if(m_executor->complete()) {
+			m_root.cache_result(t, m_resolution, e);
+			m_rendered[t] = m_root.version();
+		} else if(complete)
+			*complete = false;
+		return e;
+	}
+	
+	bool TiledRenderer::read(const Region &r, void *host, size_t row_pitch) {
+		std::vector<mcl::Event> reads;
+		std::vector<Region> ts = tiles(r);
+		bool result = true;
+		for(auto t = ts.begin(); t!=ts.end(); t++) {
+			bool complete;
+			ResultCache::Entry e = render(*t, &complete);
+			result = result && complete;
+			Region p = t->intersected(r);
+			std::vector<mcl::Event> deps(1, e.ready);
+			size_t pixel = e.image ? e.image->element_size() : e.size/(t->width*t->height);
+			char *dst = reinterpret_cast<char *>(host) + (p.y-r.y)*row_pitch + (p.x-r.x)*pixel;
+			size_t size[] = { p.width, p.height, 1 };
+			if(e.image) {
+				size_t origin[] = { p.x-t->x, p.y-t->y, 0 };
+				reads.push_back(m_queue.read(*e.image, dst, origin, size, row_pitch, deps));
+			} else {
+				size_t origin[] = { (p.x-t->x)*pixel, p.y-t->y, 0 };
+				size_t host_origin[] = { 0, 0, 0 };
+				size[0] *= pixel;
+				reads.push_back(m_queue.read(*e.buffer, dst, origin, host_origin, size, pixel*t->width, row_pitch, deps));
+			}
+		}
+		m_queue.flush();
+		for(auto i = reads.begin(); i!=reads.end(); i++)
+			i->wait();
+		return result;
+	}
+}
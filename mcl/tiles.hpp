@@ -0,0 +1,57 @@
+#ifndef MAY_TILES_HPP
+#define MAY_TILES_HPP
+
+#include "execute.hpp"
+#include <vector>
+#include <map>
+#include <memory>
+
+namespace layer {
+	
+	// renders the root output tile by tile on demand, device memory is bounded by the tile size plus halos,
+	// the graph computes every pixel itself, external layers (sources without host pixels) are rejected
+	class TiledRenderer {
+	public:
+		static const size_t default_tile = 512;
+	private:
+		Layer &m_root;
+		mcl::Queue m_queue;
+		size_t m_width;
+		size_t m_height;
+		size_t m_tile_width;
+		size_t m_tile_height;
+		size_t m_resolution;
+		Priority m_priority;
+		std::shared_ptr<MemoryPlan> m_plan;
+		std::vector<Storage> m_storages; // of the planned layers, a change of any of them re-plans
+		std::shared_ptr<Executor> m_executor;
+		std::map<Region, long long> m_rendered; // root version of the last complete result of each tile
+		void pull(const Region &, std::map<const Layer *, Region> &) const;
+		void prepare();
+		// the last result of a tile no edit reached since, or updated in place if the tile is the whole output
+		bool reuse(const Region &tile, ResultCache::Entry &);
+	public:
+		// width and height of the output at the resolution, background renders are sliced on their own queue
+		TiledRenderer(Layer &root, size_t width, size_t height, size_t tile_width=default_tile, size_t tile_height=default_tile, size_t resolution=1,
+			Priority priority=pr_interactive);
+		size_t resolution() const { return m_resolution; }
+		Priority priority() const { return m_priority; }
+		
+		size_t columns() const { return (m_width + m_tile_width - 1)/m_tile_width; }
+		size_t rows() const { return (m_height + m_tile_height - 1)/m_tile_height; }
+		Region tile(size_t column, size_t row) const;
+		// tiles covering a part of the output in row order
+		std::vector<Region> tiles(const Region &) const;
+		
+		// renders a tile, served from the result cache while the root is unchanged or the edits missed the tile,
+		// complete is false if interactive rendering skipped layers still compiling, the tile is not cached then
+		ResultCache::Entry render(const Region &tile, bool *complete=0);
+		// renders the tiles covering a region and reads them into host memory with rows row_pitch bytes apart,
+		// false if some of them are not complete
+		bool read(const Region &, void *host, size_t row_pitch);
+		// device memory used by the intermediates of one tile
+		size_t device_memory() { prepare(); return m_plan->planned_peak(); }
+	};
+}
+
+#endif // MAY_TILES_HPP
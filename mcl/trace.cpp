@@ -0,0 +1,141 @@
+#include "trace.hpp"
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+namespace mcl {
+	
+	volatile bool Trace::m_enabled = false;
+	const size_t Trace::ring_size;
+	
+	namespace {
+		struct Span {
+			const char *name;
+			const char *category;
+			long long begin;
+			long long end;
+			size_t lane; // thread or queue
+		};
+		
+		struct Ring {
+			size_t thread;
+			size_t next; // total spans recorded, the oldest are overwritten
+			std::vector<Span> spans;
+			Ring(size_t t) : thread(t), next(0), spans(Trace::ring_size) {}
+			void push(const Span &s) { spans[next++ % spans.size()] = s; }
+		};
+		
+		struct Pending {
+			const char *name;
+			long long queued;
+			cl_command_queue queue;
+		};
+		
+		const boost::posix_time::ptime started = boost::posix_time::microsec_clock::universal_time();
+		
+		// rings outlive their threads so the spans of finished threads are still written
+		boost::mutex rings_mutex;
+		std::vector<std::shared_ptr<Ring>> rings;
+		std::vector<cl_command_queue> queues; // device lanes
+		void keep(Ring *) {}
+		boost::thread_specific_ptr<Ring> ring(keep);
+		
+		Ring &local() {
+			if(!ring.get()) {
+				boost::lock_guard<boost::mutex> lk(rings_mutex);
+				rings.push_back(std::shared_ptr<Ring>(new Ring(rings.size() + 1)));
+				ring.reset(rings.back().get());
+			}
+			return *ring;
+		}
+		
+		// device commands share one ring, callbacks come from driver threads
+		boost::mutex device_mutex;
+		Ring device_ring(0);
+		
+		void completed(cl_event e, cl_int, void *data) {
+			std::unique_ptr<Pending> p(static_cast<Pending *>(data));
+			cl_ulong queued, start, end;
+			if(clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL)==CL_SUCCESS
+					&& clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL)==CL_SUCCESS
+					&& clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL)==CL_SUCCESS) {
+				boost::lock_guard<boost::mutex> lk(device_mutex);
+				size_t lane = std::find(queues.begin(), queues.end(), p->queue) - queues.begin();
+				if(lane==queues.size())
+					queues.push_back(p->queue);
+				Span s = { p->name, "device", p->queued + (long long)(start - queued)/1000, p->queued + (long long)(end - queued)/1000, lane };
+				device_ring.push(s);
+			}
+			clReleaseEvent(e);
+		}
+		
+		void write_name(std::ostream &s, const char *n) {
+			for(; *n; n++) {
+				if(*n=='"' || *n=='\\')
+					s << '\\';
+				s << *n;
+			}
+		}
+		
+		void write_spans(std::ostream &s, const Ring &r, int pid, bool &first) {
+			size_t n = std::min(r.next, r.spans.size());
+			for(size_t i=r.next-n; i<r.next; i++) {
+				const Span &sp = r.spans[i % r.spans.size()];
+				s << (first ? "" : ",\n") << "{\"name\":\"";
+				write_name(s, sp.name);
+				s << "\",\"cat\":\"" << sp.category << "\",\"ph\":\"X\",\"ts\":" << sp.begin << ",\"dur\":" << (sp.end - sp.begin)
+					<< ",\"pid\":" << pid << ",\"tid\":" << sp.lane << "}";
+				first = false;
+			}
+		}
+	}
+	
+	void Trace::enable(bool e) {
+		m_enabled = e;
+	}
+	
+	long long Trace::now() {
+		return (boost::posix_time::microsec_clock::universal_time() - started).total_microseconds();
+	}
+	
+	void Trace::record(const char *name, const char *category, long long begin, long long end) {
+		Ring &r = local();
+		Span s = { name, category, begin, end, r.thread };
+		r.push(s);
+	}
+	
+	void Trace::device(const char *name, cl_event e, long long queued) {
+		Pending *p = new Pending;
+		p->name = name;
+		p->queued = queued;
+		p->queue = NULL;
+		clGetEventInfo(e, CL_EVENT_COMMAND_QUEUE, sizeof(p->queue), &p->queue, NULL);
+		if(clSetEventCallback(e, CL_COMPLETE, completed, p)!=CL_SUCCESS) {
+			delete p;
+			clReleaseEvent(e);
+		}
+	}
+	
+	void Trace::clear() {
+		boost::lock_guard<boost::mutex> lk(rings_mutex);
+		for(auto i = rings.begin(); i!=rings.end(); i++)
+			(*i)->next = 0;
+		boost::lock_guard<boost::mutex> dlk(device_mutex);
+		device_ring.next = 0;
+	}
+	
+	void Trace::write(std::ostream &s) {
+		boost::lock_guard<boost::mutex> lk(rings_mutex);
+		boost::lock_guard<boost::mutex> dlk(device_mutex);
+		bool first = true;
+		s << "{\"traceEvents\":[\n";
+		for(auto i = rings.begin(); i!=rings.end(); i++)
+			write_spans(s, **i, 0, first);
+		write_spans(s, device_ring, 1, first);
+		s << (first ? "" : ",\n") << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"host\"}},\n";
+		s << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"device\"}}";
+		s << "\n],\"displayTimeUnit\":\"ms\"}" << std::endl;
+	}
+}
@@ -0,0 +1,42 @@
+#ifndef MAY_TRACE_HPP
+#define MAY_TRACE_HPP
+
+#include "CL/cl.h"
+#include <ostream>
+
+namespace mcl {
+	
+	// timeline of host spans and device commands, written as Chrome trace events (chrome://tracing)
+	// every thread records into its own ring buffer, nothing is recorded while disabled
+	class Trace {
+	private:
+		static volatile bool m_enabled;
+	public:
+		static const size_t ring_size = 1 << 16; // spans kept per thread
+		static bool enabled() { return m_enabled; }
+		static void enable(bool);
+		// microseconds since the process started
+		static long long now();
+		static void record(const char *name, const char *category, long long begin, long long end);
+		// takes the event, its profiling times are recorded once it completes, queued is the host time of the enqueue
+		static void device(const char *name, cl_event, long long queued);
+		static void clear();
+		// should not run while other threads are recording
+		static void write(std::ostream &);
+	};
+	
+	class TraceSpan {
+	private:
+		const char *m_name;
+		const char *m_category;
+		long long m_begin;
+	public:
+		TraceSpan(const char *name, const char *category) : m_name(name), m_category(category), m_begin(Trace::enabled() ? Trace::now() : -1) {}
+		~TraceSpan() {
+			if(m_begin>=0)
+				Trace::record(m_name, m_category, m_begin, Trace::now());
+		}
+	};
+}
+
+#endif // MAY_TRACE_HPP
@@ -0,0 +1,90 @@
+// Region arithmetic and ResultCache eviction, no device needed
+
+#include "mcl/cache.hpp"
+#include "check.hpp"
+#include <vector>
+
+using layer::Region;
+using layer::ResultCache;
+
+static const size_t max = std::numeric_limits<size_t>::max();
+
+static void regions() {
+	Region all = Region::everything(), r(10, 20, 30, 40);
+	CHECK(all.is_everything() && !all.is_empty());
+	CHECK(r.right()==40 && r.bottom()==60);
+	// edges saturate instead of wrapping around
+	CHECK(all.right()==max && all.bottom()==max);
+	Region far(max-5, max-5, 100, 100);
+	CHECK(far.right()==max && far.bottom()==max);
+	CHECK(all.intersected(r)==r && r.intersected(all)==r);
+	CHECK(all.united(r).is_everything() && r.united(all).is_everything());
+	CHECK(all.dilated(8).is_everything());
+	CHECK(far.dilated(8)==Region(max-13, max-13, 13, 13));
+	CHECK(r.dilated(15)==Region(0, 5, 55, 70));
+	CHECK(all.clipped(640, 480)==Region(0, 0, 640, 480));
+	CHECK(Region(600, 400, 100, 100).clipped(640, 480)==Region(600, 400, 40, 80));
+	// a preview pixel is dirty if any of its full size pixels is
+	CHECK(r.reduced(8)==Region(1, 2, 4, 6) && all.reduced(8).is_everything());
+	CHECK(Region(16, 16, 8, 8).reduced(8)==Region(2, 2, 1, 1));
+	
+	Region a(0, 0, 10, 10);
+	CHECK(!a.intersects(Region(10, 0, 5, 5)) && a.intersected(Region(10, 0, 5, 5)).is_empty());
+	CHECK(a.intersects(Region(9, 9, 5, 5)) && a.intersected(Region(9, 9, 5, 5))==Region(9, 9, 1, 1));
+	CHECK(a.united(Region(20, 30, 5, 5))==Region(0, 0, 25, 35));
+	CHECK(Region().united(r)==r && r.united(Region())==r);
+	CHECK(Region().dilated(4).is_empty());
+}
+
+class RecordingCache : public ResultCache {
+public:
+	std::vector<long long> dropped; // versions of the evicted keys
+	RecordingCache(size_t budget) : ResultCache(budget) {}
+protected:
+	void evicted(const Key &k, const Entry &) { dropped.push_back(k.version); }
+};
+
+static ResultCache::Key key(long long version) {
+	return ResultCache::Key(0, version, Region::everything(), 1);
+}
+
+static ResultCache::Entry entry(size_t size) {
+	ResultCache::Entry e;
+	e.size = size;
+	return e;
+}
+
+static void eviction() {
+	RecordingCache c(300);
+	ResultCache::Entry e;
+	c.insert(key(1), entry(100));
+	c.insert(key(2), entry(100));
+	c.insert(key(3), entry(100));
+	CHECK(c.size()==300 && c.dropped.empty());
+	// a hit makes the entry the most recently used
+	CHECK(c.find(key(1), e) && e.size==100);
+	c.insert(key(4), entry(100));
+	CHECK(c.dropped==std::vector<long long>(1, 2));
+	CHECK(!c.find(key(2), e) && c.find(key(1), e));
+	CHECK(c.hits()==2 && c.misses()==1);
+	// larger than the whole budget, never stored
+	c.insert(key(5), entry(400));
+	CHECK(!c.find(key(5), e) && c.size()==300 && c.dropped.size()==1);
+	// replacing an entry frees its old size first
+	c.insert(key(3), entry(50));
+	CHECK(c.size()==250 && c.dropped.size()==1);
+	// least recently used first: 4, then 1, 3 fits
+	c.set_budget(100);
+	long long order[] = { 2, 4, 1 };
+	CHECK(c.dropped==std::vector<long long>(order, order+3));
+	CHECK(c.size()==50 && c.find(key(3), e));
+	// erased entries are not reported as evicted
+	c.erase(0);
+	CHECK(c.size()==0 && c.dropped.size()==3 && !c.find(key(3), e));
+}
+
+int main() {
+	regions();
+	eviction();
+	return failures;
+}
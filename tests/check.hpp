@@ -0,0 +1,42 @@
+#ifndef MAY_CHECK_HPP
+#define MAY_CHECK_HPP
+
+#include "mcl/layer.hpp"
+#include <iostream>
+#include <vector>
+
+// failed checks are printed and counted, the test exits with their number
+static int failures = 0;
+
+#define CHECK(e) do { \
+		if(!(e)) { \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #e << std::endl; \
+			failures++; \
+		} \
+	} while(0)
+
+// runs the tests on the first OpenCL device, skipped without one; an error once a device is found fails the test
+template<typename F> int on_device(F tests) {
+	bool found = false;
+	try {
+		const std::vector<mcl::Platform> &platforms = mcl::Platform::platforms();
+		for(auto p = platforms.begin(); p!=platforms.end(); p++) {
+			std::vector<mcl::Device> devs = p->devices();
+			if(devs.empty())
+				continue;
+			found = true;
+			mcl::Context cl(devs[0]);
+			layer::Context c(cl, devs[0]);
+			tests(c);
+			return failures;
+		}
+	} catch(const mcl::Error &e) {
+		std::cerr << "error: " << e.code() << ": " << e.what() << std::endl;
+		if(found)
+			return failures+1;
+	}
+	std::cout << "skipped: no OpenCL device" << std::endl;
+	return failures;
+}
+
+#endif // MAY_CHECK_HPP
@@ -0,0 +1,91 @@
+// dirty region history of layers, its propagation and partial updates, skipped without an OpenCL device
+
+#include "mcl/layers.hpp"
+#include "mcl/execute.hpp"
+#include "check.hpp"
+#include <vector>
+
+using layer::Region;
+
+static void history(layer::Context &c) {
+	std::shared_ptr<layer::Layer> src = c.create("source"), inv = c.create("invert");
+	inv->argument("image").set_value(src);
+	long long since = src->version(), inv_since = inv->version();
+	std::vector<Region> r;
+	CHECK(src->dirty_regions(since, r) && r.empty());
+	src->invalidate(Region(0, 0, 0, 4));
+	CHECK(src->version()==since && src->dirty_regions(since, r) && r.empty());
+	
+	// the consumer gets the affected part of its own output
+	src->invalidate(Region(5, 5, 2, 2));
+	r.clear();
+	CHECK(inv->dirty_regions(inv_since, r) && r.size()==1 && r[0]==Region(5, 5, 2, 2));
+	
+	for(size_t i=1; i<layer::Layer::max_dirty; i++)
+		src->invalidate(Region(i, 0, 1, 1));
+	r.clear();
+	CHECK(src->dirty_regions(since, r) && r.size()==layer::Layer::max_dirty);
+	r.clear();
+	CHECK(src->dirty_regions(since+1, r) && r.size()==layer::Layer::max_dirty-1);
+	// one more drops the oldest, older versions need the whole output
+	src->invalidate(Region(0, 1, 1, 1));
+	r.clear();
+	CHECK(!src->dirty_regions(since, r));
+	CHECK(src->dirty_regions(since+1, r) && r.size()==layer::Layer::max_dirty);
+	r.clear();
+	CHECK(src->dirty_regions(src->version(), r) && r.empty());
+}
+
+// an edit off the origin recomputes and copies only its own pixels
+static void update(layer::Context &c) {
+	const size_t w = 8, h = 6;
+	std::shared_ptr<layer::Layer> src = c.create("source"), inv = c.create("invert");
+	dynamic_cast<layer::SourceLayer &>(*src).set_size(w, h);
+	inv->argument("image").set_value(src);
+	layer::MemoryPlan plan(*inv);
+	mcl::Context cl = c.mcl_context();
+	plan.allocate(cl);
+	mcl::Queue q = c.queue();
+	layer::Executor ex(plan, q);
+	std::vector<cl_uchar4> pixels(w*h);
+	for(size_t i=0; i<pixels.size(); i++) {
+		cl_uchar4 p = {{ cl_uchar(i), cl_uchar(i*2), cl_uchar(i*3), 255 }};
+		pixels[i] = p;
+	}
+	long long since = inv->version();
+	// zeros left anywhere the update does not copy to
+	std::vector<cl_uchar4> out(w*h, cl_uchar4());
+	layer::ResultCache::Entry previous(cl.buffer_rw(w*h*sizeof(cl_uchar4)));
+	previous.ready = q.write(out.data(), *previous.buffer);
+	
+	Region edit(5, 3, 2, 2);
+	for(size_t y=edit.y; y<edit.bottom(); y++)
+		for(size_t x=edit.x; x<edit.right(); x++)
+			pixels[y*w + x].s[0] = 200;
+	q.write(pixels.data(), plan.buffer(src.get())).wait();
+	src->invalidate(edit);
+	CHECK(ex.update(since, previous));
+	q.read(*previous.buffer, out.data(), std::vector<mcl::Event>(1, previous.ready)).wait();
+	bool inside = true, outside = true;
+	for(size_t y=0; y<h; y++) {
+		for(size_t x=0; x<w; x++) {
+			const cl_uchar4 &p = pixels[y*w + x], &o = out[y*w + x];
+			if(edit.intersects(Region(x, y, 1, 1)))
+				inside = inside && o.s[0]==255-p.s[0] && o.s[1]==255-p.s[1] && o.s[2]==255-p.s[2] && o.s[3]==p.s[3];
+			else
+				outside = outside && !o.s[0] && !o.s[1] && !o.s[2] && !o.s[3];
+		}
+	}
+	CHECK(inside);
+	CHECK(outside);
+}
+
+static void tests(layer::Context &c) {
+	history(c);
+	update(c);
+}
+
+int main() {
+	layer::register_layers();
+	return on_device(tests);
+}
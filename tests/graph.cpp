@@ -0,0 +1,51 @@
+// memory plans of layer graphs, skipped without an OpenCL device
+
+#include "mcl/layers.hpp"
+#include "mcl/graph.hpp"
+#include "check.hpp"
+#include <vector>
+
+// reads two images, stands for any layer combining its inputs
+class PairLayer : public layer::Layer {
+private:
+	static std::vector<layer::Argument> pair() {
+		std::vector<layer::Argument> r;
+		r.push_back(layer::Argument(layer::Type::ltp_color, "a"));
+		r.push_back(layer::Argument(layer::Type::ltp_color, "b"));
+		return r;
+	}
+public:
+	PairLayer(layer::Context &c) : layer::Layer(c, pair()) {}
+	layer::Storage storage() const { return argument("a").value()->storage(); }
+	mclang::ExpressionRef compute(size_t) { return mclang::ExpressionRef(); }
+};
+
+// a source planned after other layers still owns its slot from the start of the run
+static void sources(layer::Context &c) {
+	std::shared_ptr<layer::Layer> a = c.create("source"), b = c.create("source"), inv1 = c.create("invert"), inv2 = c.create("invert");
+	dynamic_cast<layer::SourceLayer &>(*a).set_size(16, 16);
+	dynamic_cast<layer::SourceLayer &>(*b).set_size(16, 16);
+	inv1->argument("image").set_value(b);
+	inv2->argument("image").set_value(inv1);
+	PairLayer pair(c);
+	pair.argument("a").set_value(inv2);
+	pair.argument("b").set_value(a);
+	
+	layer::MemoryPlan plan(pair);
+	const std::vector<layer::Layer *> &order = plan.order();
+	CHECK(order.size()==5 && plan.index(a.get())>plan.index(inv1.get()));
+	for(size_t i=0; i<order.size(); i++) {
+		if(order[i]==a.get() || order[i]==b.get())
+			continue;
+		CHECK(plan.slot(order[i])!=plan.slot(a.get()) || i>plan.index(a.get()));
+		CHECK(plan.slot(order[i])!=plan.slot(b.get()) || i>plan.index(b.get()));
+	}
+	CHECK(plan.slot(a.get())!=plan.slot(b.get()));
+	// both inputs and one intermediate are live while inv1 runs
+	CHECK(plan.live_peak()==3*16*16*sizeof(cl_uchar4));
+}
+
+int main() {
+	layer::register_layers();
+	return on_device(sources);
+}
@@ -0,0 +1,178 @@
+// sources generated by Expression::build, no OpenCL device needed
+
+#include "mcl/mclang.hpp"
+#include "check.hpp"
+#include <string>
+
+using namespace mclang;
+
+static bool contains(const std::string &s, const std::string &part) {
+	return s.find(part)!=std::string::npos;
+}
+
+// specialized arguments become constants of the snapshot the source is built from
+static void specialization() {
+	std::shared_ptr<Argument<cl_int>> radius = arg<cl_int>(3), gain = arg<cl_int>(7);
+	std::shared_ptr<BuffArgument<cl_int>> out = argv<cl_int>();
+	ExpressionRef e = set(select(out, get_global_id(0)), radius*gain);
+	radius->set_specialized(true);
+	
+	std::string generic = e->build();
+	CHECK(contains(generic, radius->id()) && contains(generic, gain->id()));
+	
+	Expression::Specialization sp = e->specialization();
+	CHECK(sp.values.size()==1 && !sp.key.empty());
+	std::string special = e->build(sp);
+	CHECK(!contains(special, radius->id()) && contains(special, "(0x3 * " + gain->id() + ")"));
+	
+	// later changes reach neither the key nor the source of the snapshot
+	radius->set(5);
+	CHECK(e->build(sp)==special);
+	CHECK(e->specialization().key!=sp.key && contains(e->build(true), "(0x5 * "));
+	
+	// a specialized condition removes the branch not taken
+	std::shared_ptr<Argument<cl_int>> flag = arg<cl_int>(0);
+	flag->set_specialized(true);
+	ExpressionRef c = cond(flag, set(select(out, get_global_id(0)), cnst<cl_int>(1)), set(select(out, get_global_id(0)), gain));
+	std::string branch = c->build(true);
+	CHECK(!contains(branch, "if(") && !contains(branch, "0x1;") && contains(branch, "= " + gain->id()));
+}
+
+// unread variables, their stores, untaken branches and the parameters only they used are dropped
+static void dead_code() {
+	std::shared_ptr<Argument<cl_int>> a = arg<cl_int>(3), b = arg<cl_int>(7);
+	std::shared_ptr<BuffArgument<cl_int>> out = argv<cl_int>();
+	ExpressionRef unread = var<cl_int>(b*b), read = var<cl_int>(a);
+	ExpressionRef e = seq({
+		set(unread, b + b),
+		set(select(out, get_global_id(0)), read),
+		cond(cnst<cl_int>(0), set(select(out, get_global_id(1)), b))
+	});
+	std::string src = e->build();
+	CHECK(!contains(src, unread->id()) && contains(src, read->id()));
+	CHECK(!contains(src, b->id()) && contains(src, "int " + a->id() + ")"));
+	CHECK(!contains(src, "get_global_id(1u)") && !contains(src, "if("));
+}
+
+static size_t count(const std::string &s, const std::string &part) {
+	size_t r = 0;
+	for(size_t i = s.find(part); i!=std::string::npos; i = s.find(part, i+part.size()))
+		r++;
+	return r;
+}
+
+// constant trip counts are unrolled, fully under the budget and by a factor above it,
+// index independent subtrees are computed once before the loop
+static void loops() {
+	std::shared_ptr<BuffArgument<cl_float>> in = argv<cl_float>(), out = argv<cl_float>();
+	std::shared_ptr<Argument<cl_float>> k = arg<cl_float>(2.0f);
+	std::shared_ptr<Argument<cl_int>> n = arg<cl_int>(100);
+	ExpressionRef i = var<cl_int>(), acc = var<cl_float>(cnst<cl_float>(0.0f)), gain = k*k;
+	ExpressionRef body = set(acc, acc + select(in, i)*gain);
+	ExpressionRef store = set(select(out, get_global_id(0)), acc);
+	
+	std::string full = seq({for_range(i, cnst<cl_int>(0), cnst<cl_int>(3), body), store})->build();
+	CHECK(!contains(full, "for(") && count(full, "[" + i->id() + "]")==3);
+	CHECK(contains(full, i->id() + " = 2;") && contains(full, i->id() + " = 3;"));
+	
+	std::string partial = seq({for_range(i, cnst<cl_int>(0), cnst<cl_int>(100), body), store})->build();
+	CHECK(count(partial, "for(")==2 && count(partial, i->id() + "++;")==8 && contains(partial, " < 96; )"));
+	
+	// the invariant product is declared once ahead of the loop and only read in the body
+	std::string hoisted = seq({for_range(i, cnst<cl_int>(0), n, body), store})->build();
+	std::string product = "(" + k->id() + " * " + k->id() + ")";
+	CHECK(count(hoisted, product)==1 && count(hoisted, "for(")==1);
+	CHECK(hoisted.find(product)<hoisted.find("for(") && contains(hoisted, "_h = " + product + ";"));
+	
+	// an integer division may trap for the values the loop guards against, it stays inside
+	ExpressionRef quotient = set(acc, acc + cast<cl_float>(n/n));
+	std::string guarded = seq({for_range(i, cnst<cl_int>(0), n, quotient), store})->build();
+	size_t division = guarded.find("(" + n->id() + " / " + n->id() + ")");
+	CHECK(division!=std::string::npos && division>guarded.find("for("));
+}
+
+// side-effect-free conditionals become select() unless an arm reads memory or is expensive
+static void predication() {
+	std::shared_ptr<BuffArgument<cl_float>> in = argv<cl_float>(), out = argv<cl_float>();
+	std::shared_ptr<Argument<cl_float>> x = arg<cl_float>(1.0f), y = arg<cl_float>(2.0f);
+	ExpressionRef v = var<cl_float>();
+	ExpressionRef store = set(select(out, get_global_id(0)), v);
+	
+	std::string cheap = seq({set(v, ternary(x, y*y, x + y)), cond(y, set(v, x), set(v, y)), store})->build();
+	CHECK(count(cheap, "select(")==2 && !contains(cheap, "if(") && !contains(cheap, " ? "));
+	CHECK(contains(cheap, "select(" + y->id() + ", " + x->id() + ", ((int)(" + y->id() + " != 0)))"));
+	
+	// a guarded read may be out of bounds when the condition is false
+	std::string read = seq({set(v, ternary(x, select(in, get_global_id(0)), x + y)), store})->build();
+	CHECK(!contains(read, "select(") && contains(read, " ? "));
+	
+	// the cost counts operations, not characters: a long sum of cheap terms is predicated, one library call is not
+	ExpressionRef sum = x;
+	for(int i=0; i<15; i++)
+		sum = sum + (i%2 ? x : y);
+	std::string longer = seq({set(v, ternary(x, sum, y)), store})->build();
+	CHECK(longer.size()>512 && contains(longer, "select("));
+	std::string call = seq({cond(x, set(v, exp(y)), set(v, y)), store})->build();
+	CHECK(!contains(call, "select(") && contains(call, "if("));
+	CHECK(!contains(seq({set(v, ternary(x, pow(x, y), y)), store})->build(), "select("));
+}
+
+// read-only buffers are const, buffers bound to distinct memory are restrict
+static void qualifiers() {
+	std::shared_ptr<BuffArgument<cl_uchar4>> in = argv<cl_uchar4>(), out = argv<cl_uchar4>();
+	ExpressionRef gid = get_global_id(0);
+	ExpressionRef copy = set(select(out, gid), select(in, gid));
+	
+	std::string distinct = copy->build();
+	CHECK(contains(distinct, "const __global uchar4 * restrict " + in->id()));
+	CHECK(contains(distinct, "__global uchar4 * restrict " + out->id()) && !contains(distinct, "const __global uchar4 * restrict " + out->id()));
+	
+	ExpressionsSet aliased;
+	aliased.insert(in.get());
+	aliased.insert(out.get());
+	std::string same = copy->build(false, aliased);
+	CHECK(!contains(same, "restrict") && contains(same, "const __global uchar4 * " + in->id()));
+	
+	// a buffer both read and written is not const
+	ExpressionRef update = set(select(out, gid), select(out, gid) ^ select(in, gid));
+	std::string both = update->build();
+	CHECK(contains(both, "__global uchar4 * restrict " + out->id()) && !contains(both, "const __global uchar4 * restrict " + out->id()));
+}
+
+// element i of the output may overwrite element i of the input only for an exact work-item index
+static void pointwise() {
+	std::shared_ptr<BuffArgument<cl_uchar4>> in = argv<cl_uchar4>(), out = argv<cl_uchar4>();
+	std::shared_ptr<Argument<cl_uchar4>> mask = arg<cl_uchar4>();
+	ExpressionRef gid = get_global_id(0);
+	
+	CHECK(set(select(out, gid), select(in, gid) ^ mask)->is_pointwise(in.get(), out.get()));
+	CHECK(!set(select(out, gid), select(in, gid + cnst<cl_uint>(1)))->is_pointwise(in.get(), out.get()));
+	CHECK(!set(select(out, gid + cnst<cl_uint>(0)), select(in, gid))->is_pointwise(in.get(), out.get()));
+	CHECK(!set(select(out, get_global_id(1)), select(in, gid))->is_pointwise(in.get(), out.get()));
+	// rows of a 2D range a pitch apart
+	std::shared_ptr<Argument<cl_uint>> pitch = arg<cl_uint>(64);
+	ExpressionRef row_major = get_global_id(1)*pitch + gid, column_major = gid*pitch + get_global_id(1);
+	CHECK(set(select(out, row_major), select(in, row_major) ^ mask)->is_pointwise(in.get(), out.get()));
+	CHECK(!set(select(out, column_major), select(in, column_major))->is_pointwise(in.get(), out.get()));
+	CHECK(!set(select(out, row_major + cnst<cl_uint>(1)), select(in, row_major + cnst<cl_uint>(1)))->is_pointwise(in.get(), out.get()));
+	
+	// the input is read again after the output element was written
+	ExpressionRef twice = seq({set(select(out, gid), select(in, gid)), set(select(out, gid), select(in, gid) ^ mask)});
+	CHECK(!twice->is_pointwise(in.get(), out.get()));
+	// a loop touches the element once per iteration
+	ExpressionRef i = var<cl_int>();
+	ExpressionRef loop = for_range(i, cnst<cl_int>(0), arg<cl_int>(2), set(select(out, gid), select(in, gid) ^ mask));
+	CHECK(!loop->is_pointwise(in.get(), out.get()));
+	// neither the input nor the output is touched
+	CHECK(!set(select(out, gid), mask)->is_pointwise(in.get(), out.get()));
+}
+
+int main() {
+	specialization();
+	dead_code();
+	loops();
+	predication();
+	qualifiers();
+	pointwise();
+	return failures;
+}
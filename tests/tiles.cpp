@@ -0,0 +1,60 @@
+// tiled renders of layer graphs against full size runs, skipped without an OpenCL device
+
+#include "mcl/layers.hpp"
+#include "mcl/execute.hpp"
+#include "mcl/tiles.hpp"
+#include "check.hpp"
+#include <vector>
+
+using layer::Region;
+
+// tiles off the origin and clipped at the edges upload their part of the source
+static void source_invert(layer::Context &c) {
+	const size_t w = 10, h = 7;
+	std::vector<cl_uchar4> pixels(w*h);
+	for(size_t i=0; i<pixels.size(); i++) {
+		cl_uchar4 p = {{ cl_uchar(i), cl_uchar(i*2), cl_uchar(i*3), cl_uchar(i*5) }};
+		pixels[i] = p;
+	}
+	std::shared_ptr<layer::Layer> src = c.create("source"), inv = c.create("invert");
+	dynamic_cast<layer::SourceLayer &>(*src).set_pixels(pixels.data(), w, h);
+	inv->argument("image").set_value(src);
+	CHECK(!src->external());
+	
+	layer::MemoryPlan plan(*inv);
+	mcl::Context cl = c.mcl_context();
+	plan.allocate(cl);
+	mcl::Queue q = c.queue();
+	layer::Executor ex(plan, q);
+	std::vector<cl_uchar4> full(w*h);
+	q.read(plan.buffer(inv.get()), full.data(), ex.run()).wait();
+	bool inverted = true;
+	for(size_t i=0; i<pixels.size(); i++)
+		inverted = inverted && full[i].s[0]==255-pixels[i].s[0] && full[i].s[3]==pixels[i].s[3];
+	CHECK(inverted);
+	
+	layer::TiledRenderer tiled(*inv, w, h, 4, 3, 1, layer::pr_background);
+	std::vector<cl_uchar4> out(w*h, cl_uchar4());
+	CHECK(tiled.read(Region(0, 0, w, h), out.data(), w*sizeof(cl_uchar4)));
+	bool same = true;
+	for(size_t i=0; i<pixels.size(); i++)
+		for(int k=0; k<4; k++)
+			same = same && out[i].s[k]==full[i].s[k];
+	CHECK(same);
+	
+	// a part across tiles
+	Region part(3, 2, 5, 4);
+	std::vector<cl_uchar4> sub(part.width*part.height, cl_uchar4());
+	CHECK(tiled.read(part, sub.data(), part.width*sizeof(cl_uchar4)));
+	same = true;
+	for(size_t y=0; y<part.height; y++)
+		for(size_t x=0; x<part.width; x++)
+			for(int k=0; k<4; k++)
+				same = same && sub[y*part.width + x].s[k]==full[(part.y + y)*w + part.x + x].s[k];
+	CHECK(same);
+}
+
+int main() {
+	layer::register_layers();
+	return on_device(source_invert);
+}
@@ -0,0 +1,317 @@
+// headless batch processing: img_cl_batch [options] graph (file|directory|@list)...
+
+#include "mcl/mcl.hpp"
+#include "mcl/layer.hpp"
+#include "mcl/layers.hpp"
+#include "mcl/graph.hpp"
+#include "mcl/batch.hpp"
+#include <wx/init.h>
+#include <wx/image.h>
+#include <wx/dir.h>
+#include <wx/filename.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdio>
+#include <boost/thread.hpp>
+
+struct Options {
+	std::string graph;
+	std::vector<std::string> inputs;
+	std::string output;
+	std::string trace;
+	std::string capture;
+	size_t workers;
+	size_t slots;
+	size_t width; // of a source input planned first, the first image if 0, other sizes get pipelines of their own
+	size_t height;
+	bool cpu;
+	Options() : output("."), workers(layer::WorkerPool::default_size()), slots(layer::BatchPipeline::default_slots), width(0), height(0), cpu(false) {}
+};
+
+static void usage() {
+	std::cerr << "usage: img_cl_batch [--cpu] [--workers N] [--slots N] [--size WxH] [--out DIR] [--trace FILE] [--capture FILE] graph (file|directory|@list)..." << std::endl;
+	std::exit(2);
+}
+
+static Options parse(int argc, char **argv) {
+	Options o;
+	for(int i=1; i<argc; i++) {
+		std::string a = argv[i];
+		if(a=="--cpu")
+			o.cpu = true;
+		else if(a=="--workers" && i+1<argc)
+			o.workers = std::max(std::atoi(argv[++i]), 1);
+		else if(a=="--slots" && i+1<argc)
+			o.slots = std::max(std::atoi(argv[++i]), 1);
+		else if(a=="--size" && i+1<argc) {
+			int w = 0, h = 0;
+			if(std::sscanf(argv[++i], "%dx%d", &w, &h)!=2 || w<=0 || h<=0)
+				usage();
+			o.width = w;
+			o.height = h;
+		} else if(a=="--out" && i+1<argc)
+			o.output = argv[++i];
+		else if(a=="--trace" && i+1<argc)
+			o.trace = argv[++i];
+		else if(a=="--capture" && i+1<argc)
+			o.capture = argv[++i];
+		else if(!a.empty() && a[0]=='-')
+			usage();
+		else if(o.graph.empty())
+			o.graph = a;
+		else
+			o.inputs.push_back(a);
+	}
+	if(o.graph.empty() || o.inputs.empty())
+		usage();
+	return o;
+}
+
+static std::vector<std::string> list_files(const std::vector<std::string> &inputs) {
+	std::vector<std::string> r;
+	for(auto i = inputs.begin(); i!=inputs.end(); i++) {
+		if((*i)[0]=='@') {
+			std::ifstream list(i->substr(1).c_str());
+			for(std::string l; std::getline(list, l);)
+				if(!l.empty())
+					r.push_back(l);
+		} else if(wxDir::Exists(wxString::FromUTF8(i->c_str()))) {
+			wxArrayString files;
+			wxDir::GetAllFiles(wxString::FromUTF8(i->c_str()), &files, wxEmptyString, wxDIR_FILES);
+			files.Sort();
+			for(size_t f=0; f<files.GetCount(); f++)
+				r.push_back(std::string(files[f].ToUTF8()));
+		} else
+			r.push_back(*i);
+	}
+	return r;
+}
+
+// 8 bit RGB or RGBA, or float RGBA
+static size_t pixel_size(const layer::Storage &st) {
+	size_t pixel = st.width && st.height ? st.size/(st.width*st.height) : 0;
+	if(pixel!=3 && pixel!=4 && pixel!=16)
+		throw std::runtime_error("unsupported pixel format");
+	return pixel;
+}
+
+static void to_pixels(const wxImage &img, const layer::Storage &st, std::vector<char> &r) {
+	size_t pixel = pixel_size(st), n = st.width*st.height;
+	const unsigned char *rgb = img.GetData(), *alpha = img.HasAlpha() ? img.GetAlpha() : 0;
+	r.resize(st.size);
+	for(size_t i=0; i<n; i++) {
+		unsigned char a = alpha ? alpha[i] : 255;
+		if(pixel==16) {
+			float *p = reinterpret_cast<float *>(&r[i*16]);
+			for(int c=0; c<3; c++)
+				p[c] = rgb[i*3 + c]/255.0f;
+			p[3] = a/255.0f;
+		} else {
+			for(size_t c=0; c<3; c++)
+				r[i*pixel + c] = rgb[i*3 + c];
+			if(pixel==4)
+				r[i*pixel + 3] = a;
+		}
+	}
+}
+
+static wxImage from_pixels(const layer::BatchPipeline::Frame &f, const layer::Storage &st) {
+	size_t pixel = pixel_size(st), n = f.width*f.height;
+	wxImage img(f.width, f.height, false);
+	unsigned char *rgb = img.GetData();
+	for(size_t i=0; i<n; i++) {
+		if(pixel==16) {
+			const float *p = reinterpret_cast<const float *>(&f.pixels[i*16]);
+			for(int c=0; c<3; c++)
+				rgb[i*3 + c] = (unsigned char)(std::min(std::max(p[c], 0.0f), 1.0f)*255.0f + 0.5f);
+		} else {
+			for(size_t c=0; c<3; c++)
+				rgb[i*3 + c] = f.pixels[i*pixel + c];
+		}
+	}
+	return img;
+}
+
+// one device with its own queues, graph and a pipeline per input size
+class Worker {
+private:
+	typedef std::map<std::pair<size_t, size_t>, std::vector<size_t>> sizes_t; // files by width and height
+	mcl::Device m_device;
+	mcl::Context m_cl;
+	layer::Context m_context;
+	layer::SavedGraph m_graph;
+	layer::SourceLayer *m_source; // resized for each input size, 0 if the input is not a source
+	std::vector<std::shared_ptr<layer::BatchPipeline>> m_pipelines; // the last one is planned for the current size
+	size_t m_slots;
+	size_t m_workers;
+	std::vector<std::string> m_files;
+	double m_megapixels;
+	boost::mutex m_mutex;
+	std::string m_error;
+	std::vector<std::string> m_skipped;
+	void skip(const std::string &msg) {
+		boost::lock_guard<boost::mutex> lk(m_mutex);
+		m_skipped.push_back(msg);
+	}
+	void plan() {
+		m_pipelines.push_back(std::shared_ptr<layer::BatchPipeline>(new layer::BatchPipeline(*m_graph.root, *m_graph.input, m_slots, m_workers)));
+	}
+	// runs files through the last pipeline, files of another size are left in other for their own, skipped without it
+	void pass(const std::vector<size_t> &files, sizes_t *other, const std::string &output) {
+		layer::Storage ist = m_graph.input->storage(), ost = m_graph.root->storage();
+		m_pipelines.back()->run(files.size(), [this, &files, &ist, other](size_t i, layer::BatchPipeline::Frame &f) {
+			// an empty frame skips the file, the others go on
+			const std::string &file = m_files[files[i]];
+			wxImage img;
+			if(!img.LoadFile(wxString::FromUTF8(file.c_str())))
+				return skip("cannot decode " + file);
+			size_t w = img.GetWidth(), h = img.GetHeight();
+			if(w!=ist.width || h!=ist.height) {
+				if(!other)
+					return skip(file + ": size differs from the graph input");
+				boost::lock_guard<boost::mutex> lk(m_mutex);
+				(*other)[std::make_pair(w, h)].push_back(files[i]);
+				return;
+			}
+			f.width = w;
+			f.height = h;
+			to_pixels(img, ist, f.pixels);
+		}, [this, &files, &ost, &output](size_t i, const layer::BatchPipeline::Frame &f) {
+			wxFileName name(wxString::FromUTF8(m_files[files[i]].c_str()));
+			name.SetPath(wxString::FromUTF8(output.c_str()));
+			name.SetExt(wxT("png"));
+			if(!from_pixels(f, ost).SaveFile(name.GetFullPath(), wxBITMAP_TYPE_PNG))
+				throw std::runtime_error("cannot write " + std::string(name.GetFullPath().ToUTF8()));
+			boost::lock_guard<boost::mutex> lk(m_mutex);
+			m_megapixels += f.width*f.height/1e6;
+		});
+	}
+public:
+	Worker(mcl::Device &d, const Options &o) : m_device(d), m_cl(d), m_context(m_cl, m_device), m_source(0), m_slots(o.slots), m_workers(o.workers), m_megapixels(0) {
+		std::ifstream in(o.graph.c_str());
+		if(!in)
+			throw std::runtime_error("cannot open " + o.graph);
+		m_graph = layer::load_graph(m_context, in);
+		if(!(bool)m_graph.input)
+			throw std::runtime_error(o.graph + ": no input layer");
+		m_source = dynamic_cast<layer::SourceLayer *>(m_graph.input.get());
+		if(m_source)
+			m_source->set_size(o.width, o.height);
+		layer::WorkerPool pool;
+		layer::GraphBuild build(*m_graph.root, pool);
+		build.wait();
+		plan();
+	}
+	void add(const std::string &f) { m_files.push_back(f); }
+	std::string name() const { return m_device.name(); }
+	double megapixels() const { return m_megapixels; }
+	const std::string &error() const { return m_error; }
+	const std::vector<std::string> &skipped() const { return m_skipped; }
+	// the first pipeline also counts the files it left to the others as skipped
+	const std::vector<std::shared_ptr<layer::BatchPipeline>> &pipelines() const { return m_pipelines; }
+	
+	void run(const std::string &output) {
+		std::vector<size_t> files;
+		for(size_t i=0; i<m_files.size(); i++)
+			files.push_back(i);
+		try {
+			sizes_t other;
+			pass(files, m_source ? &other : 0, output);
+			// the kernels do not depend on the size, only the memory is planned again
+			for(auto s = other.begin(); s!=other.end(); s++) {
+				m_source->set_size(s->first.first, s->first.second);
+				plan();
+				pass(s->second, 0, output);
+			}
+		} catch(const std::exception &e) {
+			m_error = e.what();
+		}
+	}
+};
+
+int main(int argc, char **argv) {
+	Options o = parse(argc, argv);
+	wxInitializer wx;
+	wxInitAllImageHandlers();
+	layer::register_layers();
+	// queues are created with profiling only while tracing
+	mcl::Trace::enable(!o.trace.empty());
+	try {
+		if(!o.capture.empty())
+			mcl::Capture::start(o.capture);
+		std::vector<std::string> files = list_files(o.inputs);
+		if(files.empty()) {
+			std::cerr << "no input files" << std::endl;
+			return 1;
+		}
+		if(!o.width) {
+			wxImage first;
+			if(!first.LoadFile(wxString::FromUTF8(files[0].c_str())))
+				throw std::runtime_error("cannot decode " + files[0]);
+			o.width = first.GetWidth();
+			o.height = first.GetHeight();
+		}
+		std::vector<std::shared_ptr<Worker>> workers;
+		const std::vector<mcl::Platform> &platforms = mcl::Platform::platforms();
+		for(auto p = platforms.begin(); p!=platforms.end(); p++) {
+			std::vector<mcl::Device> devs = p->devices();
+			for(auto d = devs.begin(); d!=devs.end(); d++)
+				if(!o.cpu || d->is_cpu())
+					workers.push_back(std::shared_ptr<Worker>(new Worker(*d, o)));
+		}
+		if(workers.empty()) {
+			std::cerr << "no OpenCL devices" << std::endl;
+			return 1;
+		}
+		for(size_t i=0; i<files.size(); i++)
+			workers[i%workers.size()]->add(files[i]);
+		
+		boost::posix_time::ptime started = boost::posix_time::microsec_clock::universal_time();
+		boost::thread_group threads;
+		for(auto w = workers.begin(); w!=workers.end(); w++) {
+			std::shared_ptr<Worker> wk = *w;
+			threads.create_thread([wk, &o]() { wk->run(o.output); });
+		}
+		threads.join_all();
+		double seconds = (boost::posix_time::microsec_clock::universal_time() - started).total_microseconds()/1e6;
+		
+		int status = 0;
+		size_t images = 0;
+		double megapixels = 0;
+		for(auto w = workers.begin(); w!=workers.end(); w++) {
+			std::cout << (*w)->name() << std::endl;
+			for(auto p = (*w)->pipelines().begin(); p!=(*w)->pipelines().end(); p++) {
+				(*p)->report(std::cout);
+				images += (*p)->processed(layer::BatchPipeline::st_encode);
+			}
+			for(auto s = (*w)->skipped().begin(); s!=(*w)->skipped().end(); s++) {
+				std::cerr << "skipped: " << *s << std::endl;
+				status = 1;
+			}
+			if(!(*w)->error().empty()) {
+				std::cerr << "error: " << (*w)->error() << std::endl;
+				status = 1;
+			}
+			megapixels += (*w)->megapixels();
+		}
+		mcl::Capture::stop();
+		if(!o.trace.empty()) {
+			std::ofstream f(o.trace.c_str());
+			mcl::Trace::write(f);
+		}
+		std::cout << images << " images, " << seconds << " s, " << (seconds>0 ? images/seconds : 0) << " images/s, "
+			<< (seconds>0 ? megapixels/seconds : 0) << " MP/s" << std::endl;
+		return status;
+	} catch(const mcl::Error &e) {
+		std::cerr << "error: " << e.code() << ": " << e.what() << std::endl;
+	} catch(const std::exception &e) {
+		std::cerr << "error: " << e.what() << std::endl;
+	}
+	return 1;
+}
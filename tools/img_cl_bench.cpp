@@ -0,0 +1,248 @@
+// microbenchmarks: img_cl_bench [--device N] [--repeat N] [--out FILE] [--compare BASELINE] [--threshold PERCENT]
+
+#include "mcl/mcl.hpp"
+#include "mcl/mclang.hpp"
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <cstdlib>
+#include <cmath>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+namespace m = mclang;
+
+struct Result {
+	std::string name;
+	std::string unit;
+	bool higher_better;
+	double value;
+	Result(const std::string &n, const std::string &u, bool h, double v) : name(n), unit(u), higher_better(h), value(v) {}
+};
+
+static size_t repeat = 5;
+
+// median of the runs in milliseconds, the first run warms up
+static double measure(const std::function<void()> &f) {
+	f();
+	std::vector<double> t;
+	for(size_t i=0; i<repeat; i++) {
+		boost::posix_time::ptime s = boost::posix_time::microsec_clock::universal_time();
+		f();
+		t.push_back((boost::posix_time::microsec_clock::universal_time() - s).total_microseconds()/1000.0);
+	}
+	std::sort(t.begin(), t.end());
+	return t[t.size()/2];
+}
+
+static std::string str(size_t n) {
+	std::ostringstream s;
+	s << n;
+	return s.str();
+}
+
+// n dependent operations on one element, seed makes the source unique
+static m::ExpressionRef chain(const std::shared_ptr<m::BuffArgument<cl_float>> &b, size_t n, float seed=0) {
+	m::ExpressionRef v = m::select(b, m::get_global_id(0));
+	m::ExpressionRef e = v;
+	for(size_t i=0; i<n; i++)
+		e = m::sin(e) * m::cnst<cl_float>(seed + 1.0f/(i+1)) + v;
+	return m::set(m::select(b, m::get_global_id(0)), e);
+}
+
+static void codegen(std::vector<Result> &r, const mcl::Context &) {
+	for(size_t n=16; n<=1024; n*=4) {
+		auto b = m::argv<cl_float>();
+		m::ExpressionRef e = chain(b, n);
+		r.push_back(Result("codegen/chain_" + str(n), "ms", false, measure([&e]() { e->build(); })));
+	}
+}
+
+static void compile(std::vector<Result> &r, const mcl::Context &c) {
+	for(size_t n=16; n<=256; n*=16) {
+		// a unique source for every run of measure, generated up front so only the build is timed
+		std::vector<mcl::Program> programs;
+		for(size_t i=0; i<=repeat; i++) {
+			auto b = m::argv<cl_float>();
+			programs.push_back(mcl::Program(c, chain(b, n, float(i))->build()));
+		}
+		size_t next = 0;
+		r.push_back(Result("compile/chain_" + str(n), "ms", false, measure([&]() { programs[next++].build(); })));
+	}
+}
+
+static void transfer(std::vector<Result> &r, const mcl::Context &c, mcl::Queue &q) {
+	for(size_t sz = 1 << 16; sz <= 1 << 24; sz <<= 4) {
+		std::vector<char> host(sz, 1);
+		for(int pinned=0; pinned<2; pinned++) {
+			mcl::Buffer b = pinned ? c.buffer_host(sz) : c.buffer(sz);
+			std::string kind = pinned ? "host" : "device";
+			double mb = sz/double(1 << 20);
+			double w = measure([&]() { q.mov(host.data(), b).finish(); });
+			double rd = measure([&]() { q.mov(b, host.data()).finish(); });
+			r.push_back(Result("mov/write_" + kind + "_" + str(sz), "MB/s", true, mb/(w/1000)));
+			r.push_back(Result("mov/read_" + kind + "_" + str(sz), "MB/s", true, mb/(rd/1000)));
+		}
+	}
+}
+
+static void kernels(std::vector<Result> &r, const mcl::Context &c, mcl::Queue &q) {
+	const size_t items = 1 << 22;
+	// every run reads the same input, results go to a buffer of their own
+	mcl::Buffer in = c.buffer(items*sizeof(cl_float)), out = c.buffer(items*sizeof(cl_float));
+	std::vector<cl_float> init(items, 0.5f);
+	q.mov(init, in).finish();
+	typedef std::function<m::ExpressionRef(const m::ExpressionRef &)> op_t;
+	std::vector<std::pair<std::string, op_t>> ops;
+	ops.push_back(std::make_pair("add", op_t([](const m::ExpressionRef &v) { return v + m::cnst<cl_float>(1); })));
+	ops.push_back(std::make_pair("mad", op_t([](const m::ExpressionRef &v) { return m::mad(v, m::cnst<cl_float>(0.5f), m::cnst<cl_float>(0.25f)); })));
+	ops.push_back(std::make_pair("clamp", op_t([](const m::ExpressionRef &v) { return m::clamp(v, m::cnst<cl_float>(0), m::cnst<cl_float>(1)); })));
+	ops.push_back(std::make_pair("sin", op_t([](const m::ExpressionRef &v) { return m::sin(v); })));
+	ops.push_back(std::make_pair("exp", op_t([](const m::ExpressionRef &v) { return m::exp(v); })));
+	ops.push_back(std::make_pair("pow", op_t([](const m::ExpressionRef &v) { return m::pow(v, m::cnst<cl_float>(2.2f)); })));
+	for(auto i = ops.begin(); i!=ops.end(); i++) {
+		m::ExpressionRef id = m::get_global_id(0);
+		m::ExpressionRef e = m::set(m::select(m::argv<cl_float>(out), id), i->second(m::select(m::argv<cl_float>(in), id)));
+		mcl::Program p(c, e->build());
+		p.build();
+		mcl::Kernel k = p.kernel("main_kernel");
+		e->set_arguments(k);
+		double ms = measure([&]() { q.task(k, items).finish(); });
+		r.push_back(Result("kernel/" + i->first, "Mitems/s", true, items/1e6/(ms/1000)));
+	}
+}
+
+static std::string json_string(const std::string &v) {
+	std::ostringstream s;
+	for(auto i = v.begin(); i!=v.end(); i++) {
+		unsigned char ch = *i;
+		if(ch=='"' || ch=='\\')
+			s << '\\' << *i;
+		else if(ch<0x20) {
+			static const char hex[] = "0123456789abcdef";
+			s << "\\u00" << hex[ch >> 4] << hex[ch & 15];
+		} else
+			s << *i;
+	}
+	return s.str();
+}
+
+static void write_json(std::ostream &s, const std::string &device, const std::vector<Result> &r) {
+	s << "{" << std::endl;
+	s << "\t\"device\": \"" << json_string(device) << "\"," << std::endl;
+	s << "\t\"repeat\": " << repeat << "," << std::endl;
+	s << "\t\"results\": [" << std::endl;
+	for(size_t i=0; i<r.size(); i++) {
+		s << "\t\t{\"name\": \"" << r[i].name << "\", \"unit\": \"" << r[i].unit << "\", \"better\": \""
+			<< (r[i].higher_better ? "higher" : "lower") << "\", \"value\": " << r[i].value << "}" << (i+1<r.size() ? "," : "") << std::endl;
+	}
+	s << "\t]" << std::endl;
+	s << "}" << std::endl;
+}
+
+static std::string field(const std::string &line, const std::string &key) {
+	size_t k = line.find("\"" + key + "\":");
+	if(k==std::string::npos)
+		return "";
+	size_t b = line.find_first_not_of(" \"", k + key.size() + 3), e = line.find_first_of("\",}", b);
+	return b==std::string::npos ? "" : line.substr(b, e-b);
+}
+
+// results written by write_json, one per line
+static std::vector<Result> read_json(std::istream &s) {
+	std::vector<Result> r;
+	for(std::string line; std::getline(s, line);)
+		if(line.find("\"name\":")!=std::string::npos)
+			r.push_back(Result(field(line, "name"), field(line, "unit"), field(line, "better")=="higher", std::atof(field(line, "value").c_str())));
+	return r;
+}
+
+// prints the change of every result, false if one got worse by more than threshold percent
+static bool compare(const std::vector<Result> &base, const std::vector<Result> &cur, double threshold) {
+	bool ok = true;
+	for(auto c = cur.begin(); c!=cur.end(); c++) {
+		auto b = base.begin();
+		while(b!=base.end() && b->name!=c->name)
+			b++;
+		if(b==base.end() || b->value==0) {
+			std::cout << c->name << ": " << c->value << " " << c->unit << " (new)" << std::endl;
+			continue;
+		}
+		double change = (c->value - b->value)/b->value*100;
+		bool worse = c->higher_better ? change < -threshold : change > threshold;
+		std::cout << c->name << ": " << b->value << " -> " << c->value << " " << c->unit << " (" << (change>=0 ? "+" : "") << change << "%)"
+			<< (worse ? " REGRESSION" : "") << std::endl;
+		ok = ok && !worse;
+	}
+	return ok;
+}
+
+int main(int argc, char **argv) {
+	int device = -1;
+	double threshold = 10;
+	std::string out, baseline;
+	for(int i=1; i<argc; i++) {
+		std::string a = argv[i];
+		if(a=="--device" && i+1<argc)
+			device = std::atoi(argv[++i]);
+		else if(a=="--repeat" && i+1<argc)
+			repeat = std::max(std::atoi(argv[++i]), 1);
+		else if(a=="--out" && i+1<argc)
+			out = argv[++i];
+		else if(a=="--compare" && i+1<argc)
+			baseline = argv[++i];
+		else if(a=="--threshold" && i+1<argc)
+			threshold = std::atof(argv[++i]);
+		else {
+			std::cerr << "usage: img_cl_bench [--device N] [--repeat N] [--out FILE] [--compare BASELINE] [--threshold PERCENT]" << std::endl;
+			return 2;
+		}
+	}
+	try {
+		std::vector<mcl::Device> devs;
+		const std::vector<mcl::Platform> &platforms = mcl::Platform::platforms();
+		for(auto p = platforms.begin(); p!=platforms.end(); p++) {
+			std::vector<mcl::Device> d = p->devices();
+			devs.insert(devs.end(), d.begin(), d.end());
+		}
+		if(device<0) // the first CPU device keeps runs comparable between machines
+			for(size_t i=0; i<devs.size() && device<0; i++)
+				if(devs[i].is_cpu())
+					device = i;
+		if(devs.empty() || device>=int(devs.size())) {
+			std::cerr << "no OpenCL device" << std::endl;
+			return 1;
+		}
+		mcl::Device d = devs[std::max(device, 0)];
+		mcl::Context c(d);
+		mcl::Queue q(c, d, false);
+		
+		std::vector<Result> r;
+		codegen(r, c);
+		compile(r, c);
+		transfer(r, c, q);
+		kernels(r, c, q);
+		
+		if(out.empty() && baseline.empty())
+			write_json(std::cout, d.name(), r);
+		else if(!out.empty()) {
+			std::ofstream f(out.c_str());
+			write_json(f, d.name(), r);
+		}
+		if(!baseline.empty()) {
+			std::ifstream f(baseline.c_str());
+			if(!f) {
+				std::cerr << "cannot open " << baseline << std::endl;
+				return 1;
+			}
+			return compare(read_json(f), r, threshold) ? 0 : 1;
+		}
+	} catch(const mcl::Error &e) {
+		std::cerr << "error: " << e.code() << ": " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
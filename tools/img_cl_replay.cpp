@@ -0,0 +1,95 @@
+// replays a captured command stream: img_cl_replay [--device N] [--repeat N] [--all] capture
+
+#include "mcl/mcl.hpp"
+#include <map>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+
+struct Total {
+	size_t count;
+	size_t bytes;
+	size_t items;
+	double ms;
+	Total() : count(0), bytes(0), items(0), ms(0) {}
+};
+
+int main(int argc, char **argv) {
+	int device = -1;
+	size_t repeat = 1;
+	bool all = false;
+	std::string file;
+	for(int i=1; i<argc; i++) {
+		std::string a = argv[i];
+		if(a=="--device" && i+1<argc)
+			device = std::atoi(argv[++i]);
+		else if(a=="--repeat" && i+1<argc)
+			repeat = std::max(std::atoi(argv[++i]), 1);
+		else if(a=="--all")
+			all = true;
+		else if(file.empty() && a[0]!='-')
+			file = a;
+		else {
+			file.clear();
+			break;
+		}
+	}
+	if(file.empty()) {
+		std::cerr << "usage: img_cl_replay [--device N] [--repeat N] [--all] capture" << std::endl;
+		return 2;
+	}
+	try {
+		mcl::Replay replay(file);
+		std::vector<mcl::Device> devs;
+		const std::vector<mcl::Platform> &platforms = mcl::Platform::platforms();
+		for(auto p = platforms.begin(); p!=platforms.end(); p++) {
+			std::vector<mcl::Device> d = p->devices();
+			devs.insert(devs.end(), d.begin(), d.end());
+		}
+		if(device<0)
+			for(size_t i=0; i<devs.size() && device<0; i++)
+				if(devs[i].is_cpu())
+					device = i;
+		if(devs.empty() || device>=int(devs.size())) {
+			std::cerr << "no OpenCL device" << std::endl;
+			return 1;
+		}
+		mcl::Device d = devs[std::max(device, 0)];
+		mcl::Context c(d);
+		std::cout << file << ": " << replay.records() << " records on " << d.name() << std::endl;
+		
+		for(size_t run=0; run<repeat; run++) {
+			replay.run(c, d);
+			const std::vector<mcl::Replay::Command> &cmds = replay.commands();
+			std::map<std::string, Total> totals;
+			double ms = 0;
+			for(size_t i=0; i<cmds.size(); i++) {
+				const mcl::Replay::Command &cmd = cmds[i];
+				std::string key = std::string(mcl::Replay::op_name(cmd.op)) + (cmd.name.empty() ? "" : " " + cmd.name);
+				Total &t = totals[key];
+				t.count++;
+				t.bytes += cmd.bytes;
+				t.items += cmd.items;
+				t.ms += cmd.ms;
+				ms += cmd.ms;
+				if(all)
+					std::cout << std::setw(8) << i << "  " << std::setw(10) << std::fixed << std::setprecision(3) << cmd.ms << " ms  " << key << std::endl;
+			}
+			std::cout << "run " << run+1 << ": " << std::fixed << std::setprecision(3) << ms << " ms" << std::endl;
+			for(auto t = totals.begin(); t!=totals.end(); t++) {
+				std::cout << "\t" << t->first << ": " << t->second.count << " x, " << t->second.ms << " ms";
+				if(t->second.bytes && t->second.ms>0)
+					std::cout << ", " << t->second.bytes/1048576.0/(t->second.ms/1000) << " MB/s";
+				if(t->second.items && t->second.ms>0)
+					std::cout << ", " << t->second.items/1e6/(t->second.ms/1000) << " Mitems/s";
+				std::cout << std::endl;
+			}
+		}
+	} catch(const mcl::Error &e) {
+		std::cerr << "error: " << e.code() << ": " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}